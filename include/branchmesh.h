@@ -0,0 +1,64 @@
+#ifndef BRANCHMESH_H
+#define BRANCHMESH_H
+
+#include "geometry.h"
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Indexed triangle mesh of a plant's stems
+struct BranchMesh {
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::vec3> colors;
+    std::vector<uint32_t> indices;      // Triangles, counter-clockwise from outside
+
+    size_t getVertexCount() const { return positions.size(); }
+    size_t getTriangleCount() const { return indices.size() / 3; }
+
+    void clear() {
+        positions.clear();
+        normals.clear();
+        colors.clear();
+        indices.clear();
+    }
+};
+
+// Welds turtle cylinders into generalized cylinders. Of the later segments
+// starting exactly where a segment ends, the best-aligned one continues its
+// chain and shares the ring there (across brackets, so F[+F]F is one tube
+// with a side branch); the others start chains of their own. Ring frames
+// are parallel-transported along the chain so the surface doesn't twist,
+// and joints use the bisector of the two directions.
+// Each chain of k segments costs (k + 1) rings instead of 2k.
+class BranchMeshBuilder {
+public:
+    BranchMeshBuilder();
+
+    // Vertices per ring (at least 3); the unit ring table is rebuilt here
+    void setRadialSegments(int segments);
+    int getRadialSegments() const { return static_cast<int>(ringCos_.size()); }
+    void setThreadCount(int threads) { threadCount_ = threads; } // 0 = all cores
+
+    // Rebuild `mesh` from `cylinders`; chains are meshed concurrently
+    void build(const SegmentBuffer& cylinders, BranchMesh& mesh);
+
+private:
+    // A run of welded segments: kept_[first, first + count)
+    struct Chain {
+        uint32_t first;
+        uint32_t count;
+        size_t vertexOffset;
+        size_t indexOffset;
+    };
+
+    std::vector<float> ringCos_;
+    std::vector<float> ringSin_;
+    int threadCount_;
+    std::vector<Chain> chains_;
+    std::vector<uint32_t> kept_;        // Cylinders long enough to mesh
+
+    void buildChain(const SegmentBuffer& cylinders, const Chain& chain, BranchMesh& mesh) const;
+};
+
+#endif // BRANCHMESH_H
@@ -0,0 +1,117 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "geometry.h"
+#include <vector>
+#include <cstdint>
+#include <cfloat>
+#include <glm/glm.hpp>
+
+// A cylinder or leaf of the indexed buffers
+struct PrimitiveRef {
+    enum Kind : uint8_t { Segment, Leaf };
+    Kind kind;
+    uint32_t index;     // Into the SegmentBuffer or LeafBuffer
+};
+
+// Nearest hit of a ray
+struct RayHit {
+    float distance;     // Along the ray, in units of its direction's length
+    glm::vec3 point;
+    PrimitiveRef primitive;
+    uint32_t symbol;    // Source symbol index, or kNoSymbol
+};
+
+// Six planes (normal, offset) facing inward: a point p is inside when
+// dot(normal, p) + offset >= 0 for every plane
+struct Frustum {
+    glm::vec4 planes[6];
+
+    // Planes of the clip volume -w <= x, y, z <= w of an OpenGL
+    // projection * view matrix
+    static Frustum fromMatrix(const glm::mat4& viewProjection);
+
+    // -1 if the box is outside a plane, 1 if inside all of them, else 0
+    int classify(const glm::vec3& min, const glm::vec3& max) const;
+};
+
+// Bounding volume hierarchy over the cylinders and leaves of a plant, with
+// the same shapes the renderer draws: open cylinders and the leaf triangle.
+// Built top-down by binned SAH; the top levels are split serially and the
+// subtrees below them built concurrently. The buffers passed to build() are
+// referenced, not copied, and must outlive the queries.
+class PlantBVH {
+public:
+    PlantBVH();
+
+    void build(const SegmentBuffer& segments, const LeafBuffer& leaves);
+    void clear();
+
+    // Recompute bounds bottom-up for buffers with the same primitives in new
+    // places (turtle parameter edits), keeping the tree. Returns false, and
+    // leaves the tree untouched, when the counts differ from the last build.
+    bool refit(const SegmentBuffer& segments, const LeafBuffer& leaves);
+
+    bool empty() const { return nodes_.empty(); }
+    size_t getNodeCount() const { return nodes_.size(); }
+    glm::vec3 getMinBounds() const { return nodes_.empty() ? glm::vec3(0.0f) : nodes_[0].min; }
+    glm::vec3 getMaxBounds() const { return nodes_.empty() ? glm::vec3(0.0f) : nodes_[0].max; }
+
+    void setThreadCount(int threads) { threadCount_ = threads; } // 0 = all cores
+
+    // Nearest primitive along origin + t * direction, 0 < t < maxDistance
+    bool intersect(const glm::vec3& origin, const glm::vec3& direction, RayHit& hit,
+                   float maxDistance = FLT_MAX) const;
+
+    // Append every primitive whose bounding box overlaps the box, or is not
+    // entirely outside one frustum plane
+    void query(const glm::vec3& minBounds, const glm::vec3& maxBounds, std::vector<PrimitiveRef>& out) const;
+    void query(const Frustum& frustum, std::vector<PrimitiveRef>& out) const;
+
+private:
+    // Leaves hold primitives_[first, first + count); interior nodes have
+    // count 0 and children at first and first + 1, always after the parent
+    struct Node {
+        glm::vec3 min;
+        uint32_t first;
+        glm::vec3 max;
+        uint32_t count;
+    };
+
+    // Nodes [begin, end) below one top-level node, built by one task
+    struct Subtree {
+        uint32_t begin;
+        uint32_t end;
+    };
+
+    struct BuildItem {
+        uint32_t node;
+        uint32_t begin;
+        uint32_t end;
+        uint32_t depth;
+    };
+
+    std::vector<Node> nodes_;
+    std::vector<uint32_t> primitives_;      // Ids: segments first, then leaves
+    std::vector<glm::vec3> primitiveMin_;   // Bounds by id
+    std::vector<glm::vec3> primitiveMax_;
+    std::vector<Subtree> subtrees_;
+    size_t segmentCount_;
+    size_t leafCount_;
+    const SegmentBuffer* segments_;
+    const LeafBuffer* leaves_;
+    int threadCount_;
+
+    void computeBounds();
+    void buildNodes(std::vector<Node>& nodes, BuildItem root, size_t deferBelow,
+                    std::vector<BuildItem>* deferred);
+    uint32_t partition(uint32_t begin, uint32_t end, const glm::vec3& centroidMin,
+                       const glm::vec3& centroidMax);
+    void refitNodes(uint32_t begin, uint32_t end);
+    void collect(uint32_t node, std::vector<PrimitiveRef>& out) const;
+    bool intersectPrimitive(uint32_t id, const glm::vec3& origin, const glm::vec3& direction,
+                            float maxDistance, float& t) const;
+    PrimitiveRef toRef(uint32_t id) const;
+};
+
+#endif // BVH_H
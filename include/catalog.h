@@ -0,0 +1,196 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include "lsystem.h"
+#include "parametric.h"
+#include "turtle.h"
+#include "instancing.h"
+#include "plantlod.h"
+#include "presetlibrary.h"
+#include "softwarerenderer.h"
+#include "image.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+// Headless catalog rendering, shared by plant_modeler --headless and the
+// GL-free plant_renderer. Nothing here touches GL, GLFW or imgui; each
+// program supplies its own backends.
+
+// Past the symbol budget generate() clamps the iteration count, but the
+// turtle can still take the full derivation as it streams, never holding
+// the string, while the geometry it draws stays under a byte budget
+bool shouldStream(const LSystem& lsystem, const Turtle& turtle, const GenerationStats& prediction);
+
+// Auto-center the camera on the plant root while keeping the whole plant in
+// view; Backend is Renderer or SoftwareRenderer
+template <typename Backend>
+void frameCamera(Backend& renderer, const Turtle& turtle, float targetOffsetX) {
+    glm::vec3 minBounds = turtle.getMinBounds();
+    glm::vec3 maxBounds = turtle.getMaxBounds();
+    glm::vec3 size = maxBounds - minBounds;
+    glm::vec3 rootPosition = turtle.getRootPosition();
+    glm::vec3 rootTarget(rootPosition.x, rootPosition.y, rootPosition.z);
+    float horizontalSpan = std::max(size.x, size.z);
+    float dominantSpan = std::max(horizontalSpan, size.y);
+    
+    // Set camera to look at the root while keeping the entire plant in view
+    const float targetOffsetY = 0.0f; // CUSTOMIZATION: shift to raise/lower root framing
+    renderer.cameraTarget_ = rootTarget + glm::vec3(targetOffsetX, targetOffsetY, 0.0f);
+    const float zoomTightness = 1.85f; // CUSTOMIZATION: raise/lower to change auto zoom framing
+    const float minZoom = 3.0f;        // CUSTOMIZATION: lowest camera distance allowed on regen
+    renderer.cameraDistance = std::max(dominantSpan * zoomTightness, minZoom);
+    renderer.cameraRotationX = 25.0f;
+    renderer.cameraRotationY = 45.0f;
+}
+
+// Command line of the headless catalog renderer
+struct HeadlessOptions {
+    std::string outputDir = "renders";
+    std::string format = "png";
+    int width = 1024;
+    int height = 1024;
+    int iterations = 4;
+    bool software = false;              // CPU rasterizer instead of GL
+    bool instanced = false;             // Shared subtrees, without tropism
+    bool parametric = false;            // The parametric grammars instead of the presets
+    int threads = 0;                    // Software rasterizer threads, 0 = all cores
+    std::vector<std::string> presets;   // Empty: all presets
+    bool overrideCamera = false;
+    float cameraDistance = 0.0f;
+    float cameraPitch = 0.0f;
+    float cameraYaw = 0.0f;
+};
+
+// False on a malformed command line
+bool parseHeadlessOptions(int argc, char** argv, bool& headless, HeadlessOptions& options);
+
+// How an instanced plant was drawn, for the catalog log and the UI. The GL
+// overload is defined with plant_modeler's main, so this header stays GL-free
+class Renderer;
+const char* instancedPath(const Renderer& renderer);
+const char* instancedPath(const SoftwareRenderer& renderer);
+
+// Render each requested preset with the interactive defaults and its own
+// turtle parameters, one image per preset, reusing one context throughout.
+// The log names how instanced plants were drawn via instancedPath(renderer)
+template <typename Backend>
+int renderCatalog(Backend& renderer, const HeadlessOptions& options) {
+    if (!renderer.initializeHeadless(options.width, options.height)) {
+        return -1;
+    }
+    
+    LSystem lsystem;
+    lsystem.setSymbolBudget(64u << 20);
+    Turtle turtle;
+    turtle.setMergeStraightRuns(true);
+    ParametricLSystem parametric;
+    InstancedPlant instancedPlant;
+    PlantLOD plantLOD;
+    
+    PresetLibrary presetLibrary;
+    if (PresetLibrary::compile("presets/plants.lsys", "build/plants.lsyb") &&
+        presetLibrary.open("build/plants.lsyb")) {
+        lsystem.setPresetLibrary(&presetLibrary);
+    }
+    std::vector<std::string> available = options.parametric ? parametric.getAvailablePresets()
+                                                             : lsystem.getAvailablePresets();
+    const std::vector<std::string>& presets = options.presets.empty() ? available : options.presets;
+    
+    std::error_code error;
+    std::filesystem::create_directories(options.outputDir, error);
+    
+    int failures = 0;
+    for (const std::string& name : presets) {
+        // loadPreset falls back to a default grammar for names it doesn't know
+        if (std::find(available.begin(), available.end(), name) == available.end()) {
+            std::cerr << "Unknown preset " << name << std::endl;
+            ++failures;
+            continue;
+        }
+        auto started = std::chrono::steady_clock::now();
+        
+        // Same defaults as the interactive UI, overridden by the preset
+        PresetTurtle params;
+        if (presetLibrary.isOpen()) presetLibrary.getTurtle(name, params);
+        turtle.setAngle(params.mask & PresetTurtle::Angle ? params.angle : 25.0f);
+        turtle.setStepLength(params.mask & PresetTurtle::StepLength ? params.stepLength : 0.5f);
+        turtle.setStepWidth(params.mask & PresetTurtle::StepWidth ? params.stepWidth : 0.05f);
+        turtle.setLengthScale(params.mask & PresetTurtle::LengthScale ? params.lengthScale : 0.9f);
+        turtle.setWidthScale(params.mask & PresetTurtle::WidthScale ? params.widthScale : 0.7f);
+        turtle.setTropism(options.instanced ? glm::vec3(0.0f)
+                          : params.mask & PresetTurtle::Tropism
+                          ? glm::vec3(params.tropism[0], params.tropism[1], params.tropism[2])
+                          : glm::vec3(0.0f, -0.1f, 0.0f));
+        turtle.set3DMode(true);
+        
+        bool instanced = false;
+        if (options.parametric) {
+            // Module parameters scale the turtle's steps, angles and widths
+            parametric.loadPreset(name);
+            turtle.interpret(parametric.generate(options.iterations));
+        } else {
+            lsystem.loadPreset(name);
+            const std::string& derived = lsystem.generate(options.iterations);
+            bool streamed = shouldStream(lsystem, turtle, lsystem.predict(options.iterations));
+            int depth = streamed ? options.iterations : lsystem.getIterations();
+            instanced = options.instanced && turtle.interpretInstanced(lsystem, depth, instancedPlant);
+            if (!instanced) {
+                if (streamed) {
+                    turtle.interpret(lsystem, depth);
+                } else {
+                    turtle.interpret(derived);
+                }
+            }
+        }
+        plantLOD.clear();
+        if (!instanced) {
+            plantLOD.build(turtle.getSegments(), turtle.getLeaves(), turtle.getMinBounds(), turtle.getMaxBounds());
+        }
+        
+        // No UI panel to make room for, so no horizontal nudge
+        frameCamera(renderer, turtle, 0.0f);
+        if (options.overrideCamera) {
+            renderer.cameraDistance = options.cameraDistance;
+            renderer.cameraRotationX = options.cameraPitch;
+            renderer.cameraRotationY = options.cameraYaw;
+        }
+        renderer.updateCamera(0.0f);
+        
+        renderer.beginFrame();
+        if (instanced) {
+            renderer.render(instancedPlant);
+        } else {
+            renderer.render(plantLOD);
+        }
+        renderer.endFrame();
+        
+        std::string file = name;
+        for (char& c : file) {
+            c = std::isalnum(static_cast<unsigned char>(c)) ? std::tolower(static_cast<unsigned char>(c)) : '_';
+        }
+        std::string path = (std::filesystem::path(options.outputDir) / (file + "." + options.format)).string();
+        Image image;
+        if (!renderer.readImage(image) || !writeImage(path, image)) {
+            ++failures;
+            continue;
+        }
+        
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        std::cout << path << " (" << image.width << "x" << image.height << ", " << seconds * 1000.0 << " ms";
+        if (instanced) {
+            std::cout << ", " << instancedPlant.getPrototypes().size() << " shared subtrees via " << instancedPath(renderer);
+        }
+        std::cout << ")" << std::endl;
+    }
+    
+    renderer.shutdown();
+    return failures > 0 ? 1 : 0;
+}
+
+#endif // CATALOG_H
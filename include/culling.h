@@ -0,0 +1,85 @@
+#ifndef CULLING_H
+#define CULLING_H
+
+#include "bvh.h"
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// 30-bit Morton code of a point in [0, 1]^3; sorting by it groups nearby
+// primitives into compact clusters
+inline uint32_t mortonCode(const glm::vec3& unit) {
+    auto spread = [](float value) {
+        uint32_t x = static_cast<uint32_t>(std::min(std::max(value * 1024.0f, 0.0f), 1023.0f));
+        x = (x | (x << 16)) & 0x030000FF;
+        x = (x | (x << 8)) & 0x0300F00F;
+        x = (x | (x << 4)) & 0x030C30C3;
+        x = (x | (x << 2)) & 0x09249249;
+        return x;
+    };
+    return spread(unit.x) << 2 | spread(unit.y) << 1 | spread(unit.z);
+}
+
+// Solid cylinder that may hide geometry behind it
+struct Occluder {
+    glm::vec3 start;
+    glm::vec3 end;
+    float radius;
+};
+
+// What became of the clusters tested since begin()
+struct CullStats {
+    size_t tested;
+    size_t outsideFrustum;
+    size_t subPixel;
+    size_t occluded;
+
+    size_t drawn() const { return tested - outsideFrustum - subPixel - occluded; }
+};
+
+// Per-frame cluster culling against a camera: boxes outside the frustum,
+// boxes under a pixel on screen, and boxes behind occluders in a coarse
+// depth buffer. Occluders are rasterized conservatively (a cell takes an
+// occluder's far depth only where the occluder covers all of it) into cells
+// of kCellSize pixels, with a max-depth pyramid above them so a box tests a
+// few cells at whatever size it has on screen.
+class ClusterCuller {
+public:
+    static const int kCellSize = 8;
+
+    ClusterCuller();
+
+    // viewProjection maps world to clip space for a viewport of width x
+    // height pixels; focalPixels is the pixel size of one unit at unit depth
+    void begin(const glm::mat4& viewProjection, int width, int height, float focalPixels);
+
+    // Replace the occlusion buffer's contents (empty: nothing is occluded)
+    void setOccluders(const std::vector<Occluder>& occluders);
+    void setOcclusionEnabled(bool enabled) { occlusionEnabled_ = enabled; }
+
+    bool isVisible(const glm::vec3& minBounds, const glm::vec3& maxBounds);
+
+    const CullStats& getStats() const { return stats_; }
+
+private:
+    glm::mat4 viewProjection_;
+    Frustum frustum_;
+    int width_;
+    int height_;
+    float focalPixels_;
+    bool occlusionEnabled_;
+    bool hasOccluders_;
+    CullStats stats_;
+
+    // Eye depth per cell, finest level first; each level halves the last
+    std::vector<std::vector<float>> levels_;
+    std::vector<int> levelWidths_;
+    std::vector<int> levelHeights_;
+
+    bool project(const glm::vec3& point, float& x, float& y, float& depth) const;
+    void rasterizeOccluder(const Occluder& occluder);
+    bool isOccluded(float minX, float minY, float maxX, float maxY, float nearDepth) const;
+};
+
+#endif // CULLING_H
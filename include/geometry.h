@@ -0,0 +1,120 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <glm/glm.hpp>
+
+// Symbol index of geometry that doesn't come from a position in an
+// interpreted string, such as flattened instances
+static const uint32_t kNoSymbol = UINT32_MAX;
+
+// Exact-position hash; joints repeat bit-for-bit in turtle output. Round
+// coordinates have all-zero low mantissa bits, so the result is mixed into
+// the high bits as well and any of its bits can index a table
+struct PointHash {
+    size_t operator()(const glm::vec3& p) const {
+        uint32_t bits[3];
+        std::memcpy(bits, &p, sizeof(bits));
+        uint64_t h = (bits[0] * 73856093ull) ^ (bits[1] * 19349663ull) ^ (bits[2] * 83492791ull);
+        h *= 0x9E3779B97F4A7C15ull;
+        return static_cast<size_t>(h ^ (h >> 32));
+    }
+};
+
+// Stem segments as parallel streams: cylinders in 3D mode, lines in 2D.
+// clear() keeps capacity, so a buffer reused across regenerations stops
+// allocating once it has seen the largest plant.
+struct SegmentBuffer {
+    std::vector<glm::vec3> positions;   // Start and end of segment i at 2i and 2i + 1 (GL_LINES order)
+    std::vector<float> radii;           // Cylinder radius, or line width in 2D
+    std::vector<glm::vec3> colors;
+    std::vector<uint32_t> symbols;      // Index of the F/G that drew it in the interpreted string
+
+    static const size_t kBytesPerSegment = 3 * sizeof(glm::vec3) + sizeof(float) + sizeof(uint32_t);
+
+    size_t size() const { return radii.size(); }
+    bool empty() const { return radii.empty(); }
+    const glm::vec3& start(size_t i) const { return positions[2 * i]; }
+    const glm::vec3& end(size_t i) const { return positions[2 * i + 1]; }
+
+    void clear() {
+        positions.clear();
+        radii.clear();
+        colors.clear();
+        symbols.clear();
+    }
+
+    void reserve(size_t count) {
+        positions.reserve(2 * count);
+        radii.reserve(count);
+        colors.reserve(count);
+        symbols.reserve(count);
+    }
+
+    void resize(size_t count) {
+        positions.resize(2 * count);
+        radii.resize(count);
+        colors.resize(count);
+        symbols.resize(count);
+    }
+
+    void push(const glm::vec3& start, const glm::vec3& end, float radius, const glm::vec3& color,
+              uint32_t symbol = kNoSymbol) {
+        positions.push_back(start);
+        positions.push_back(end);
+        radii.push_back(radius);
+        colors.push_back(color);
+        symbols.push_back(symbol);
+    }
+};
+
+// Leaves as parallel streams
+struct LeafBuffer {
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<float> sizes;
+    std::vector<glm::vec3> colors;
+    std::vector<uint32_t> symbols;      // Index of the L that drew it
+
+    static const size_t kBytesPerLeaf = 3 * sizeof(glm::vec3) + sizeof(float) + sizeof(uint32_t);
+
+    size_t size() const { return sizes.size(); }
+    bool empty() const { return sizes.empty(); }
+
+    void clear() {
+        positions.clear();
+        normals.clear();
+        sizes.clear();
+        colors.clear();
+        symbols.clear();
+    }
+
+    void reserve(size_t count) {
+        positions.reserve(count);
+        normals.reserve(count);
+        sizes.reserve(count);
+        colors.reserve(count);
+        symbols.reserve(count);
+    }
+
+    void resize(size_t count) {
+        positions.resize(count);
+        normals.resize(count);
+        sizes.resize(count);
+        colors.resize(count);
+        symbols.resize(count);
+    }
+
+    void push(const glm::vec3& position, const glm::vec3& normal, float size, const glm::vec3& color,
+              uint32_t symbol = kNoSymbol) {
+        positions.push_back(position);
+        normals.push_back(normal);
+        sizes.push_back(size);
+        colors.push_back(color);
+        symbols.push_back(symbol);
+    }
+};
+
+#endif // GEOMETRY_H
@@ -0,0 +1,31 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// 8-bit RGB pixels, rows top to bottom
+struct Image {
+    int width;
+    int height;
+    std::vector<uint8_t> pixels;
+
+    Image() : width(0), height(0) {}
+    Image(int w, int h) : width(w), height(h), pixels(static_cast<size_t>(w) * h * 3, 0) {}
+
+    uint8_t* row(int y) { return pixels.data() + static_cast<size_t>(y) * width * 3; }
+    const uint8_t* row(int y) const { return pixels.data() + static_cast<size_t>(y) * width * 3; }
+};
+
+// Binary PPM (P6)
+bool writePPM(const std::string& path, const Image& image);
+
+// PNG, deflated at zlib's fastest level: catalog renders are written far
+// more often than they are read
+bool writePNG(const std::string& path, const Image& image);
+
+// PPM for a ".ppm" path, PNG otherwise
+bool writeImage(const std::string& path, const Image& image);
+
+#endif // IMAGE_H
@@ -0,0 +1,114 @@
+#ifndef INSTANCING_H
+#define INSTANCING_H
+
+#include "turtle.h"
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Placement of geometry relative to a parent frame: a point p in the child's
+// local frame lands at origin + frame * p; radii and leaf sizes scale by
+// widthScale
+struct InstanceTransform {
+    glm::vec3 origin;
+    glm::mat3 frame;      // Columns: left, direction, up (times length scale)
+    float widthScale;
+
+    InstanceTransform() : origin(0.0f), frame(1.0f), widthScale(1.0f) {}
+
+    InstanceTransform operator*(const InstanceTransform& child) const {
+        InstanceTransform result;
+        result.origin = origin + frame * child.origin;
+        result.frame = frame * child.frame;
+        result.widthScale = widthScale * child.widthScale;
+        return result;
+    }
+};
+
+// A prototype instantiated inside another prototype
+struct InstanceRef {
+    uint32_t prototype;
+    InstanceTransform transform;
+};
+
+// Geometry of one symbol expanded for `depth` generations, in the local frame
+// of a turtle starting from the default TurtleState
+struct Prototype {
+    char symbol;                      // 0 for the root (the axiom)
+    int depth;                        // Generations expanded
+
+    SegmentBuffer cylinders;
+    LeafBuffer leaves;
+    std::vector<InstanceRef> children;
+
+    // Turtle state after the expansion, relative to the default start state
+    TurtleState end;
+
+    // Local bounds including children (conservative: child boxes are
+    // transformed corner by corner, except for the root, whose bounds are
+    // fitted to its placed geometry), and fully expanded primitive counts
+    glm::vec3 minBounds;
+    glm::vec3 maxBounds;
+    size_t totalCylinders;
+    size_t totalLeaves;
+};
+
+// Plant stored as a DAG of shared prototypes instead of flat geometry;
+// built by Turtle::interpretInstanced
+class InstancedPlant {
+public:
+    InstancedPlant();
+
+    void clear();
+
+    // Changes whenever the plant is cleared or rebuilt
+    uint64_t getVersion() const { return version_; }
+    
+    const std::vector<Prototype>& getPrototypes() const { return prototypes_; }
+    const Prototype& getRoot() const { return prototypes_[root_]; }
+    bool empty() const { return prototypes_.empty(); }
+
+    // Visit every placed prototype with its world transform, depth-first in
+    // interpretation order: fn(const Prototype&, const InstanceTransform&)
+    template <typename Fn>
+    void forEachInstance(Fn&& fn) const {
+        if (prototypes_.empty()) return;
+        visit(root_, InstanceTransform(), fn);
+    }
+
+    // Expand into world-space geometry (same primitives interpret() yields,
+    // though not in the same order)
+    void flatten(SegmentBuffer& cylinders, LeafBuffer& leaves) const;
+
+    size_t getCylinderCount() const { return empty() ? 0 : getRoot().totalCylinders; }
+    size_t getLeafCount() const { return empty() ? 0 : getRoot().totalLeaves; }
+    size_t getPlacementCount() const;
+
+    glm::vec3 getMinBounds() const { return empty() ? glm::vec3(0.0f) : getRoot().minBounds; }
+    glm::vec3 getMaxBounds() const { return empty() ? glm::vec3(0.0f) : getRoot().maxBounds; }
+    glm::vec3 getRootPosition() const;
+
+private:
+    friend class Turtle;
+
+    std::vector<Prototype> prototypes_;
+    uint32_t root_;
+    uint64_t version_;
+
+    // Refit the root's box to its transformed points, skipping subtrees
+    // whose conservative boxes are already inside
+    void fitRootBounds();
+    void fitBounds(uint32_t index, const InstanceTransform& transform,
+                   glm::vec3& minBounds, glm::vec3& maxBounds) const;
+
+    template <typename Fn>
+    void visit(uint32_t index, const InstanceTransform& transform, Fn& fn) const {
+        const Prototype& prototype = prototypes_[index];
+        fn(prototype, transform);
+        for (const auto& child : prototype.children) {
+            visit(child.prototype, transform * child.transform, fn);
+        }
+    }
+};
+
+#endif // INSTANCING_H
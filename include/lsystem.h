@@ -4,6 +4,10 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <deque>
+#include <list>
+#include <array>
+#include <cstdint>
 #include <random>
 
 // Structure to represent a production rule
@@ -17,6 +21,55 @@ struct Rule {
     }
 };
 
+// Context-sensitive production: left < predecessor > right -> successor
+struct ContextRule {
+    std::string left;       // Matched right to left from the predecessor; may be empty
+    char predecessor;
+    std::string right;      // Matched left to right; may be empty
+    std::string successor;
+};
+
+// Compiled dispatch entry for one symbol byte
+struct CompiledRule {
+    enum Kind : uint8_t { Identity, Deterministic, Stochastic, Contextual };
+    
+    Kind kind;
+    uint32_t first;   // Deterministic: successor id; Stochastic: first alias entry;
+                      // Contextual: first entry in the compiled context rules
+    uint32_t count;   // Stochastic: number of productions (alias table size);
+                      // Contextual: number of context rules
+    
+    CompiledRule() : kind(Identity), first(0), count(0) {}
+};
+
+// One column of a Walker/Vose alias table
+struct AliasEntry {
+    float threshold;    // Keep `primary` if the coin lands below this
+    uint32_t primary;   // Successor id
+    uint32_t alias;     // Successor id taken otherwise
+};
+
+// Size of a generation predicted from the rule set alone
+struct GenerationStats {
+    int iterations;
+    bool exact;                         // False for stochastic/context rules (expected values)
+    double length;                      // Symbols in the string
+    std::array<double, 256> histogram;  // Occurrences per symbol byte
+    double segments;                    // F and G: one cylinder (3D) or line (2D) each
+    double leaves;                      // L
+    double stringBytes;                 // The string, plus cached generations if caching
+    int bracketDepth;                   // Deepest '[' nesting (an upper bound unless exact)
+};
+
+class PresetLibrary;
+
+// Receives derived symbols in order, one run at a time
+class SymbolSink {
+public:
+    virtual ~SymbolSink() = default;
+    virtual void consume(const char* symbols, size_t count) = 0;
+};
+
 // L-System class for procedural plant generation
 class LSystem {
 public:
@@ -29,30 +82,135 @@ public:
     void addStochasticRule(char predecessor, const std::string& successor, float probability);
     void clearRules();
     
+    // Context-sensitive rule "left < predecessor > right -> successor". Contexts
+    // skip over bracketed branches and ignored symbols; a symbol's left context
+    // continues into its parent branch. Context rules for a symbol are tried in
+    // insertion order before its context-free rule (or identity).
+    void addContextRule(const std::string& left, char predecessor,
+                        const std::string& right, const std::string& successor);
+    void setContextIgnore(const std::string& symbols);
+    bool hasContextRules() const { return !contextRules_.empty(); }
+    
     // Generation
-    std::string generate(int iterations);
+    const std::string& generate(int iterations);
     void reset();
     
+    // Streaming derivation: expands the axiom depth-first and feeds the final
+    // generation to `sink` without materializing any generation. Peak memory
+    // grows with `iterations`, not with string length. Produces exactly the
+    // string generate(iterations) would; the current string is left untouched.
+    // Context-sensitive rule sets need whole generations and fall back to
+    // generate() followed by a single consume(). The symbol budget bounds
+    // materialized strings only, so it does not limit derive() otherwise.
+    void derive(int iterations, SymbolSink& sink);
+    
+    // Stochastic picks are a pure function of (seed, generation, symbol index),
+    // so a given seed reproduces the same plant for any thread count
+    void setSeed(uint64_t seed) { seed_ = seed; keyDirty_ = true; }
+    uint64_t getSeed() const { return seed_; }
+    void setThreadCount(int threads) { threadCount_ = threads; } // 0 = all cores
+    int getThreadCount() const { return threadCount_; }
+    
+    // Derivation cache: every generation computed so far is kept per
+    // (axiom, rule set, seed), so raising the iteration count applies only the
+    // missing rewrite steps and revisiting a grammar costs nothing
+    void setCacheEnabled(bool enabled);
+    bool isCacheEnabled() const { return cacheEnabled_; }
+    void clearCache();
+    
+    // Closed-form statistics from powers of the production count matrix
+    // (entry [t][s] = occurrences of t in the successor of s). Never derives
+    // anything, so it is safe to call for iteration counts that would not fit.
+    GenerationStats predict(int iterations) const;
+    
+    // Upper limit on the length of any generated string (a symbol is one
+    // byte; 0 = unlimited). generate() checks it against a conservative
+    // projection before allocating and clamps the iteration count instead of
+    // exceeding it; getIterations() then reports the clamped count.
+    void setSymbolBudget(size_t symbols) { symbolBudget_ = symbols; }
+    size_t getSymbolBudget() const { return symbolBudget_; }
+    bool wasClamped() const { return clamped_; }
+    
+    // Rule queries
+    bool isDeterministic() const;                       // No stochastic or context rules
+    const std::string* getSuccessor(char symbol) const; // Deterministic successor, or nullptr
+    
     // Getters
     std::string getAxiom() const { return axiom_; }
-    std::string getCurrentString() const { return currentString_; }
+    const std::string& getCurrentString() const { return *current_; }
     int getIterations() const { return currentIterations_; }
     
-    // Predefined plant presets
+    // Predefined plant presets. With a library set, names resolve there first
+    // and getAvailablePresets() lists its entries; the built-in presets remain
+    // as a fallback. The library must outlive this L-system.
+    void setPresetLibrary(const PresetLibrary* library) { library_ = library; }
     void loadPreset(const std::string& presetName);
     std::vector<std::string> getAvailablePresets() const;
     
 private:
+    // All generations derived so far for one (axiom, rule set, seed) key
+    struct CachedDerivation {
+        uint64_t key;
+        std::deque<std::string> generations;  // Deque keeps references stable on growth
+    };
+    
     std::string axiom_;
     std::string currentString_;
+    std::string scratchString_;     // Back buffer, swapped with currentString_ each generation
+    const std::string* current_;    // currentString_ or a cached generation
     std::map<char, Rule> rules_;
     int currentIterations_;
     
-    std::mt19937 rng_;
-    std::uniform_real_distribution<float> dist_;
+    // Rules compiled into a flat table indexed by symbol byte, rebuilt
+    // lazily after the rule set changes
+    std::array<CompiledRule, 256> dispatch_;
+    std::string successorPool_;                        // All successors back to back
+    std::vector<std::pair<uint32_t, uint32_t>> successors_; // (offset, length) into the pool
+    std::vector<AliasEntry> aliasTable_;
+    bool rulesDirty_;
+    
+    // Context-sensitive rules; compiled entries keep the context-free fallback
+    // of their symbol in contextFallback_
+    std::vector<ContextRule> contextRules_;
+    std::array<bool, 256> contextIgnore_;
+    std::vector<std::pair<const ContextRule*, uint32_t>> compiledContext_; // (rule, successor id)
+    std::array<CompiledRule, 256> contextFallback_;
+    
+    // Per-generation context tables: index of the nearest left/right context
+    // symbol of every position, or kNoContext
+    std::vector<uint32_t> leftContext_;
+    std::vector<uint32_t> rightContext_;
+    
+    uint64_t seed_;
+    int threadCount_;
+    std::vector<size_t> chunkOffsets_;                 // Per-chunk output offsets (prefix sum)
+    
+    size_t symbolBudget_;
+    bool clamped_;
+    const PresetLibrary* library_;
+    
+    std::list<CachedDerivation> cache_;                // Most recently used first
+    bool cacheEnabled_;
+    bool keyDirty_;
+    uint64_t key_;
     
-    std::string applyRules(const std::string& input);
-    char applyRule(char symbol);
+    void compileRules();
+    void productionMatrices(std::vector<unsigned char>& alphabet, std::vector<double>& expected,
+                            std::vector<double>& upper, std::vector<double>& axiomCounts) const;
+    int clampToBudget(int iterations) const;
+    int bracketDepth(int iterations) const;
+    uint64_t derivationKey();
+    CachedDerivation& cachedDerivation();
+    uint32_t addSuccessor(const std::string& successor);
+    void buildAliasTable(const Rule& rule, CompiledRule& entry);
+    uint32_t sampleProduction(const CompiledRule& entry, uint32_t generation, uint64_t index) const;
+    void buildContextTables(const std::string& input);
+    bool matchesContext(const ContextRule& rule, const std::string& input, size_t index) const;
+    uint32_t selectSuccessor(const CompiledRule& entry, const std::string& input, size_t index,
+                             uint32_t generation) const;
+    size_t measureRange(const std::string& input, size_t begin, size_t end, uint32_t generation) const;
+    void writeRange(const std::string& input, size_t begin, size_t end, uint32_t generation, char* out) const;
+    void applyRules(const std::string& input, std::string& output, uint32_t generation);
 };
 
 #endif // LSYSTEM_H
@@ -0,0 +1,159 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Number of hardware threads, never less than one
+inline int hardwareThreadCount() {
+    unsigned int count = std::thread::hardware_concurrency();
+    return count > 0 ? static_cast<int>(count) : 1;
+}
+
+// Resolve a requested thread count (0 = all hardware threads)
+inline int resolveThreadCount(int requested) {
+    return requested > 0 ? requested : hardwareThreadCount();
+}
+
+// Run fn(task) for every task in [0, taskCount) on up to threadCount threads
+// (0 = all hardware threads). Tasks are claimed dynamically, so uneven tasks
+// still balance; the calling thread works too. Runs inline when only one
+// thread or one task is involved.
+template <typename Fn>
+void parallelFor(size_t taskCount, int threadCount, Fn&& fn) {
+    size_t workers = std::min(static_cast<size_t>(resolveThreadCount(threadCount)), taskCount);
+    if (workers <= 1) {
+        for (size_t task = 0; task < taskCount; ++task) {
+            fn(task);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t task = next++; task < taskCount; task = next++) {
+            fn(task);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(workers - 1);
+    for (size_t i = 1; i < workers; ++i) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// parallelFor on threads that outlive the call, for callers that run many
+// short loops back to back (a renderer's batches) where starting and joining
+// threads each time would cost as much as the work. Workers start on the
+// first run that needs them and sleep between runs; one run at a time.
+class ThreadPool {
+public:
+    ThreadPool() : threadCount_(0), taskCount_(0), invoke_(nullptr), context_(nullptr),
+                   generation_(0), active_(0), stopping_(false) {}
+    ~ThreadPool() { stop(); }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // 0 = all hardware threads; running workers are replaced on the next run
+    void setThreadCount(int threads) {
+        if (threads == threadCount_) return;
+        stop();
+        threadCount_ = threads;
+    }
+    int getThreadCount() const { return threadCount_; }
+
+    // As parallelFor(taskCount, getThreadCount(), fn)
+    template <typename Fn>
+    void parallelFor(size_t taskCount, Fn&& fn) {
+        size_t threads = static_cast<size_t>(resolveThreadCount(threadCount_));
+        if (std::min(threads, taskCount) <= 1) {
+            for (size_t task = 0; task < taskCount; ++task) {
+                fn(task);
+            }
+            return;
+        }
+        // No run is in progress, so new workers wait for the next generation
+        while (workers_.size() < threads - 1) {
+            uint64_t seen = generation_;
+            workers_.emplace_back([this, seen]() { workerLoop(seen); });
+        }
+
+        typedef typename std::remove_reference<Fn>::type Body;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            taskCount_ = taskCount;
+            next_ = 0;
+            invoke_ = [](void* context, size_t task) { (*static_cast<Body*>(context))(task); };
+            context_ = &fn;
+            active_ = workers_.size();
+            ++generation_;
+        }
+        wake_.notify_all();
+        work();
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this]() { return active_ == 0; });
+    }
+
+private:
+    int threadCount_;
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_;      // A run started, or stop()
+    std::condition_variable done_;      // The last worker left the run
+
+    // The current run, written under mutex_ before generation_ moves on
+    size_t taskCount_;
+    std::atomic<size_t> next_;
+    void (*invoke_)(void*, size_t);
+    void* context_;
+    uint64_t generation_;
+    size_t active_;                     // Workers still in the run
+    bool stopping_;
+
+    void work() {
+        for (size_t task = next_++; task < taskCount_; task = next_++) {
+            invoke_(context_, task);
+        }
+    }
+
+    void workerLoop(uint64_t seen) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            wake_.wait(lock, [&]() { return stopping_ || generation_ != seen; });
+            if (stopping_) return;
+            seen = generation_;
+            lock.unlock();
+            work();
+            lock.lock();
+            if (--active_ == 0) done_.notify_one();
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+        workers_.clear();
+        stopping_ = false;
+    }
+};
+
+#endif // PARALLEL_H
@@ -0,0 +1,115 @@
+#ifndef PARAMETRIC_H
+#define PARAMETRIC_H
+
+#include <string>
+#include <vector>
+#include <array>
+#include <map>
+#include <cstdint>
+
+// Packed parametric module string: one byte per module plus a shared float
+// parameter array. Module i owns params[offsets[i] .. offsets[i + 1]).
+struct ModuleString {
+    std::string symbols;
+    std::vector<uint32_t> offsets;
+    std::vector<float> params;
+
+    ModuleString() : offsets(1, 0) {}
+
+    size_t size() const { return symbols.size(); }
+    size_t paramCount(size_t i) const { return offsets[i + 1] - offsets[i]; }
+    const float* paramsOf(size_t i) const { return params.data() + offsets[i]; }
+
+    void clear() {
+        symbols.clear();
+        offsets.assign(1, 0);
+        params.clear();
+    }
+
+    void append(char symbol, const float* values, size_t count) {
+        symbols.push_back(symbol);
+        params.insert(params.end(), values, values + count);
+        offsets.push_back(static_cast<uint32_t>(params.size()));
+    }
+
+    // Text form, e.g. "A(1,0.5)F(2)[+B]"
+    std::string toString() const;
+};
+
+// Stack-machine opcodes for compiled parameter expressions and guards
+enum class OpCode : uint8_t {
+    PushConst, PushParam,
+    Add, Sub, Mul, Div, Pow, Neg,
+    Less, Greater, LessEqual, GreaterEqual, Equal, NotEqual,
+    And, Or, Not
+};
+
+struct Instruction {
+    OpCode op;
+    uint32_t index;   // PushParam: predecessor parameter
+    float value;      // PushConst: literal
+};
+
+// Parametric L-system: rules such as "A(l,w) : l > 0.1 -> F(l)[+A(l*0.7,w)]".
+// Guards and successor expressions are compiled once into bytecode when the
+// rule is added; rewriting only runs the bytecode.
+class ParametricLSystem {
+public:
+    ParametricLSystem();
+
+    // Named constants usable in axiom and rule expressions; define before use
+    void setConstant(const std::string& name, float value) { constants_[name] = value; }
+
+    // Setup methods; return false (and log) on a parse error
+    bool setAxiom(const std::string& axiom);
+    bool addRule(const std::string& rule);
+    void clearRules();
+
+    // Generation
+    const ModuleString& generate(int iterations);
+    const ModuleString& getCurrentString() const { return current_; }
+    int getIterations() const { return currentIterations_; }
+
+    void loadPreset(const std::string& presetName);
+    std::vector<std::string> getAvailablePresets() const;
+
+private:
+    // A compiled expression: a slice of code_
+    struct Expression {
+        uint32_t first;
+        uint32_t count;
+    };
+
+    struct SuccessorModule {
+        char symbol;
+        uint32_t firstExpression;   // Slice of expressions_
+        uint32_t expressionCount;
+    };
+
+    struct CompiledRule {
+        uint32_t arity;
+        int32_t condition;          // Index into expressions_, -1 = always
+        uint32_t firstModule;       // Slice of modules_
+        uint32_t moduleCount;
+        uint32_t paramTotal;        // Parameters emitted by one application
+    };
+
+    ModuleString axiom_;
+    ModuleString current_;
+    ModuleString scratch_;
+    int currentIterations_;
+
+    std::map<std::string, float> constants_;
+    std::vector<Instruction> code_;
+    std::vector<Expression> expressions_;
+    std::vector<SuccessorModule> modules_;
+    std::vector<CompiledRule> rules_;
+    std::array<std::vector<uint32_t>, 256> rulesBySymbol_;  // Rule indices in priority order
+    std::vector<int32_t> choices_;                          // Matched rule per module (-1 = none)
+
+    float evaluate(const Expression& expression, const float* params) const;
+    int32_t matchRule(char symbol, const float* params, size_t count) const;
+    void applyRules(const ModuleString& input, ModuleString& output);
+};
+
+#endif // PARAMETRIC_H
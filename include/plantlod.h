@@ -0,0 +1,54 @@
+#ifndef PLANTLOD_H
+#define PLANTLOD_H
+
+#include "geometry.h"
+#include "branchmesh.h"
+#include <vector>
+
+// One representation of a plant. Every simplification applied stays within
+// `error` world units of the full-detail geometry.
+struct LODLevel {
+    float error;            // World-space error bound (0 for full detail)
+    int radialSegments;     // Ring resolution of the branch mesh
+    SegmentBuffer cylinders;
+    LeafBuffer leaves;
+    BranchMesh mesh;
+};
+
+// Chain of progressively coarser representations built from turtle output.
+// Level k > 0 gets a tolerance of kBaseError * 4^(k - 1) of the plant size and
+// uses it three ways: the fewest ring segments whose polygon stays within it
+// on the thickest stem, merging runs of welded segments whose inner joints
+// lie within it of the merged axis, and dropping twigs whose whole subtree
+// fits inside it around the twig's base.
+class PlantLOD {
+public:
+    static const int kLevelCount = 4;
+    static constexpr float kBaseError = 0.002f;
+
+    PlantLOD();
+
+    void build(const SegmentBuffer& cylinders, const LeafBuffer& leaves,
+               const glm::vec3& minBounds, const glm::vec3& maxBounds);
+    void clear();
+
+    size_t getLevelCount() const { return levels_.size(); }
+    uint64_t getVersion() const { return version_; }    // Changes on every build() and clear()
+    const LODLevel& getLevel(size_t index) const { return levels_[index]; }
+
+    // Coarsest level whose error projects to at most `maxPixels`, given the
+    // pixels one world unit covers at the plant
+    size_t selectLevel(float pixelsPerUnit, float maxPixels) const;
+
+    void setThreadCount(int threads) { builder_.setThreadCount(threads); } // 0 = all cores
+
+private:
+    std::vector<LODLevel> levels_;
+    BranchMeshBuilder builder_;
+    uint64_t version_;
+
+    static void simplify(const SegmentBuffer& cylinders, const LeafBuffer& leaves,
+                         float tolerance, LODLevel& level);
+};
+
+#endif // PLANTLOD_H
@@ -0,0 +1,105 @@
+#ifndef PRESETLIBRARY_H
+#define PRESETLIBRARY_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+class LSystem;
+
+// One production of a grammar file entry
+struct PresetRule {
+    std::string left;           // Context; empty if none
+    char predecessor;
+    std::string right;
+    std::string successor;
+    float probability;          // < 0 for a deterministic rule
+};
+
+// Turtle parameters a preset may set; `mask` tells which ones it does
+struct PresetTurtle {
+    enum Field : uint32_t {
+        Angle = 1, StepLength = 2, StepWidth = 4,
+        LengthScale = 8, WidthScale = 16, Tropism = 32
+    };
+
+    uint32_t mask;
+    float angle;
+    float stepLength;
+    float stepWidth;
+    float lengthScale;
+    float widthScale;
+    float tropism[3];
+
+    PresetTurtle() : mask(0), angle(25.0f), stepLength(0.5f), stepWidth(0.05f),
+                     lengthScale(0.9f), widthScale(0.7f), tropism{0.0f, 0.0f, 0.0f} {}
+};
+
+// A parsed grammar file entry
+struct PresetDefinition {
+    std::string name;
+    std::string axiom;
+    std::string ignore;         // Symbols skipped by context matching
+    std::vector<PresetRule> rules;
+    PresetTurtle turtle;
+};
+
+// Library of plant presets. Grammars are written in a text format, one
+// statement per line; a word starting with '#' comments out the rest:
+//
+//   preset "Fractal Tree"
+//   axiom X
+//   rule X -> F[+X][-X]FX        # deterministic
+//   rule F 0.5 -> F[+F]F         # stochastic, with its weight
+//   rule 0 < 1 > 0 -> 1          # context-sensitive, either context optional
+//   ignore +-F                   # symbols context matching skips
+//   angle 25                     # also step, width, length_scale,
+//   end                          # width_scale and tropism x y z
+//
+// and compiled into a flat binary file that open() memory-maps. The binary
+// keeps a name-sorted index, so find()/apply() are a binary search plus a few
+// reads; nothing is parsed at start-up and entries load only when applied.
+class PresetLibrary {
+public:
+    PresetLibrary();
+    ~PresetLibrary();
+
+    PresetLibrary(const PresetLibrary&) = delete;
+    PresetLibrary& operator=(const PresetLibrary&) = delete;
+
+    // Text format; return false (and log the line) on a syntax error
+    static bool parse(const std::string& text, std::vector<PresetDefinition>& presets);
+    static bool parseFile(const std::string& path, std::vector<PresetDefinition>& presets);
+
+    // Write presets in the binary format (native byte order)
+    static bool write(const std::vector<PresetDefinition>& presets, const std::string& path);
+
+    // Compile a text grammar file unless the binary is already newer
+    static bool compile(const std::string& textPath, const std::string& binaryPath);
+
+    // Map a compiled library; the previous one is released
+    bool open(const std::string& path);
+    void close();
+    bool isOpen() const { return data_ != nullptr; }
+
+    // Entries in grammar file order; names are read straight from the mapping
+    size_t size() const;
+    std::string getName(size_t index) const;
+    std::vector<std::string> getNames() const;
+
+    // Entry index by name, or -1
+    long find(const std::string& name) const;
+
+    // Replace the axiom and rules of `lsystem` with the named entry; optionally
+    // return its turtle parameters. Returns false if the name is unknown.
+    bool apply(const std::string& name, LSystem& lsystem, PresetTurtle* turtle = nullptr) const;
+    bool getTurtle(const std::string& name, PresetTurtle& turtle) const;
+
+private:
+    const unsigned char* data_;
+    size_t size_;
+
+    const char* text(uint32_t offset) const { return reinterpret_cast<const char*>(data_) + offset; }
+};
+
+#endif // PRESETLIBRARY_H
@@ -1,7 +1,13 @@
 #ifndef RENDERER_H
 #define RENDERER_H
 
-#include "Turtle.h"
+#include "turtle.h"
+#include "instancing.h"
+#include "branchmesh.h"
+#include "plantlod.h"
+#include "image.h"
+#include "culling.h"
+#include "scene.h"
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
 
@@ -13,49 +19,195 @@ public:
     bool initialize(int width, int height, const char* title);
     void shutdown();
     
+    // Render into an offscreen framebuffer of the given size, with no UI
+    // panel, from a hidden window. Falls back to OSMesa where GLFW has it
+    // and no display is available
+    bool initializeHeadless(int width, int height);
+    bool isHeadless() const { return headless_; }
+    
+    // Copy the last frame's 3D viewport
+    bool readImage(Image& image) const;
+    
     // Camera controls
     void setCamera(const glm::vec3& position, const glm::vec3& target, const glm::vec3& up);
     void updateCamera(float deltaTime);
     void resetCamera();
     
-    // Rendering
+    // Rendering. Turtle and PlantLOD geometry is uploaded to vertex/index
+    // buffers the first time it is drawn after a regeneration and redrawn
+    // from there, a few calls per geometry class per frame.
     void beginFrame();
     void endFrame();
     void render(const Turtle& turtle);
+    void render(const InstancedPlant& plant);       // GPU instancing when available
+    
+    // Draw the coarsest level whose error covers at most lodPixelError
+    // pixels at cameraDistance
+    void render(const PlantLOD& lod);
+    size_t getSelectedLOD() const { return selectedLOD_; }
+    
+    // Draw every instance of a scene: instances are culled whole, each picks
+    // its own level of detail, and instances sharing a geometry and level
+    // are drawn back to back from one set of buffers
+    void render(const Scene& scene);
+    size_t getSceneInstancesDrawn() const { return sceneInstancesDrawn_; }
+    size_t getSceneTrianglesDrawn() const { return sceneTrianglesDrawn_; }
+    
+    // Whether InstancedPlant is drawn with instanced calls (known after its
+    // first draw); otherwise it is flattened into retained buffers
+    bool isGpuInstancing() const { return instanceProgram_ != 0; }
+    float getPixelsPerUnit() const;
+    
+    // World-space ray through a cursor position in window coordinates;
+    // false outside the 3D viewport
+    bool getViewRay(double x, double y, glm::vec3& origin, glm::vec3& direction) const;
     
     // Window management
     bool shouldClose() const;
     GLFWwindow* getWindow() const { return window_; }
-    void setSceneOffset(const glm::vec3& offset);
+    void setSceneOffset(const glm::vec3& offset) { sceneOffset_ = offset; }    // Moves everything drawn
     glm::vec3 getSceneOffset() const { return sceneOffset_; }
     
+    // Clusters skipped and drawn since beginFrame()
+    const CullStats& getCullStats() const { return culler_.getStats(); }
+    
     // Camera parameters
     float cameraDistance;
     float cameraRotationX;
     float cameraRotationY;
     bool autoRotate;
     glm::vec3 cameraTarget_;
+    float lodPixelError;
+    
+    // Retained geometry is split into spatial clusters; with cullingEnabled
+    // those outside the view or under a pixel are skipped, and with
+    // occlusionCulling also those behind a plant's thickest branches
+    bool cullingEnabled;
+    bool occlusionCulling;
     
 private:
     GLFWwindow* window_;
     int width_;
     int height_;
+    bool headless_;
+    GLuint framebuffer_;                // Headless render target, 0 for the window's
+    GLuint colorRenderbuffer_;
+    GLuint depthRenderbuffer_;
     
     glm::vec3 cameraPos_;
     glm::vec3 cameraUp_;
     glm::vec3 sceneOffset_;
+    glm::mat4 view_;                    // As loaded by beginFrame()
+    glm::mat4 projection_;              // As loaded by setupProjection()
+    ClusterCuller culler_;
     
     // Mouse state
     double lastMouseX_;
     double lastMouseY_;
     bool mousePressed_;
     
+    size_t selectedLOD_;
+    
+    // Interleaved vertex of the retained buffers
+    struct GpuVertex {
+        glm::vec3 position;
+        glm::vec3 normal;
+        glm::vec3 color;
+    };
+    
+    // Index range drawn with one call, and the box around it; lines are
+    // grouped by width
+    struct GpuBatch {
+        float lineWidth;
+        size_t first;
+        size_t count;
+        glm::vec3 minBounds;            // Set by buildClusters()
+        glm::vec3 maxBounds;
+        
+        GpuBatch() : lineWidth(1.0f), first(0), count(0), minBounds(0.0f), maxBounds(0.0f) {}
+        GpuBatch(float width, size_t first, size_t count)
+            : lineWidth(width), first(first), count(count), minBounds(0.0f), maxBounds(0.0f) {}
+    };
+    
+    // Geometry held in GL buffers, valid while its source (an object's
+    // address and version) is unchanged
+    struct GpuMesh {
+        const void* source;
+        uint64_t version;
+        GLuint vertexBuffer;
+        GLuint indexBuffer;
+        glm::vec3 baseColor;            // Ambient material is taken from it
+        std::vector<GpuBatch> batches;  // Spatial clusters after buildClusters()
+        std::vector<Occluder> occluders;
+        
+        GpuMesh() : source(nullptr), version(0), vertexBuffer(0), indexBuffer(0), baseColor(0.0f) {}
+    };
+    
+    GpuMesh stemBuffers_;               // Turtle lines or cylinders
+    GpuMesh leafBuffers_;               // Turtle leaves
+    std::vector<GpuMesh> lodStemBuffers_;   // Per PlantLOD level
+    std::vector<GpuMesh> lodLeafBuffers_;
+    std::vector<GpuVertex> vertexScratch_;  // Staging for uploads, capacity kept
+    std::vector<uint32_t> indexScratch_;
+    
+    // Placement of the unit cylinder or leaf: vertex p of the unit mesh
+    // lands at origin + axes * p
+    struct GpuInstance {
+        glm::vec3 origin;
+        glm::vec3 axes[3];
+        glm::vec3 color;
+    };
+    
+    // Instanced drawing: a vertex shader places one unit cylinder and one
+    // unit leaf per instance (or a scene level's meshes per scene instance)
+    // and lights them like the fixed pipeline
+    bool instancingChecked_;
+    GLuint instanceProgram_;            // 0 when instancing is unavailable
+    GLuint unitVertexBuffer_;           // Unit cylinder, then unit leaf
+    GLuint unitIndexBuffer_;
+    GLuint instanceBuffer_;             // Cylinder instances, then leaf instances
+    GLuint sceneInstanceBuffer_;        // A frame's visible scene instances, in sceneDraws_ order
+    const void* instanceSource_;
+    uint64_t instanceVersion_;
+    size_t cylinderInstances_;
+    size_t leafInstances_;
+    std::vector<GpuInstance> instanceScratch_;
+    std::vector<GpuBatch> cylinderClusters_;    // Ranges of instances, not indices
+    std::vector<GpuBatch> leafClusters_;
+    std::vector<Occluder> instanceOccluders_;
+    
+    // Scene drawing: buffers per geometry and level, and the visible
+    // instances of a frame keyed by (geometry * levels + level, instance)
+    std::vector<GpuMesh> sceneStemBuffers_;
+    std::vector<GpuMesh> sceneLeafBuffers_;
+    std::vector<std::pair<uint32_t, uint32_t>> sceneDraws_;
+    std::vector<GpuInstance> sceneInstanceScratch_;
+    std::vector<Occluder> sceneOccluders_;
+    size_t sceneInstancesDrawn_;
+    size_t sceneTrianglesDrawn_;
+    
+    // Retained-mode helpers
+    void stageLines(const SegmentBuffer& lines, GpuMesh& mesh);
+    void stageCylinders(const SegmentBuffer& cylinders, GpuMesh& mesh);
+    void stageLeaves(const LeafBuffer& leaves, GpuMesh& mesh);
+    void stageBranchMesh(const BranchMesh& branches, GpuMesh& mesh);
+    void buildClusters(GpuMesh& mesh, size_t primitiveIndices);
+    void upload(GpuMesh& mesh, const void* source, uint64_t version);
+    void bindMesh(const GpuMesh& mesh);
+    void unbindMesh();
+    void drawMesh(const GpuMesh& mesh, GLenum mode);
+    void releaseMesh(GpuMesh& mesh);
+    void releaseBuffers();
+    bool createFramebuffer();
+    void setupContext();
+    bool initInstancing();
+    void stageInstances(const InstancedPlant& plant);
+    void clusterInstances(size_t first, size_t count, bool leaves, std::vector<GpuBatch>& clusters);
+    void drawInstances(GLuint vertexBuffer, GLuint indexBuffer, GLuint instances,
+                       size_t first, size_t count, size_t indexFirst, size_t indexCount);
+    void drawInstanceClusters(const std::vector<GpuBatch>& clusters, size_t indexFirst, size_t indexCount);
+    
     // Rendering methods
-    void renderLines(const std::vector<LineSegment>& lines);
-    void renderCylinders(const std::vector<Cylinder>& cylinders);
-    void renderLeaves(const std::vector<Leaf>& leaves);
-    void drawCylinder(const glm::vec3& start, const glm::vec3& end, float radius, const glm::vec3& color);
-    void drawLeaf(const glm::vec3& position, const glm::vec3& normal, float size, const glm::vec3& color);
     void setupLighting();
     void setupProjection();
     
@@ -0,0 +1,116 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "lsystem.h"
+#include "turtle.h"
+#include "plantlod.h"
+#include "culling.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Everything a plant's geometry is generated from; instances with equal keys
+// share one geometry
+struct PlantKey {
+    std::string preset;
+    uint64_t seed;
+    int iterations;
+    float angle;
+    float stepLength;
+    float stepWidth;
+    float lengthScale;
+    float widthScale;
+    glm::vec3 tropism;
+
+    PlantKey();
+    bool operator<(const PlantKey& other) const;
+};
+
+// Generated once per key, in object space with the root at the origin
+struct PlantGeometry {
+    PlantKey key;
+    PlantLOD lod;
+    glm::vec3 minBounds;
+    glm::vec3 maxBounds;
+    size_t triangles;                   // Stems and leaves at full detail
+    std::vector<Occluder> occluders;    // Thickest cylinders, for culling
+};
+
+// A placed plant: geometry scaled, turned about +y and moved to position
+struct SceneInstance {
+    uint32_t geometry;                  // Index into Scene::getGeometries()
+    glm::vec3 position;
+    float rotation;                     // Radians
+    float scale;
+};
+
+// Random placement over the square [-extent, extent]^2 of the ground plane:
+// one plant per cell of a jittered grid, its species drawn from `species`
+// and its seed from `seedsPerSpecies` variants of each
+struct ScatterOptions {
+    size_t count;
+    float extent;
+    float height;                   // Each geometry is scaled to this height first (0 = as generated)
+    float minScale;                 // Then by a random factor in [minScale, maxScale]
+    float maxScale;
+    int seedsPerSpecies;
+    uint64_t seed;
+    std::vector<PlantKey> species;
+
+    ScatterOptions() : count(1000), extent(20.0f), height(3.0f), minScale(0.7f), maxScale(1.3f),
+                       seedsPerSpecies(4), seed(1) {}
+};
+
+// Many plants drawn from a few generated geometries. Geometry is cached by
+// PlantKey (seeds of deterministic grammars collapse to one key), so a
+// forest of thousands of instances generates only its distinct species.
+class Scene {
+public:
+    Scene();
+
+    // Grammars resolve here first, as in LSystem::setPresetLibrary()
+    void setPresetLibrary(const PresetLibrary* library) { lsystem_.setPresetLibrary(library); }
+
+    // Index of the geometry for key, generating it on first use
+    uint32_t acquire(const PlantKey& key);
+    void addInstance(uint32_t geometry, const glm::vec3& position, float rotation, float scale);
+
+    // Replace the instances with a scattered population. Geometry of keys
+    // still in use is kept; the rest is dropped, so changing parameters
+    // doesn't accumulate species
+    void scatter(const ScatterOptions& options);
+    void clearInstances();
+    void clear();                       // Instances and geometry
+
+    const std::vector<std::unique_ptr<PlantGeometry>>& getGeometries() const { return geometries_; }
+    const std::vector<SceneInstance>& getInstances() const { return instances_; }
+    size_t getTriangleCount() const { return triangles_; }  // Over all instances, full detail
+    glm::vec3 getMinBounds() const { return minBounds_; }
+    glm::vec3 getMaxBounds() const { return maxBounds_; }
+    uint64_t getVersion() const { return version_; }        // Changes when geometry is dropped
+
+    // Where an instance puts a point of its geometry
+    static glm::vec3 transform(const SceneInstance& instance, const glm::vec3& point);
+
+    // World-space box of an instance
+    void getInstanceBounds(const SceneInstance& instance, glm::vec3& minBounds, glm::vec3& maxBounds) const;
+
+private:
+    LSystem lsystem_;
+    Turtle turtle_;
+    std::map<PlantKey, uint32_t> cache_;
+    std::vector<std::unique_ptr<PlantGeometry>> geometries_;
+    std::vector<SceneInstance> instances_;
+    size_t triangles_;
+    glm::vec3 minBounds_;
+    glm::vec3 maxBounds_;
+    uint64_t version_;
+
+    // Drop geometries not in `used`, renumbering `used` to match
+    void dropUnused(std::vector<uint32_t>& used);
+};
+
+#endif // SCENE_H
@@ -0,0 +1,126 @@
+#ifndef SOFTWARERENDERER_H
+#define SOFTWARERENDERER_H
+
+#include "turtle.h"
+#include "instancing.h"
+#include "branchmesh.h"
+#include "plantlod.h"
+#include "image.h"
+#include "parallel.h"
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// CPU rasterizer with Renderer's camera, projection and lighting, for
+// thumbnails and previews where no usable GL exists. Each draw is processed
+// in batches: primitives are lit, clipped and set up on all cores, binned
+// into screen tiles, and the tiles are filled in parallel with 4-wide edge
+// functions. Bins keep submission order, so the image does not depend on
+// the thread count.
+class SoftwareRenderer {
+public:
+    SoftwareRenderer();
+
+    // Same entry points as Renderer's headless mode; nothing to create
+    bool initializeHeadless(int width, int height);
+    void shutdown() {}
+    bool isHeadless() const { return true; }
+    void setThreadCount(int threads) { pool_.setThreadCount(threads); }  // 0 = all cores
+
+    void updateCamera(float deltaTime);
+    float getPixelsPerUnit() const;
+
+    // Clears the frame; render() calls draw into it in order
+    void beginFrame();
+    void endFrame() {}
+    void render(const Turtle& turtle);
+    void render(const InstancedPlant& plant);
+    void render(const BranchMesh& mesh, const LeafBuffer& leaves);
+    void render(const PlantLOD& lod);
+    size_t getSelectedLOD() const { return selectedLOD_; }
+
+    bool readImage(Image& image) const;
+
+    // Camera parameters, as in Renderer
+    float cameraDistance;
+    float cameraRotationX;
+    float cameraRotationY;
+    glm::vec3 cameraTarget_;
+    float lodPixelError;
+
+private:
+    int width_;
+    int height_;
+    ThreadPool pool_;               // Kept across batches and frames
+    size_t selectedLOD_;
+
+    // View: position, right/up/forward basis and projection scales, set by
+    // beginFrame()
+    glm::vec3 cameraPos_;
+    glm::vec3 right_;
+    glm::vec3 up_;
+    glm::vec3 forward_;
+    glm::vec3 halfVector_;      // Between light and viewer, for specular
+    float projectionX_;
+    float projectionY_;
+    float focalPixels_;         // Pixels one unit covers at unit depth
+
+    // Projected vertex: pixel coordinates (rows downward), window depth,
+    // 1/w and color
+    struct ScreenVertex {
+        float x, y, z, invW;
+        glm::vec3 color;
+    };
+
+    // Triangle ready for filling. Edge i is opposite vertex i; edge and
+    // depth planes are evaluated at integer pixel coordinates (centers
+    // already folded in), edges positive inside
+    struct RasterTriangle {
+        float edgeA[3], edgeB[3], edgeC[3];
+        bool edgeInclusive[3];      // Owns pixels exactly on the edge
+        float depthA, depthB, depthC;
+        float invArea;
+        float invW[3];
+        glm::vec3 color[3];
+        int minX, minY, maxX, maxY; // Covered pixel bounds, on screen
+    };
+
+    // Output of one slice of a batch: its triangles and their tile bins
+    struct Chunk {
+        std::vector<RasterTriangle> triangles;
+        std::vector<uint32_t> binTiles;
+        std::vector<uint32_t> binTriangles;
+    };
+
+    Image color_;
+    std::vector<float> depth_;      // Rows padded to a multiple of 4
+    int depthStride_;
+    int tilesX_;
+    int tilesY_;
+
+    std::vector<Chunk> chunks_;
+    std::vector<uint32_t> tileStart_;               // Per tile, into tileEntries_
+    std::vector<const RasterTriangle*> tileEntries_;
+    std::vector<glm::vec3> litColors_;              // Per mesh vertex
+
+    // Run emit(primitive, chunk) for every primitive and rasterize what it
+    // appends, batch by batch
+    template <typename Emit>
+    void draw(size_t primitiveCount, Emit&& emit);
+    void binChunks(size_t chunkCount);
+    void fillTile(size_t tile);
+
+    glm::vec3 shade(const glm::vec3& normal, const glm::vec3& color, float specular, float shininess) const;
+    void emitTriangle(const glm::vec3 positions[3], const glm::vec3 colors[3], Chunk& chunk) const;
+    void emitCylinder(const glm::vec3& start, const glm::vec3& end, float radius, const glm::vec3& color, Chunk& chunk) const;
+    void emitLeaf(const glm::vec3& position, const glm::vec3& normal, float size, const glm::vec3& color, Chunk& chunk) const;
+    void emitLine(const glm::vec3& start, const glm::vec3& end, float width, const glm::vec3& color, Chunk& chunk) const;
+    ScreenVertex project(const glm::vec3& eye, const glm::vec3& color) const;
+    void setupTriangle(ScreenVertex a, ScreenVertex b, ScreenVertex c, Chunk& chunk) const;
+
+    void renderCylinders(const SegmentBuffer& cylinders);
+    void renderLeaves(const LeafBuffer& leaves);
+    void renderLines(const SegmentBuffer& lines);
+};
+
+#endif // SOFTWARERENDERER_H
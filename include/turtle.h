@@ -2,10 +2,12 @@
 #define TURTLE_H
 
 #include <vector>
-#include <stack>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <string>
+#include "lsystem.h"
+#include "parametric.h"
+#include "geometry.h"
 
 // Structure to represent turtle state
 struct TurtleState {
@@ -15,39 +17,46 @@ struct TurtleState {
     glm::vec3 left;
     float length;
     float width;
-    glm::vec3 color;
+    uint32_t rotations;     // Frame rotations so far, for periodic re-orthonormalization
     
     TurtleState() : position(0.0f), direction(0.0f, 1.0f, 0.0f), 
                     up(0.0f, 0.0f, 1.0f), left(1.0f, 0.0f, 0.0f),
-                    length(1.0f), width(0.1f), color(0.4f, 0.8f, 0.3f) {}
+                    length(1.0f), width(0.1f), rotations(0) {}
 };
 
-// Line segment for 2D/3D rendering
-struct LineSegment {
-    glm::vec3 start;
-    glm::vec3 end;
-    glm::vec3 color;
-    float width;
-};
-
-// Cylinder for 3D rendering
-struct Cylinder {
-    glm::vec3 start;
-    glm::vec3 end;
-    float radius;
-    glm::vec3 color;
+// A derived string compiled for replay under changing turtle parameters:
+// runs of the same command become one entry with a count, symbols without
+// a turtle action are dropped, and each push holds the index of its pop
+struct TurtleProgram {
+    enum Op : uint8_t {
+        Forward, Move, TurnLeft, TurnRight, PitchDown, PitchUp, RollLeft, RollRight,
+        TurnAround, Push, Pop, Leaf, Thinner, Thicker
+    };
+    
+    std::vector<uint8_t> ops;
+    std::vector<uint32_t> args;         // Run length; for Push, the matching Pop (UINT32_MAX if unclosed)
+    std::vector<uint32_t> symbols;      // String index of the run's first symbol
+    size_t segments;                    // F/G count
+    size_t leaves;                      // L count
+    size_t depth;                       // Deepest bracket nesting
+    bool balanced;                      // Every '[' closed, no ']' underflows
+    
+    TurtleProgram() : segments(0), leaves(0), depth(0), balanced(true) {}
+    
+    size_t size() const { return ops.size(); }
+    bool empty() const { return ops.empty(); }
+    void clear();
+    
+    // Replaces the program; false (leaving it empty) if the string is too
+    // long for 32-bit indices
+    bool compile(const char* text, size_t count);
 };
 
-// Leaf for 3D rendering
-struct Leaf {
-    glm::vec3 position;
-    glm::vec3 normal;
-    float size;
-    glm::vec3 color;
-};
+class InstancedPlant;
+struct InstanceTransform;
 
 // Turtle graphics interpreter
-class Turtle {
+class Turtle : public SymbolSink {
 public:
     Turtle();
     ~Turtle();
@@ -60,20 +69,69 @@ public:
     void setWidthScale(float scale) { widthScale_ = scale; }
     void setTropism(const glm::vec3& tropism) { tropism_ = tropism; }
     void set3DMode(bool mode) { mode3D_ = mode; }
+    void setThreadCount(int threads) { threadCount_ = threads; } // 0 = all cores
+    
+    // Draw a straight run of F/G as one segment instead of one per symbol;
+    // the segment takes the symbol index of the run's first F
+    void setMergeStraightRuns(bool merge) { mergeStraightRuns_ = merge; }
+    bool getMergeStraightRuns() const { return mergeStraightRuns_; }
     
     float getAngle() const { return angle_; }
     float getStepLength() const { return stepLength_; }
     float getStepWidth() const { return stepWidth_; }
     bool is3DMode() const { return mode3D_; }
+    int getThreadCount() const { return threadCount_; }
     
-    // Interpret L-system string
+    // Interpret L-system string: it is compiled to a TurtleProgram, which is
+    // then replayed. Long bracket-balanced programs are split at large
+    // branches, which are interpreted concurrently from the state at their
+    // '[' and merged in string order; the result is identical to a serial walk.
     void interpret(const std::string& lsystemString);
+    
+    // Replay the program of the last interpreted string under the current
+    // parameters, without looking at the string again. False if there is
+    // none (the other interpret overloads discard it).
+    bool reinterpret();
+    const TurtleProgram& getProgram() const { return program_; }
+    
     void reset();
     
-    // Get geometry
-    const std::vector<LineSegment>& getLines() const { return lines_; }
-    const std::vector<Cylinder>& getCylinders() const { return cylinders_; }
-    const std::vector<Leaf>& getLeaves() const { return leaves_; }
+    // Pre-size geometry and the state stack (bracket depth); the interpret
+    // overloads do this themselves from a symbol count or the L-system's
+    // prediction. Capacity is kept across reset().
+    void reserve(size_t segments, size_t leaves, size_t depth);
+    
+    // Derive and interpret in one streaming pass, never holding the full string.
+    // Draws what interpret(generate(iterations)) would, so it can go past the
+    // L-system's symbol budget; the app does so when the geometry still fits
+    void interpret(LSystem& lsystem, int iterations);
+    
+    // Interpret a parametric string: the first parameter of F/G/f is the step
+    // (scaled by step length), of + - & ^ \ / the angle in degrees, of ! the width
+    void interpret(const ModuleString& modules);
+    
+    // SymbolSink: interpret more symbols, continuing from the current state.
+    // Runs of F and turns may continue in the next call, as they would in
+    // one string, so the last run is held back until flush()
+    void consume(const char* symbols, size_t count) override;
+    void flush();
+    
+    // Interpret as a DAG of shared subtrees: each (symbol, remaining depth)
+    // expansion is built once in a local frame and placed by rigid transform,
+    // so work and memory grow linearly with iterations. Requires 3D mode, no
+    // tropism, a deterministic rule set and bracket-balanced successors;
+    // returns false (leaving `plant` empty) otherwise. Resets this turtle.
+    bool interpretInstanced(const LSystem& lsystem, int iterations, InstancedPlant& plant);
+    
+    // Bytes the geometry of a predicted generation would take with the
+    // current mode (one line or cylinder per F/G, one leaf per L; an upper
+    // bound when straight runs are merged)
+    double projectedGeometryBytes(const GenerationStats& stats) const;
+    
+    // Get geometry: segments are cylinders in 3D mode, lines in 2D
+    const SegmentBuffer& getSegments() const { return segments_; }
+    const LeafBuffer& getLeaves() const { return leaves_; }
+    uint64_t getGeometryVersion() const { return version_; }   // Changes on every reset()
     
     // Get bounding information
     glm::vec3 getMinBounds() const { return minBounds_; }
@@ -84,7 +142,13 @@ public:
 private:
     // Turtle state
     TurtleState state_;
-    std::stack<TurtleState> stateStack_;
+    std::vector<TurtleState> stateStack_;   // Flat stack; entries past stackDepth_ are spare
+    size_t stackDepth_;
+    size_t symbolIndex_;                    // String index of the symbol being interpreted
+    int runOp_;                             // Run consume() has not drawn yet: opcode,
+    uint32_t runCount_;                     // length (0 = none)
+    size_t runSymbol_;                      // and index of its first symbol
+    TurtleProgram program_;                 // Last interpreted string, compiled
     
     // Parameters
     float angle_;           // Branching angle in degrees
@@ -94,11 +158,22 @@ private:
     float widthScale_;      // Width reduction per level
     glm::vec3 tropism_;     // Gravitational tropism vector
     bool mode3D_;           // 2D or 3D mode
+    int threadCount_;       // Parallel interpretation threads (0 = all cores)
+    bool mergeStraightRuns_; // One segment per straight F run
+    
+    // Cosine and sine of angle_ and of the per-step tropism bend, computed
+    // once in reset() so turning commands are a fixed multiply
+    float angleCos_;
+    float angleSin_;
+    float tropismCos_;
+    float tropismSin_;
+    float tropismBend_;     // Per-step tropism bend in radians
+    bool tropismEnabled_;   // Tropism strong enough to bend at all
     
     // Generated geometry
-    std::vector<LineSegment> lines_;
-    std::vector<Cylinder> cylinders_;
-    std::vector<Leaf> leaves_;
+    SegmentBuffer segments_;
+    LeafBuffer leaves_;
+    uint64_t version_;
     
     // Bounds
     glm::vec3 minBounds_;
@@ -106,25 +181,52 @@ private:
     glm::vec3 lowestPoint_;
     float lowestY_;
     
-    // Turtle commands
-    void moveForward();
-    void turnLeft();
-    void turnRight();
-    void pitchUp();
-    void pitchDown();
-    void rollLeft();
-    void rollRight();
-    void turnAround();
+    // Turtle commands. The templated ones are specialized on 2D/3D mode and
+    // on tropism, so loops built from them test neither per symbol;
+    // execute() and consume() pick an instantiation once per call.
+    void moveForward(float distance);
+    void turn(float angleDeg);
+    void pitch(float angleDeg);
+    void roll(float angleDeg);
+    template <bool Mode3D, bool Tropism> void moveForward(float distance);
+    template <bool Mode3D, bool Tropism> void moveForwardRun(size_t count);
+    template <bool Mode3D> void turnBy(float c, float s);
+    template <bool Mode3D> void pitchBy(float c, float s);
+    template <bool Mode3D> void rollBy(float c, float s);
+    template <bool Mode3D> void turnAround();
     void pushState();
     void popState();
     void drawLeaf();
     void scaleLength(float factor);
     void scaleWidth(float factor);
     
+    // Program replay; runCommand expects symbolIndex_ at the run's first symbol
+    void execute(const TurtleProgram& program, size_t begin, size_t end);
+    template <bool Mode3D, bool Tropism> void executeAs(const TurtleProgram& program, size_t begin, size_t end);
+    template <bool Mode3D, bool Tropism> void consumeAs(const char* symbols, size_t count);
+    template <bool Mode3D, bool Tropism> void flushAs();
+    template <bool Mode3D, bool Tropism> void runCommand(int op, uint32_t count);
+    void runTrig(uint32_t count, float& c, float& s) const;
+    
+    // Parallel interpretation helpers
+    struct InterpretTask;
+    void interpretParallel(const TurtleProgram& program);
+    void interpretTask(InterpretTask& task, const TurtleProgram& program, size_t grain) const;
+    void copyParameters(Turtle& other) const;
+    
+    // Instancing helpers
+    uint32_t buildPrototype(const LSystem& lsystem, char symbol, const std::string& body,
+                            int childDepth, int iterations, InstancedPlant& plant,
+                            std::vector<int32_t>& memo) const;
+    static InstanceTransform stateTransform(const TurtleState& state);
+    static TurtleState applyEndState(const TurtleState& state, const TurtleState& end);
+    
     // Helper methods
+    void reserveFor(const char* symbols, size_t count);
     void updateBounds(const glm::vec3& point);
-    void applyTropism();
-    glm::mat3 getRotationMatrix(const glm::vec3& axis, float angleDeg);
+    template <bool Mode3D> void applyTropism();
+    void countRotation();
+    void orthonormalize();
 };
 
 #endif // TURTLE_H
@@ -20,20 +20,30 @@ fi
 echo ""
 echo "Checking dependencies..."
 
-# Check for GLFW
-if ! brew list glfw &>/dev/null; then
-    echo "GLFW not found. Installing via Homebrew..."
-    brew install glfw
+if [ "$(uname -s)" = "Darwin" ]; then
+    # Check for GLFW
+    if ! brew list glfw &>/dev/null; then
+        echo "GLFW not found. Installing via Homebrew..."
+        brew install glfw
+    else
+        echo "✓ GLFW is installed"
+    fi
+    
+    # Check for GLM
+    if ! brew list glm &>/dev/null; then
+        echo "GLM not found. Installing via Homebrew..."
+        brew install glm
+    else
+        echo "✓ GLM is installed"
+    fi
 else
-    echo "✓ GLFW is installed"
-fi
-
-# Check for GLM
-if ! brew list glm &>/dev/null; then
-    echo "GLM not found. Installing via Homebrew..."
-    brew install glm
-else
-    echo "✓ GLM is installed"
+    # Elsewhere the Makefile uses pkg-config; GLM is header-only
+    if pkg-config --exists glfw3 gl; then
+        echo "✓ GLFW and GL are installed"
+    else
+        echo "GLFW or GL development files not found; install them with your package manager"
+        echo "(e.g. sudo apt install libglfw3-dev libglm-dev libgl-dev zlib1g-dev pkg-config)"
+    fi
 fi
 
 echo ""
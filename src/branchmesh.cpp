@@ -0,0 +1,225 @@
+#include "branchmesh.h"
+#include "parallel.h"
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+
+// Chains per parallel task; most chains are only a few segments long
+static const size_t kChainsPerTask = 256;
+
+// Any unit vector perpendicular to the unit vector v
+static glm::vec3 perpendicular(const glm::vec3& v) {
+    glm::vec3 other = std::fabs(v.x) < 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+    return glm::normalize(glm::cross(v, other));
+}
+
+// Augmenting path: give `from` the first of its options that is free or
+// whose taker can move to another of its own; `seen` marks options tried
+// in this round
+static bool linkSegment(uint32_t from, uint32_t round, const std::vector<uint32_t>& optionBegin,
+                        const std::vector<uint32_t>& options, std::vector<uint32_t>& predecessor,
+                        std::vector<uint32_t>& seen) {
+    for (uint32_t o = optionBegin[from]; o < optionBegin[from + 1]; ++o) {
+        uint32_t to = options[o];
+        if (seen[to] == round) continue;
+        seen[to] = round;
+        if (predecessor[to] == UINT32_MAX ||
+            linkSegment(predecessor[to], round, optionBegin, options, predecessor, seen)) {
+            predecessor[to] = from;
+            return true;
+        }
+    }
+    return false;
+}
+
+BranchMeshBuilder::BranchMeshBuilder() : threadCount_(0) {
+    setRadialSegments(8);
+}
+
+void BranchMeshBuilder::setRadialSegments(int segments) {
+    segments = std::max(segments, 3);
+    ringCos_.resize(segments);
+    ringSin_.resize(segments);
+    for (int i = 0; i < segments; ++i) {
+        float angle = static_cast<float>(i) / segments * 2.0f * static_cast<float>(M_PI);
+        ringCos_[i] = std::cos(angle);
+        ringSin_[i] = std::sin(angle);
+    }
+}
+
+void BranchMeshBuilder::build(const SegmentBuffer& cylinders, BranchMesh& mesh) {
+    chains_.clear();
+    kept_.clear();
+
+    // Segments too short to draw are dropped, as in Renderer::stageCylinders
+    std::vector<uint32_t> segments;
+    segments.reserve(cylinders.size());
+    for (size_t i = 0; i < cylinders.size(); ++i) {
+        if (glm::length(cylinders.end(i) - cylinders.start(i)) >= 0.001f) {
+            segments.push_back(static_cast<uint32_t>(i));
+        }
+    }
+    size_t count = segments.size();
+
+    // Segments starting at each point, listed in buffer order: the first in
+    // an open-addressed table, the rest linked from it
+    const uint32_t none = UINT32_MAX;
+    struct Slot {
+        glm::vec3 point;
+        uint32_t first;
+    };
+    size_t capacity = 16;
+    while (capacity < 2 * count) capacity <<= 1;
+    std::vector<Slot> starts(capacity, Slot{glm::vec3(0.0f), none});
+    std::vector<uint32_t> nextStart(count, none);
+    PointHash hash;
+    auto slotOf = [&](const glm::vec3& point) -> Slot& {
+        size_t slot = hash(point) & (capacity - 1);
+        while (starts[slot].first != none && starts[slot].point != point) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        return starts[slot];
+    };
+    for (size_t k = count; k-- > 0;) {
+        Slot& slot = slotOf(cylinders.start(segments[k]));
+        slot.point = cylinders.start(segments[k]);
+        nextStart[k] = slot.first;
+        slot.first = static_cast<uint32_t>(k);
+    }
+
+    // Turtle output lists a segment before the ones that grow from its end,
+    // so a segment can continue into any later one starting there: its
+    // options, best aligned first and on a tie the later one, which follows
+    // the side branches' brackets
+    std::vector<glm::vec3> directions(count);
+    for (size_t k = 0; k < count; ++k) {
+        directions[k] = glm::normalize(cylinders.end(segments[k]) - cylinders.start(segments[k]));
+    }
+    std::vector<uint32_t> optionBegin(count + 1, 0);
+    std::vector<uint32_t> options;
+    std::vector<float> alignments;
+    options.reserve(count);
+    alignments.reserve(count);
+    for (size_t k = 0; k < count; ++k) {
+        for (uint32_t c = slotOf(cylinders.end(segments[k])).first; c != none; c = nextStart[c]) {
+            if (c <= k) continue;
+            float alignment = glm::dot(directions[k], directions[c]);
+            size_t o = options.size();
+            options.push_back(c);
+            alignments.push_back(alignment);
+            for (; o > optionBegin[k] && alignments[o - 1] <= alignment; --o) {
+                std::swap(options[o], options[o - 1]);
+                std::swap(alignments[o], alignments[o - 1]);
+            }
+        }
+        optionBegin[k + 1] = static_cast<uint32_t>(options.size());
+    }
+
+    // Branches sometimes end where another segment also ends, and both may
+    // want the same continuation; a segment then moves an earlier taker to
+    // one of its other options when that frees one, so as many segments as
+    // possible continue
+    std::vector<uint32_t> predecessor(count, none);
+    std::vector<uint32_t> seen(count, none);
+    for (size_t k = 0; k < count; ++k) {
+        if (optionBegin[k] != optionBegin[k + 1]) {
+            linkSegment(static_cast<uint32_t>(k), static_cast<uint32_t>(k), optionBegin, options, predecessor, seen);
+        }
+    }
+    std::vector<uint32_t> successor(count, none);
+    for (size_t c = 0; c < count; ++c) {
+        if (predecessor[c] != none) successor[predecessor[c]] = static_cast<uint32_t>(c);
+    }
+
+    // A chain starts at every segment nothing continues into
+    kept_.reserve(count);
+    for (size_t k = 0; k < count; ++k) {
+        if (predecessor[k] != none) continue;
+        Chain chain;
+        chain.first = static_cast<uint32_t>(kept_.size());
+        chain.count = 0;
+        for (uint32_t c = static_cast<uint32_t>(k); c != none; c = successor[c]) {
+            kept_.push_back(segments[c]);
+            ++chain.count;
+        }
+        chains_.push_back(chain);
+    }
+
+    size_t radial = ringCos_.size();
+    size_t vertexCount = 0;
+    size_t indexCount = 0;
+    for (auto& chain : chains_) {
+        chain.vertexOffset = vertexCount;
+        chain.indexOffset = indexCount;
+        vertexCount += (chain.count + 1) * radial;
+        indexCount += chain.count * radial * 6;
+    }
+    if (vertexCount > UINT32_MAX) {
+        std::cerr << "Branch mesh: " << vertexCount << " vertices exceed 32-bit indices" << std::endl;
+        mesh.clear();
+        return;
+    }
+
+    mesh.positions.resize(vertexCount);
+    mesh.normals.resize(vertexCount);
+    mesh.colors.resize(vertexCount);
+    mesh.indices.resize(indexCount);
+
+    size_t tasks = (chains_.size() + kChainsPerTask - 1) / kChainsPerTask;
+    parallelFor(tasks, threadCount_, [&](size_t task) {
+        size_t end = std::min(chains_.size(), (task + 1) * kChainsPerTask);
+        for (size_t c = task * kChainsPerTask; c < end; ++c) {
+            buildChain(cylinders, chains_[c], mesh);
+        }
+    });
+}
+
+void BranchMeshBuilder::buildChain(const SegmentBuffer& cylinders, const Chain& chain, BranchMesh& mesh) const {
+    size_t radial = ringCos_.size();
+    const uint32_t* ids = kept_.data() + chain.first;
+
+    // Ring k sits at the start of segment k; the last one closes the chain
+    glm::vec3 side(0.0f);
+    glm::vec3 incoming(0.0f);
+    for (uint32_t ring = 0; ring <= chain.count; ++ring) {
+        uint32_t segment = ids[std::min(ring, chain.count - 1)];
+        glm::vec3 center = ring < chain.count ? cylinders.start(segment) : cylinders.end(segment);
+        glm::vec3 outgoing = ring < chain.count
+            ? glm::normalize(cylinders.end(segment) - cylinders.start(segment)) : incoming;
+        if (ring == 0) incoming = outgoing;
+
+        // Bisector at joints; a full reversal falls back to the new direction
+        glm::vec3 axis = incoming + outgoing;
+        axis = glm::length(axis) > 0.0001f ? glm::normalize(axis) : outgoing;
+
+        // Parallel transport of the previous ring's frame
+        side = ring == 0 ? perpendicular(axis) : side - glm::dot(side, axis) * axis;
+        side = glm::length(side) > 0.0001f ? glm::normalize(side) : perpendicular(axis);
+        glm::vec3 binormal = glm::cross(axis, side);
+
+        float radius = cylinders.radii[segment];
+        const glm::vec3& color = cylinders.colors[segment];
+        size_t base = chain.vertexOffset + ring * radial;
+        for (size_t a = 0; a < radial; ++a) {
+            glm::vec3 normal = ringCos_[a] * side + ringSin_[a] * binormal;
+            mesh.positions[base + a] = center + radius * normal;
+            mesh.normals[base + a] = normal;
+            mesh.colors[base + a] = color;
+        }
+        incoming = outgoing;
+    }
+
+    // Two triangles per quad between consecutive rings
+    uint32_t* out = mesh.indices.data() + chain.indexOffset;
+    for (uint32_t ring = 0; ring < chain.count; ++ring) {
+        uint32_t base = static_cast<uint32_t>(chain.vertexOffset + ring * radial);
+        for (size_t a = 0; a < radial; ++a) {
+            uint32_t v00 = base + static_cast<uint32_t>(a);
+            uint32_t v01 = base + static_cast<uint32_t>((a + 1) % radial);
+            uint32_t v10 = v00 + static_cast<uint32_t>(radial);
+            uint32_t v11 = v01 + static_cast<uint32_t>(radial);
+            *out++ = v00; *out++ = v01; *out++ = v11;
+            *out++ = v00; *out++ = v11; *out++ = v10;
+        }
+    }
+}
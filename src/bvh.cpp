@@ -0,0 +1,524 @@
+#include "bvh.h"
+#include "parallel.h"
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+
+// Primitives per leaf node, and the depth past which ranges become leaves
+// regardless (bounds the traversal stacks below)
+static const uint32_t kMaxLeafPrimitives = 4;
+static const uint32_t kMaxDepth = 48;
+static const size_t kStackSize = kMaxDepth + 2;
+
+// SAH bins per split
+static const int kBinCount = 16;
+
+// Subtrees smaller than this are never built as their own task, and
+// primitive bounds are computed this many at a time
+static const size_t kMinTaskPrimitives = 1 << 12;
+static const size_t kBoundsPerTask = 1 << 12;
+
+// Leaf triangle height over its half-width; must match Renderer::stageLeaves
+static const float kLeafHeight = 1.5f;
+
+// Half the surface area of a box, for SAH costs
+static float halfArea(const glm::vec3& min, const glm::vec3& max) {
+    glm::vec3 d = max - min;
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+// Entry distance of the ray into the box if it enters before maxDistance
+static bool intersectBox(const glm::vec3& min, const glm::vec3& max, const glm::vec3& origin,
+                         const glm::vec3& inverse, float maxDistance, float& entry) {
+    float near = 0.0f;
+    float far = maxDistance;
+    for (int a = 0; a < 3; ++a) {
+        float t1 = (min[a] - origin[a]) * inverse[a];
+        float t2 = (max[a] - origin[a]) * inverse[a];
+        near = std::max(near, std::min(t1, t2));
+        far = std::min(far, std::max(t1, t2));
+    }
+    entry = near;
+    return near <= far;
+}
+
+static bool overlaps(const glm::vec3& minA, const glm::vec3& maxA, const glm::vec3& minB, const glm::vec3& maxB) {
+    return minA.x <= maxB.x && maxA.x >= minB.x &&
+           minA.y <= maxB.y && maxA.y >= minB.y &&
+           minA.z <= maxB.z && maxA.z >= minB.z;
+}
+
+int Frustum::classify(const glm::vec3& min, const glm::vec3& max) const {
+    int result = 1;
+    for (const glm::vec4& plane : planes) {
+        glm::vec3 normal(plane.x, plane.y, plane.z);
+        glm::vec3 farthest(normal.x >= 0.0f ? max.x : min.x,
+                           normal.y >= 0.0f ? max.y : min.y,
+                           normal.z >= 0.0f ? max.z : min.z);
+        glm::vec3 nearest(normal.x >= 0.0f ? min.x : max.x,
+                          normal.y >= 0.0f ? min.y : max.y,
+                          normal.z >= 0.0f ? min.z : max.z);
+        if (glm::dot(normal, farthest) + plane.w < 0.0f) return -1;
+        if (glm::dot(normal, nearest) + plane.w < 0.0f) result = 0;
+    }
+    return result;
+}
+
+Frustum Frustum::fromMatrix(const glm::mat4& m) {
+    glm::vec4 rows[4];
+    for (int r = 0; r < 4; ++r) {
+        rows[r] = glm::vec4(m[0][r], m[1][r], m[2][r], m[3][r]);
+    }
+
+    Frustum frustum;
+    for (int a = 0; a < 3; ++a) {
+        frustum.planes[2 * a] = rows[3] + rows[a];
+        frustum.planes[2 * a + 1] = rows[3] - rows[a];
+    }
+    for (glm::vec4& plane : frustum.planes) {
+        float length = glm::length(glm::vec3(plane.x, plane.y, plane.z));
+        if (length > 0.0f) plane = plane * (1.0f / length);
+    }
+    return frustum;
+}
+
+PlantBVH::PlantBVH()
+    : segmentCount_(0), leafCount_(0), segments_(nullptr), leaves_(nullptr), threadCount_(0) {}
+
+void PlantBVH::clear() {
+    nodes_.clear();
+    primitives_.clear();
+    subtrees_.clear();
+    segmentCount_ = 0;
+    leafCount_ = 0;
+    segments_ = nullptr;
+    leaves_ = nullptr;
+}
+
+void PlantBVH::build(const SegmentBuffer& segments, const LeafBuffer& leaves) {
+    clear();
+    size_t total = segments.size() + leaves.size();
+    if (total == 0) return;
+    if (total >= UINT32_MAX) {
+        std::cerr << "BVH: " << total << " primitives exceed 32-bit indices" << std::endl;
+        return;
+    }
+
+    segments_ = &segments;
+    leaves_ = &leaves;
+    segmentCount_ = segments.size();
+    leafCount_ = leaves.size();
+    computeBounds();
+
+    primitives_.resize(total);
+    for (size_t i = 0; i < total; ++i) {
+        primitives_[i] = static_cast<uint32_t>(i);
+    }
+
+    // Split serially until ranges are small enough to hand out as tasks
+    int threads = resolveThreadCount(threadCount_);
+    size_t deferBelow = std::max(kMinTaskPrimitives, total / (static_cast<size_t>(threads) * 8));
+    std::vector<BuildItem> deferred;
+    nodes_.resize(1);
+    BuildItem root = {0, 0, static_cast<uint32_t>(total), 0};
+    buildNodes(nodes_, root, deferBelow, threads > 1 ? &deferred : nullptr);
+    if (deferred.empty()) return;
+
+    std::vector<std::vector<Node>> local(deferred.size());
+    parallelFor(deferred.size(), threadCount_, [&](size_t t) {
+        BuildItem item = deferred[t];
+        item.node = 0;
+        local[t].resize(1);
+        buildNodes(local[t], item, 0, nullptr);
+    });
+
+    // Each task's root replaces its placeholder; the rest is appended
+    for (size_t t = 0; t < deferred.size(); ++t) {
+        uint32_t base = static_cast<uint32_t>(nodes_.size());
+        auto relocate = [base](Node node) {
+            if (node.count == 0) node.first = node.first - 1 + base;
+            return node;
+        };
+        nodes_[deferred[t].node] = relocate(local[t][0]);
+        for (size_t i = 1; i < local[t].size(); ++i) {
+            nodes_.push_back(relocate(local[t][i]));
+        }
+        subtrees_.push_back({base, static_cast<uint32_t>(nodes_.size())});
+    }
+}
+
+void PlantBVH::computeBounds() {
+    size_t total = segmentCount_ + leafCount_;
+    primitiveMin_.resize(total);
+    primitiveMax_.resize(total);
+
+    size_t tasks = (total + kBoundsPerTask - 1) / kBoundsPerTask;
+    parallelFor(tasks, threadCount_, [&](size_t task) {
+        size_t end = std::min(total, (task + 1) * kBoundsPerTask);
+        for (size_t id = task * kBoundsPerTask; id < end; ++id) {
+            if (id < segmentCount_) {
+                // A cylinder's rim extends r * sqrt(1 - d_a^2) along axis a
+                const glm::vec3& a = segments_->start(id);
+                const glm::vec3& b = segments_->end(id);
+                float radius = segments_->radii[id];
+                glm::vec3 axis = b - a;
+                float length2 = glm::dot(axis, axis);
+                glm::vec3 extent(radius);
+                if (length2 > 1e-12f) {
+                    for (int c = 0; c < 3; ++c) {
+                        extent[c] = radius * std::sqrt(std::max(0.0f, 1.0f - axis[c] * axis[c] / length2));
+                    }
+                }
+                primitiveMin_[id] = glm::min(a, b) - extent;
+                primitiveMax_[id] = glm::max(a, b) + extent;
+            } else {
+                size_t leaf = id - segmentCount_;
+                const glm::vec3& position = leaves_->positions[leaf];
+                float size = leaves_->sizes[leaf];
+                primitiveMin_[id] = position - glm::vec3(size, 0.0f, 0.0f);
+                primitiveMax_[id] = position + glm::vec3(size, size * kLeafHeight, 0.0f);
+            }
+        }
+    });
+}
+
+void PlantBVH::buildNodes(std::vector<Node>& nodes, BuildItem root, size_t deferBelow,
+                          std::vector<BuildItem>* deferred) {
+    std::vector<BuildItem> stack(1, root);
+    while (!stack.empty()) {
+        BuildItem item = stack.back();
+        stack.pop_back();
+        uint32_t count = item.end - item.begin;
+        if (deferred && count < deferBelow) {
+            deferred->push_back(item);
+            continue;
+        }
+
+        glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+        glm::vec3 centroidMin(FLT_MAX), centroidMax(-FLT_MAX);
+        for (uint32_t i = item.begin; i < item.end; ++i) {
+            uint32_t id = primitives_[i];
+            boundsMin = glm::min(boundsMin, primitiveMin_[id]);
+            boundsMax = glm::max(boundsMax, primitiveMax_[id]);
+            glm::vec3 centroid = (primitiveMin_[id] + primitiveMax_[id]) * 0.5f;
+            centroidMin = glm::min(centroidMin, centroid);
+            centroidMax = glm::max(centroidMax, centroid);
+        }
+        nodes[item.node].min = boundsMin;
+        nodes[item.node].max = boundsMax;
+
+        if (count <= kMaxLeafPrimitives || item.depth >= kMaxDepth) {
+            nodes[item.node].first = item.begin;
+            nodes[item.node].count = count;
+            continue;
+        }
+
+        uint32_t mid = partition(item.begin, item.end, centroidMin, centroidMax);
+        uint32_t left = static_cast<uint32_t>(nodes.size());
+        nodes.resize(nodes.size() + 2);
+        nodes[item.node].first = left;
+        nodes[item.node].count = 0;
+        stack.push_back({left + 1, mid, item.end, item.depth + 1});
+        stack.push_back({left, item.begin, mid, item.depth + 1});
+    }
+}
+
+uint32_t PlantBVH::partition(uint32_t begin, uint32_t end, const glm::vec3& centroidMin,
+                             const glm::vec3& centroidMax) {
+    glm::vec3 extent = centroidMax - centroidMin;
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+    if (extent[axis] <= 0.0f) {
+        return begin + (end - begin) / 2;   // Coincident centroids: any split will do
+    }
+
+    float origin = centroidMin[axis];
+    float scale = kBinCount / extent[axis];
+    auto binOf = [&](uint32_t id) {
+        float centroid = (primitiveMin_[id][axis] + primitiveMax_[id][axis]) * 0.5f;
+        return std::min(static_cast<int>((centroid - origin) * scale), kBinCount - 1);
+    };
+
+    glm::vec3 binMin[kBinCount], binMax[kBinCount];
+    uint32_t binCount[kBinCount] = {};
+    for (int b = 0; b < kBinCount; ++b) {
+        binMin[b] = glm::vec3(FLT_MAX);
+        binMax[b] = glm::vec3(-FLT_MAX);
+    }
+    for (uint32_t i = begin; i < end; ++i) {
+        uint32_t id = primitives_[i];
+        int b = binOf(id);
+        binMin[b] = glm::min(binMin[b], primitiveMin_[id]);
+        binMax[b] = glm::max(binMax[b], primitiveMax_[id]);
+        ++binCount[b];
+    }
+
+    // Cost of splitting before bin b: area * count on each side. The first
+    // and last bins hold the extreme centroids, so neither side is empty.
+    float rightCost[kBinCount];
+    glm::vec3 sideMin(FLT_MAX), sideMax(-FLT_MAX);
+    uint32_t sideCount = 0;
+    for (int b = kBinCount - 1; b > 0; --b) {
+        sideMin = glm::min(sideMin, binMin[b]);
+        sideMax = glm::max(sideMax, binMax[b]);
+        sideCount += binCount[b];
+        rightCost[b] = sideCount > 0 ? halfArea(sideMin, sideMax) * sideCount : 0.0f;
+    }
+
+    int bestSplit = 1;
+    float bestCost = FLT_MAX;
+    sideMin = glm::vec3(FLT_MAX);
+    sideMax = glm::vec3(-FLT_MAX);
+    sideCount = 0;
+    for (int b = 1; b < kBinCount; ++b) {
+        sideMin = glm::min(sideMin, binMin[b - 1]);
+        sideMax = glm::max(sideMax, binMax[b - 1]);
+        sideCount += binCount[b - 1];
+        float cost = (sideCount > 0 ? halfArea(sideMin, sideMax) * sideCount : 0.0f) + rightCost[b];
+        if (cost < bestCost && sideCount > 0 && sideCount < end - begin) {
+            bestCost = cost;
+            bestSplit = b;
+        }
+    }
+
+    uint32_t* first = primitives_.data() + begin;
+    uint32_t* middle = std::partition(first, primitives_.data() + end,
+                                      [&](uint32_t id) { return binOf(id) < bestSplit; });
+    return static_cast<uint32_t>(middle - primitives_.data());
+}
+
+bool PlantBVH::refit(const SegmentBuffer& segments, const LeafBuffer& leaves) {
+    if (segments.size() != segmentCount_ || leaves.size() != leafCount_) return false;
+    if (nodes_.empty()) return true;
+
+    segments_ = &segments;
+    leaves_ = &leaves;
+    computeBounds();
+
+    // Task subtrees are independent; the top levels above them go last
+    parallelFor(subtrees_.size(), threadCount_, [&](size_t t) {
+        refitNodes(subtrees_[t].begin, subtrees_[t].end);
+    });
+    refitNodes(0, subtrees_.empty() ? static_cast<uint32_t>(nodes_.size()) : subtrees_[0].begin);
+    return true;
+}
+
+void PlantBVH::refitNodes(uint32_t begin, uint32_t end) {
+    // Children follow their parent, so a backward sweep sees them first
+    for (uint32_t i = end; i-- > begin;) {
+        Node& node = nodes_[i];
+        glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+        if (node.count > 0) {
+            for (uint32_t p = node.first; p < node.first + node.count; ++p) {
+                boundsMin = glm::min(boundsMin, primitiveMin_[primitives_[p]]);
+                boundsMax = glm::max(boundsMax, primitiveMax_[primitives_[p]]);
+            }
+        } else {
+            boundsMin = glm::min(nodes_[node.first].min, nodes_[node.first + 1].min);
+            boundsMax = glm::max(nodes_[node.first].max, nodes_[node.first + 1].max);
+        }
+        node.min = boundsMin;
+        node.max = boundsMax;
+    }
+}
+
+PrimitiveRef PlantBVH::toRef(uint32_t id) const {
+    PrimitiveRef ref;
+    if (id < segmentCount_) {
+        ref.kind = PrimitiveRef::Segment;
+        ref.index = id;
+    } else {
+        ref.kind = PrimitiveRef::Leaf;
+        ref.index = static_cast<uint32_t>(id - segmentCount_);
+    }
+    return ref;
+}
+
+bool PlantBVH::intersect(const glm::vec3& origin, const glm::vec3& direction, RayHit& hit,
+                         float maxDistance) const {
+    if (nodes_.empty()) return false;
+
+    glm::vec3 inverse(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+    float best = maxDistance;
+    uint32_t bestId = UINT32_MAX;
+
+    // Nearer child on top; entries the current best has passed are skipped
+    uint32_t stackNode[kStackSize];
+    float stackEntry[kStackSize];
+    size_t depth = 0;
+    float entry;
+    if (!intersectBox(nodes_[0].min, nodes_[0].max, origin, inverse, best, entry)) return false;
+    stackNode[depth] = 0;
+    stackEntry[depth++] = entry;
+
+    while (depth > 0) {
+        --depth;
+        if (stackEntry[depth] >= best) continue;
+        const Node& node = nodes_[stackNode[depth]];
+
+        if (node.count > 0) {
+            for (uint32_t p = node.first; p < node.first + node.count; ++p) {
+                float t;
+                if (intersectPrimitive(primitives_[p], origin, direction, best, t)) {
+                    best = t;
+                    bestId = primitives_[p];
+                }
+            }
+            continue;
+        }
+
+        float entryA, entryB;
+        bool hitA = intersectBox(nodes_[node.first].min, nodes_[node.first].max, origin, inverse, best, entryA);
+        bool hitB = intersectBox(nodes_[node.first + 1].min, nodes_[node.first + 1].max, origin, inverse, best, entryB);
+        if (hitA && hitB && entryA < entryB) {
+            stackNode[depth] = node.first + 1;
+            stackEntry[depth++] = entryB;
+            hitB = false;
+        }
+        if (hitA) {
+            stackNode[depth] = node.first;
+            stackEntry[depth++] = entryA;
+        }
+        if (hitB) {
+            stackNode[depth] = node.first + 1;
+            stackEntry[depth++] = entryB;
+        }
+    }
+
+    if (bestId == UINT32_MAX) return false;
+    hit.distance = best;
+    hit.point = origin + direction * best;
+    hit.primitive = toRef(bestId);
+    hit.symbol = hit.primitive.kind == PrimitiveRef::Segment
+        ? segments_->symbols[hit.primitive.index] : leaves_->symbols[hit.primitive.index];
+    return true;
+}
+
+bool PlantBVH::intersectPrimitive(uint32_t id, const glm::vec3& origin, const glm::vec3& direction,
+                                  float maxDistance, float& t) const {
+    if (id < segmentCount_) {
+        // Open cylinder: solve |offset from axis|^2 = r^2, keep hits between the caps
+        const glm::vec3& a = segments_->start(id);
+        glm::vec3 axis = segments_->end(id) - a;
+        float height = glm::length(axis);
+        if (height < 1e-6f) return false;
+        axis /= height;
+
+        float radius = segments_->radii[id];
+        glm::vec3 m = origin - a;
+        glm::vec3 d = direction - glm::dot(direction, axis) * axis;
+        glm::vec3 o = m - glm::dot(m, axis) * axis;
+        float qa = glm::dot(d, d);
+        if (qa < 1e-12f) return false;
+        float qb = glm::dot(d, o);
+        float qc = glm::dot(o, o) - radius * radius;
+        float discriminant = qb * qb - qa * qc;
+        if (discriminant < 0.0f) return false;
+
+        float root = std::sqrt(discriminant);
+        for (float candidate : {(-qb - root) / qa, (-qb + root) / qa}) {
+            if (candidate <= 0.0f || candidate >= maxDistance) continue;
+            float along = glm::dot(m + direction * candidate, axis);
+            if (along >= 0.0f && along <= height) {
+                t = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Leaf triangle as Renderer::stageLeaves places it, either side
+    size_t leaf = id - segmentCount_;
+    const glm::vec3& position = leaves_->positions[leaf];
+    float size = leaves_->sizes[leaf];
+    glm::vec3 v0 = position - glm::vec3(size, 0.0f, 0.0f);
+    glm::vec3 e1(2.0f * size, 0.0f, 0.0f);
+    glm::vec3 e2(size, size * kLeafHeight, 0.0f);
+
+    glm::vec3 p = glm::cross(direction, e2);
+    float determinant = glm::dot(e1, p);
+    if (std::fabs(determinant) < 1e-12f) return false;
+    float inverse = 1.0f / determinant;
+    glm::vec3 s = origin - v0;
+    float u = glm::dot(s, p) * inverse;
+    if (u < 0.0f || u > 1.0f) return false;
+    glm::vec3 q = glm::cross(s, e1);
+    float v = glm::dot(direction, q) * inverse;
+    if (v < 0.0f || u + v > 1.0f) return false;
+    float candidate = glm::dot(e2, q) * inverse;
+    if (candidate <= 0.0f || candidate >= maxDistance) return false;
+    t = candidate;
+    return true;
+}
+
+void PlantBVH::collect(uint32_t node, std::vector<PrimitiveRef>& out) const {
+    uint32_t stack[kStackSize];
+    size_t depth = 0;
+    stack[depth++] = node;
+    while (depth > 0) {
+        const Node& current = nodes_[stack[--depth]];
+        if (current.count > 0) {
+            for (uint32_t p = current.first; p < current.first + current.count; ++p) {
+                out.push_back(toRef(primitives_[p]));
+            }
+        } else {
+            stack[depth++] = current.first + 1;
+            stack[depth++] = current.first;
+        }
+    }
+}
+
+void PlantBVH::query(const glm::vec3& minBounds, const glm::vec3& maxBounds, std::vector<PrimitiveRef>& out) const {
+    if (nodes_.empty()) return;
+
+    uint32_t stack[kStackSize];
+    size_t depth = 0;
+    stack[depth++] = 0;
+    while (depth > 0) {
+        uint32_t index = stack[--depth];
+        const Node& node = nodes_[index];
+        if (!overlaps(node.min, node.max, minBounds, maxBounds)) continue;
+
+        bool contained = glm::min(node.min, minBounds) == minBounds && glm::max(node.max, maxBounds) == maxBounds;
+        if (contained) {
+            collect(index, out);
+        } else if (node.count > 0) {
+            for (uint32_t p = node.first; p < node.first + node.count; ++p) {
+                uint32_t id = primitives_[p];
+                if (overlaps(primitiveMin_[id], primitiveMax_[id], minBounds, maxBounds)) {
+                    out.push_back(toRef(id));
+                }
+            }
+        } else {
+            stack[depth++] = node.first + 1;
+            stack[depth++] = node.first;
+        }
+    }
+}
+
+void PlantBVH::query(const Frustum& frustum, std::vector<PrimitiveRef>& out) const {
+    if (nodes_.empty()) return;
+
+    uint32_t stack[kStackSize];
+    size_t depth = 0;
+    stack[depth++] = 0;
+    while (depth > 0) {
+        uint32_t index = stack[--depth];
+        const Node& node = nodes_[index];
+        int side = frustum.classify(node.min, node.max);
+        if (side < 0) continue;
+
+        if (side > 0) {
+            collect(index, out);
+        } else if (node.count > 0) {
+            for (uint32_t p = node.first; p < node.first + node.count; ++p) {
+                uint32_t id = primitives_[p];
+                if (frustum.classify(primitiveMin_[id], primitiveMax_[id]) >= 0) {
+                    out.push_back(toRef(id));
+                }
+            }
+        } else {
+            stack[depth++] = node.first + 1;
+            stack[depth++] = node.first;
+        }
+    }
+}
@@ -0,0 +1,66 @@
+#include "catalog.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Geometry a derivation streamed past the symbol budget may draw
+static const double kStreamGeometryBytes = 1024.0 * 1024.0 * 1024.0;
+
+bool shouldStream(const LSystem& lsystem, const Turtle& turtle, const GenerationStats& prediction) {
+    return lsystem.wasClamped() && turtle.projectedGeometryBytes(prediction) <= kStreamGeometryBytes;
+}
+
+bool parseHeadlessOptions(int argc, char** argv, bool& headless, HeadlessOptions& options) {
+    headless = false;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (std::strcmp(arg, "--headless") == 0) {
+            headless = true;
+            continue;
+        }
+        if (std::strcmp(arg, "--software") == 0) {
+            options.software = true;
+            continue;
+        }
+        if (std::strcmp(arg, "--instanced") == 0) {
+            options.instanced = true;
+            continue;
+        }
+        if (std::strcmp(arg, "--parametric") == 0) {
+            options.parametric = true;
+            continue;
+        }
+        if (!value) return false;
+        ++i;
+        if (std::strcmp(arg, "--output") == 0) {
+            options.outputDir = value;
+        } else if (std::strcmp(arg, "--format") == 0) {
+            options.format = value;
+            if (options.format != "png" && options.format != "ppm") return false;
+        } else if (std::strcmp(arg, "--size") == 0) {
+            if (std::sscanf(value, "%dx%d", &options.width, &options.height) != 2 ||
+                options.width <= 0 || options.height <= 0) {
+                return false;
+            }
+        } else if (std::strcmp(arg, "--preset") == 0) {
+            options.presets.push_back(value);
+        } else if (std::strcmp(arg, "--threads") == 0) {
+            options.threads = std::atoi(value);
+        } else if (std::strcmp(arg, "--iterations") == 0) {
+            options.iterations = std::atoi(value);
+        } else if (std::strcmp(arg, "--camera") == 0) {
+            if (std::sscanf(value, "%f,%f,%f", &options.cameraDistance, &options.cameraPitch, &options.cameraYaw) != 3) {
+                return false;
+            }
+            options.overrideCamera = true;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+const char* instancedPath(const SoftwareRenderer&) {
+    return "software rasterizer";
+}
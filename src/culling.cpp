@@ -0,0 +1,179 @@
+#include "culling.h"
+#include <cfloat>
+#include <cmath>
+
+// Inradius of stageCylinders' octagon over its radius
+static const float kOctagonInradius = 0.92f;
+
+// Whether p lies in the rectangle of half-width radius around segment ab
+// (no caps past the ends)
+static bool insideStrip(float px, float py, float ax, float ay, float bx, float by, float radius) {
+    float dx = bx - ax, dy = by - ay;
+    float lengthSquared = dx * dx + dy * dy;
+    float along = (px - ax) * dx + (py - ay) * dy;
+    if (along < 0.0f || along > lengthSquared) return false;
+    float across = (px - ax) * dy - (py - ay) * dx;
+    return across * across <= radius * radius * lengthSquared;
+}
+
+ClusterCuller::ClusterCuller()
+    : viewProjection_(1.0f), width_(0), height_(0), focalPixels_(1.0f), occlusionEnabled_(true),
+      hasOccluders_(false), stats_() {}
+
+void ClusterCuller::begin(const glm::mat4& viewProjection, int width, int height, float focalPixels) {
+    viewProjection_ = viewProjection;
+    frustum_ = Frustum::fromMatrix(viewProjection);
+    width_ = width;
+    height_ = height;
+    focalPixels_ = focalPixels;
+    hasOccluders_ = false;
+    stats_ = CullStats();
+}
+
+void ClusterCuller::setOccluders(const std::vector<Occluder>& occluders) {
+    hasOccluders_ = false;
+    if (!occlusionEnabled_ || width_ <= 0 || height_ <= 0) return;
+
+    // Finest level: one cell per kCellSize pixels, nothing in front
+    levels_.resize(1);
+    levelWidths_.assign(1, (width_ + kCellSize - 1) / kCellSize);
+    levelHeights_.assign(1, (height_ + kCellSize - 1) / kCellSize);
+    levels_[0].assign(static_cast<size_t>(levelWidths_[0]) * levelHeights_[0], FLT_MAX);
+    for (const Occluder& occluder : occluders) {
+        rasterizeOccluder(occluder);
+    }
+    if (!hasOccluders_) return;
+
+    // Coarser levels keep the farthest of their children
+    while (levelWidths_.back() > 1 || levelHeights_.back() > 1) {
+        int childWidth = levelWidths_.back(), childHeight = levelHeights_.back();
+        int levelWidth = (childWidth + 1) / 2, levelHeight = (childHeight + 1) / 2;
+        std::vector<float> level(static_cast<size_t>(levelWidth) * levelHeight, 0.0f);
+        const std::vector<float>& child = levels_.back();
+        for (int y = 0; y < childHeight; ++y) {
+            for (int x = 0; x < childWidth; ++x) {
+                float& cell = level[(y / 2) * levelWidth + x / 2];
+                cell = std::max(cell, child[y * childWidth + x]);
+            }
+        }
+        levels_.push_back(std::move(level));
+        levelWidths_.push_back(levelWidth);
+        levelHeights_.push_back(levelHeight);
+    }
+}
+
+bool ClusterCuller::isVisible(const glm::vec3& minBounds, const glm::vec3& maxBounds) {
+    ++stats_.tested;
+    if (frustum_.classify(minBounds, maxBounds) < 0) {
+        ++stats_.outsideFrustum;
+        return false;
+    }
+
+    // Screen rectangle and nearest depth of the box; a box reaching behind
+    // the camera is simply drawn
+    float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX, nearDepth = FLT_MAX;
+    for (int corner = 0; corner < 8; ++corner) {
+        glm::vec3 point(corner & 1 ? maxBounds.x : minBounds.x,
+                        corner & 2 ? maxBounds.y : minBounds.y,
+                        corner & 4 ? maxBounds.z : minBounds.z);
+        float x, y, depth;
+        if (!project(point, x, y, depth)) return true;
+        minX = std::min(minX, x);
+        maxX = std::max(maxX, x);
+        minY = std::min(minY, y);
+        maxY = std::max(maxY, y);
+        nearDepth = std::min(nearDepth, depth);
+    }
+
+    if (std::max(maxX - minX, maxY - minY) < 1.0f) {
+        ++stats_.subPixel;
+        return false;
+    }
+    if (hasOccluders_ && isOccluded(minX, minY, maxX, maxY, nearDepth)) {
+        ++stats_.occluded;
+        return false;
+    }
+    return true;
+}
+
+bool ClusterCuller::project(const glm::vec3& point, float& x, float& y, float& depth) const {
+    glm::vec4 clip = viewProjection_ * glm::vec4(point, 1.0f);
+    if (clip.w <= 1e-5f) return false;
+    x = (clip.x / clip.w * 0.5f + 0.5f) * width_;
+    y = (clip.y / clip.w * 0.5f + 0.5f) * height_;
+    depth = clip.w;     // Eye-space distance along the view direction
+    return true;
+}
+
+void ClusterCuller::rasterizeOccluder(const Occluder& occluder) {
+    float x0, y0, depth0, x1, y1, depth1;
+    if (!project(occluder.start, x0, y0, depth0) || !project(occluder.end, x1, y1, depth1)) return;
+
+    // Thinnest screen radius along the cylinder, and its farthest depth
+    float farDepth = std::max(depth0, depth1);
+    float radius = occluder.radius * focalPixels_ / farDepth * kOctagonInradius;
+    if (radius < kCellSize * 0.71f) return;     // Cannot cover a whole cell
+    float depth = farDepth + occluder.radius;
+
+    // Cylinders are open: pull the ends in by the widest screen radius so
+    // what shows through an end opening is not counted as covered
+    float trim = occluder.radius * focalPixels_ / std::min(depth0, depth1);
+    float dx = x1 - x0, dy = y1 - y0;
+    float length = std::sqrt(dx * dx + dy * dy);
+    if (length <= 2.0f * trim) return;
+    x0 += dx * (trim / length);
+    y0 += dy * (trim / length);
+    x1 -= dx * (trim / length);
+    y1 -= dy * (trim / length);
+
+    int cellsX = levelWidths_[0], cellsY = levelHeights_[0];
+    int minCellX = std::max(static_cast<int>(std::floor((std::min(x0, x1) - radius) / kCellSize)), 0);
+    int maxCellX = std::min(static_cast<int>(std::floor((std::max(x0, x1) + radius) / kCellSize)), cellsX - 1);
+    int minCellY = std::max(static_cast<int>(std::floor((std::min(y0, y1) - radius) / kCellSize)), 0);
+    int maxCellY = std::min(static_cast<int>(std::floor((std::max(y0, y1) + radius) / kCellSize)), cellsY - 1);
+
+    // A cell is covered when all four corners are inside the strip
+    std::vector<float>& cells = levels_[0];
+    for (int cy = minCellY; cy <= maxCellY; ++cy) {
+        for (int cx = minCellX; cx <= maxCellX; ++cx) {
+            bool covered = true;
+            for (int corner = 0; corner < 4 && covered; ++corner) {
+                float px = static_cast<float>((cx + (corner & 1)) * kCellSize);
+                float py = static_cast<float>((cy + (corner >> 1)) * kCellSize);
+                covered = insideStrip(px, py, x0, y0, x1, y1, radius);
+            }
+            if (!covered) continue;
+            float& cell = cells[cy * cellsX + cx];
+            cell = std::min(cell, depth);
+            hasOccluders_ = true;
+        }
+    }
+}
+
+bool ClusterCuller::isOccluded(float minX, float minY, float maxX, float maxY, float nearDepth) const {
+    int cellsX = levelWidths_[0], cellsY = levelHeights_[0];
+    int minCellX = std::max(static_cast<int>(std::floor(minX / kCellSize)), 0);
+    int maxCellX = std::min(static_cast<int>(std::floor(maxX / kCellSize)), cellsX - 1);
+    int minCellY = std::max(static_cast<int>(std::floor(minY / kCellSize)), 0);
+    int maxCellY = std::min(static_cast<int>(std::floor(maxY / kCellSize)), cellsY - 1);
+    if (minCellX > maxCellX || minCellY > maxCellY) return false;
+
+    // Coarsest level where the rectangle spans at most 2 x 2 cells
+    size_t level = 0;
+    while (level + 1 < levels_.size() && (maxCellX - minCellX > 1 || maxCellY - minCellY > 1)) {
+        minCellX >>= 1;
+        maxCellX >>= 1;
+        minCellY >>= 1;
+        maxCellY >>= 1;
+        ++level;
+    }
+
+    const std::vector<float>& cells = levels_[level];
+    int levelWidth = levelWidths_[level];
+    for (int cy = minCellY; cy <= maxCellY; ++cy) {
+        for (int cx = minCellX; cx <= maxCellX; ++cx) {
+            if (cells[cy * levelWidth + cx] >= nearDepth) return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,86 @@
+#include "image.h"
+#include <zlib.h>
+#include <fstream>
+#include <algorithm>
+#include <iostream>
+
+bool writePPM(const std::string& path, const Image& image) {
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Cannot write image: " << path << std::endl;
+        return false;
+    }
+    file << "P6\n" << image.width << " " << image.height << "\n255\n";
+    file.write(reinterpret_cast<const char*>(image.pixels.data()), image.pixels.size());
+    return static_cast<bool>(file);
+}
+
+// PNG chunks store integers big-endian
+static void appendBigEndian(std::vector<uint8_t>& out, uint32_t value) {
+    out.push_back(static_cast<uint8_t>(value >> 24));
+    out.push_back(static_cast<uint8_t>(value >> 16));
+    out.push_back(static_cast<uint8_t>(value >> 8));
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+// Length, type, data and a CRC over type and data
+static void appendChunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t size) {
+    appendBigEndian(out, static_cast<uint32_t>(size));
+    size_t typeStart = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + size);
+    uLong crc = crc32(0L, out.data() + typeStart, static_cast<uInt>(size + 4));
+    appendBigEndian(out, static_cast<uint32_t>(crc));
+}
+
+bool writePNG(const std::string& path, const Image& image) {
+    // Scanlines, each behind an "Up" filter byte: plant renders are mostly
+    // flat background, which the filter turns into runs of zeros
+    size_t stride = static_cast<size_t>(image.width) * 3;
+    std::vector<uint8_t> raw((stride + 1) * image.height);
+    for (int y = 0; y < image.height; ++y) {
+        uint8_t* line = raw.data() + (stride + 1) * y;
+        const uint8_t* current = image.row(y);
+        line[0] = y > 0 ? 2 : 0;
+        if (y == 0) {
+            std::copy(current, current + stride, line + 1);
+            continue;
+        }
+        const uint8_t* above = image.row(y - 1);
+        for (size_t i = 0; i < stride; ++i) {
+            line[1 + i] = static_cast<uint8_t>(current[i] - above[i]);
+        }
+    }
+    
+    uLongf deflatedSize = compressBound(static_cast<uLong>(raw.size()));
+    std::vector<uint8_t> deflated(deflatedSize);
+    if (compress2(deflated.data(), &deflatedSize, raw.data(), static_cast<uLong>(raw.size()), Z_BEST_SPEED) != Z_OK) {
+        std::cerr << "Cannot compress image: " << path << std::endl;
+        return false;
+    }
+    
+    std::vector<uint8_t> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    std::vector<uint8_t> header;
+    appendBigEndian(header, static_cast<uint32_t>(image.width));
+    appendBigEndian(header, static_cast<uint32_t>(image.height));
+    header.insert(header.end(), {8, 2, 0, 0, 0});   // 8-bit RGB, deflate, adaptive filters, no interlace
+    appendChunk(png, "IHDR", header.data(), header.size());
+    appendChunk(png, "IDAT", deflated.data(), deflatedSize);
+    appendChunk(png, "IEND", nullptr, 0);
+    
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Cannot write image: " << path << std::endl;
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(png.data()), png.size());
+    return static_cast<bool>(file);
+}
+
+bool writeImage(const std::string& path, const Image& image) {
+    size_t dot = path.rfind('.');
+    if (dot != std::string::npos && path.compare(dot, std::string::npos, ".ppm") == 0) {
+        return writePPM(path, image);
+    }
+    return writePNG(path, image);
+}
@@ -0,0 +1,95 @@
+#include "instancing.h"
+#include <cfloat>
+
+InstancedPlant::InstancedPlant() : root_(0), version_(0) {}
+
+void InstancedPlant::clear() {
+    prototypes_.clear();
+    root_ = 0;
+    ++version_;
+}
+
+void InstancedPlant::flatten(SegmentBuffer& cylinders, LeafBuffer& leaves) const {
+    cylinders.clear();
+    leaves.clear();
+    cylinders.reserve(getCylinderCount());
+    leaves.reserve(getLeafCount());
+
+    forEachInstance([&](const Prototype& prototype, const InstanceTransform& transform) {
+        const SegmentBuffer& localCylinders = prototype.cylinders;
+        for (size_t i = 0; i < localCylinders.size(); ++i) {
+            cylinders.push(transform.origin + transform.frame * localCylinders.start(i),
+                           transform.origin + transform.frame * localCylinders.end(i),
+                           localCylinders.radii[i] * transform.widthScale, localCylinders.colors[i]);
+        }
+        const LeafBuffer& localLeaves = prototype.leaves;
+        for (size_t i = 0; i < localLeaves.size(); ++i) {
+            leaves.push(transform.origin + transform.frame * localLeaves.positions[i],
+                        glm::normalize(transform.frame * localLeaves.normals[i]),
+                        localLeaves.sizes[i] * transform.widthScale, localLeaves.colors[i]);
+        }
+    });
+}
+
+size_t InstancedPlant::getPlacementCount() const {
+    if (prototypes_.empty()) return 0;
+
+    // Prototypes only reference earlier-built ones, so one forward pass suffices
+    std::vector<size_t> placements(prototypes_.size(), 1);
+    for (size_t i = 0; i < prototypes_.size(); ++i) {
+        for (const auto& child : prototypes_[i].children) {
+            placements[i] += placements[child.prototype];
+        }
+    }
+    return placements[root_];
+}
+
+glm::vec3 InstancedPlant::getRootPosition() const {
+    // The turtle starts at the origin; report the base of the bounds below it
+    return glm::vec3(0.0f, getMinBounds().y, 0.0f);
+}
+
+void InstancedPlant::fitRootBounds() {
+    if (prototypes_.empty()) return;
+    glm::vec3 minBounds(FLT_MAX), maxBounds(-FLT_MAX);
+    fitBounds(root_, InstanceTransform(), minBounds, maxBounds);
+    prototypes_[root_].minBounds = minBounds;
+    prototypes_[root_].maxBounds = maxBounds;
+}
+
+void InstancedPlant::fitBounds(uint32_t index, const InstanceTransform& transform,
+                               glm::vec3& minBounds, glm::vec3& maxBounds) const {
+    const Prototype& prototype = prototypes_[index];
+    auto grow = [&](const glm::vec3& point) {
+        glm::vec3 placed = transform.origin + transform.frame * point;
+        minBounds = glm::min(minBounds, placed);
+        maxBounds = glm::max(maxBounds, placed);
+    };
+
+    // The points the turtle's own bounds cover: where it starts and ends,
+    // and what it drew
+    grow(glm::vec3(0.0f));
+    grow(prototype.end.position);
+    for (const glm::vec3& position : prototype.cylinders.positions) {
+        grow(position);
+    }
+    for (const glm::vec3& position : prototype.leaves.positions) {
+        grow(position);
+    }
+
+    for (const auto& child : prototype.children) {
+        InstanceTransform placed = transform * child.transform;
+        const Prototype& geometry = prototypes_[child.prototype];
+        bool inside = true;
+        for (int corner = 0; corner < 8 && inside; ++corner) {
+            glm::vec3 p((corner & 1) ? geometry.maxBounds.x : geometry.minBounds.x,
+                        (corner & 2) ? geometry.maxBounds.y : geometry.minBounds.y,
+                        (corner & 4) ? geometry.maxBounds.z : geometry.minBounds.z);
+            p = placed.origin + placed.frame * p;
+            inside = glm::min(p, minBounds) == minBounds && glm::max(p, maxBounds) == maxBounds;
+        }
+        if (!inside) {
+            fitBounds(child.prototype, placed, minBounds, maxBounds);
+        }
+    }
+}
@@ -1,10 +1,48 @@
-#include "LSystem.h"
+#include "lsystem.h"
+#include "parallel.h"
+#include "presetlibrary.h"
 #include <iostream>
-#include <sstream>
+#include <algorithm>
+#include <cstring>
 
-LSystem::LSystem() : currentIterations_(0), rng_(std::random_device{}()), dist_(0.0f, 1.0f) {
+// Inputs shorter than this are rewritten on the calling thread
+static const size_t kParallelMinSymbols = 1 << 16;
+static const size_t kChunksPerThread = 4;
+static const size_t kMaxCachedDerivations = 4;
+static const uint32_t kNoContext = 0xFFFFFFFFu;
+
+// SplitMix64 finalizer
+static inline uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Counter-based uniform in [0, 1): a hash of (seed, generation, index),
+// independent of evaluation order
+static inline float counterUniform(uint64_t seed, uint32_t generation, uint64_t index) {
+    uint64_t key = mix64(seed + 0x9E3779B97F4A7C15ull * (static_cast<uint64_t>(generation) + 1));
+    uint64_t bits = mix64(key ^ (index * 0xD1B54A32D192ED03ull));
+    return static_cast<float>(bits >> 40) * (1.0f / 16777216.0f);
+}
+
+// FNV-1a over raw bytes, chained through `hash`
+static inline uint64_t hashBytes(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+LSystem::LSystem() : current_(&currentString_), currentIterations_(0), rulesDirty_(true),
+                     threadCount_(0), symbolBudget_(0), clamped_(false), library_(nullptr),
+                     cacheEnabled_(true), keyDirty_(true), key_(0) {
+    std::random_device device;
+    seed_ = (static_cast<uint64_t>(device()) << 32) | device();
     axiom_ = "F";
     currentString_ = axiom_;
+    contextIgnore_.fill(false);
 }
 
 LSystem::~LSystem() {}
@@ -12,7 +50,9 @@ LSystem::~LSystem() {}
 void LSystem::setAxiom(const std::string& axiom) {
     axiom_ = axiom;
     currentString_ = axiom;
+    current_ = &currentString_;
     currentIterations_ = 0;
+    keyDirty_ = true;
 }
 
 void LSystem::addRule(char predecessor, const std::string& successor) {
@@ -21,6 +61,8 @@ void LSystem::addRule(char predecessor, const std::string& successor) {
     rule.productions.clear();
     rule.productions.push_back({successor, 1.0f});
     rules_[predecessor] = rule;
+    rulesDirty_ = true;
+    keyDirty_ = true;
 }
 
 void LSystem::addStochasticRule(char predecessor, const std::string& successor, float probability) {
@@ -30,71 +72,733 @@ void LSystem::addStochasticRule(char predecessor, const std::string& successor,
         rules_[predecessor] = rule;
     }
     rules_[predecessor].productions.push_back({successor, probability});
+    rulesDirty_ = true;
+    keyDirty_ = true;
 }
 
 void LSystem::clearRules() {
     rules_.clear();
+    contextRules_.clear();
+    contextIgnore_.fill(false);
+    rulesDirty_ = true;
+    keyDirty_ = true;
+}
+
+void LSystem::addContextRule(const std::string& left, char predecessor,
+                             const std::string& right, const std::string& successor) {
+    ContextRule rule;
+    rule.left = left;
+    rule.predecessor = predecessor;
+    rule.right = right;
+    rule.successor = successor;
+    contextRules_.push_back(rule);
+    rulesDirty_ = true;
+    keyDirty_ = true;
+}
+
+void LSystem::setContextIgnore(const std::string& symbols) {
+    contextIgnore_.fill(false);
+    for (unsigned char symbol : symbols) {
+        contextIgnore_[symbol] = true;
+    }
+    rulesDirty_ = true;
+    keyDirty_ = true;
+}
+
+// Square matrix product c = a * b (row-major, n x n)
+static void multiplyMatrices(const std::vector<double>& a, const std::vector<double>& b,
+                             std::vector<double>& c, size_t n) {
+    std::vector<double> result(n * n, 0.0);
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t k = 0; k < n; ++k) {
+            double aik = a[i * n + k];
+            if (aik == 0.0) continue;
+            for (size_t j = 0; j < n; ++j) {
+                result[i * n + j] += aik * b[k * n + j];
+            }
+        }
+    }
+    c.swap(result);
+}
+
+// y = m * x (row-major, n x n)
+static void multiplyVector(const std::vector<double>& m, const std::vector<double>& x,
+                           std::vector<double>& y, size_t n) {
+    std::vector<double> result(n, 0.0);
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < n; ++j) {
+            result[i] += m[i * n + j] * x[j];
+        }
+    }
+    y.swap(result);
+}
+
+void LSystem::productionMatrices(std::vector<unsigned char>& alphabet, std::vector<double>& expected,
+                                 std::vector<double>& upper, std::vector<double>& axiomCounts) const {
+    // Compact alphabet: every symbol that can ever appear
+    std::array<int, 256> slot;
+    slot.fill(-1);
+    alphabet.clear();
+    auto addSymbols = [&](const std::string& text) {
+        for (unsigned char symbol : text) {
+            if (slot[symbol] < 0) {
+                slot[symbol] = static_cast<int>(alphabet.size());
+                alphabet.push_back(symbol);
+            }
+        }
+    };
+    addSymbols(axiom_);
+    for (const auto& entry : rules_) {
+        for (const auto& production : entry.second.productions) {
+            addSymbols(production.first);
+        }
+    }
+    for (const auto& rule : contextRules_) {
+        addSymbols(rule.successor);
+    }
+    
+    size_t n = alphabet.size();
+    expected.assign(n * n, 0.0);
+    upper.assign(n * n, 0.0);
+    axiomCounts.assign(n, 0.0);
+    for (unsigned char symbol : axiom_) {
+        axiomCounts[slot[symbol]] += 1.0;
+    }
+    
+    // Column s: symbol counts in the successor of s. Stochastic rules use the
+    // effective production probabilities; `upper` takes the per-symbol maximum
+    // over every possible successor (context rules included) as a safe bound.
+    std::vector<double> counts(n);
+    for (size_t s = 0; s < n; ++s) {
+        char symbol = static_cast<char>(alphabet[s]);
+        bool anyRule = false;
+        
+        auto accumulate = [&](const std::string& successor, double weight) {
+            std::fill(counts.begin(), counts.end(), 0.0);
+            for (unsigned char t : successor) counts[slot[t]] += 1.0;
+            for (size_t t = 0; t < n; ++t) {
+                expected[t * n + s] += weight * counts[t];
+                upper[t * n + s] = std::max(upper[t * n + s], counts[t]);
+            }
+            anyRule = true;
+        };
+        
+        auto rule = rules_.find(symbol);
+        if (rule != rules_.end() && !rule->second.productions.empty()) {
+            const auto& productions = rule->second.productions;
+            double cumulative = 0.0;
+            for (size_t i = 0; i < productions.size(); ++i) {
+                double next = std::min(cumulative + std::max(productions[i].second, 0.0f), 1.0);
+                double weight = next - cumulative;
+                if (i + 1 == productions.size()) weight += 1.0 - next;
+                accumulate(productions[i].first, weight);
+                cumulative = next;
+            }
+        }
+        for (const auto& context : contextRules_) {
+            if (context.predecessor != symbol) continue;
+            // Counted in the bound only; the expectation uses the context-free rule
+            std::fill(counts.begin(), counts.end(), 0.0);
+            for (unsigned char t : context.successor) counts[slot[t]] += 1.0;
+            for (size_t t = 0; t < n; ++t) {
+                upper[t * n + s] = std::max(upper[t * n + s], counts[t]);
+            }
+            upper[s * n + s] = std::max(upper[s * n + s], 1.0);  // Identity fallback
+        }
+        
+        if (!anyRule) {
+            expected[s * n + s] = 1.0;
+            upper[s * n + s] = std::max(upper[s * n + s], 1.0);
+        }
+    }
+}
+
+GenerationStats LSystem::predict(int iterations) const {
+    std::vector<unsigned char> alphabet;
+    std::vector<double> expected, upper, counts;
+    productionMatrices(alphabet, expected, upper, counts);
+    size_t n = alphabet.size();
+    
+    GenerationStats stats;
+    stats.iterations = std::max(iterations, 0);
+    stats.exact = isDeterministic();
+    stats.histogram.fill(0.0);
+    
+    // Cached generations all stay resident, so sum them step by step
+    std::vector<double> step = counts;
+    double cachedBytes = 0.0;
+    for (int i = 0; i <= stats.iterations && cacheEnabled_; ++i) {
+        for (double c : step) cachedBytes += c;
+        if (i < stats.iterations) multiplyVector(expected, step, step, n);
+    }
+    
+    // counts(N) = E^N * counts(0), with E^N by repeated squaring
+    std::vector<double> power(n * n, 0.0);
+    for (size_t i = 0; i < n; ++i) power[i * n + i] = 1.0;
+    std::vector<double> base = expected;
+    for (int k = stats.iterations; k > 0; k >>= 1) {
+        if (k & 1) multiplyMatrices(base, power, power, n);
+        if (k > 1) multiplyMatrices(base, base, base, n);
+    }
+    multiplyVector(power, counts, counts, n);
+    
+    stats.length = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        stats.histogram[alphabet[i]] = counts[i];
+        stats.length += counts[i];
+    }
+    stats.segments = stats.histogram['F'] + stats.histogram['G'];
+    stats.leaves = stats.histogram['L'];
+    stats.stringBytes = cacheEnabled_ ? cachedBytes : stats.length;
+    stats.bracketDepth = bracketDepth(stats.iterations);
+    return stats;
+}
+
+int LSystem::bracketDepth(int iterations) const {
+    // Per symbol, the net depth change and the deepest point reached while
+    // expanding it k generations; level k is built from level k - 1 by walking
+    // each successor. Alternative successors contribute their maximum.
+    std::array<int, 256> net, peak;
+    for (int c = 0; c < 256; ++c) {
+        net[c] = c == '[' ? 1 : (c == ']' ? -1 : 0);
+        peak[c] = std::max(net[c], 0);
+    }
+    
+    auto walk = [](const std::string& successor, const std::array<int, 256>& net,
+                   const std::array<int, 256>& peak, int& netOut, int& peakOut) {
+        int depth = 0;
+        for (unsigned char t : successor) {
+            peakOut = std::max(peakOut, depth + peak[t]);
+            depth += net[t];
+        }
+        netOut = std::max(netOut, depth);
+    };
+    
+    for (int k = 0; k < iterations; ++k) {
+        std::array<int, 256> nextNet = net, nextPeak = peak;
+        for (const auto& entry : rules_) {
+            unsigned char s = static_cast<unsigned char>(entry.first);
+            if (entry.second.productions.empty()) continue;
+            nextNet[s] = INT32_MIN;
+            nextPeak[s] = 0;
+            for (const auto& production : entry.second.productions) {
+                walk(production.first, net, peak, nextNet[s], nextPeak[s]);
+            }
+        }
+        for (const auto& rule : contextRules_) {
+            // Context rules may also leave the symbol unchanged
+            unsigned char s = static_cast<unsigned char>(rule.predecessor);
+            walk(rule.successor, net, peak, nextNet[s], nextPeak[s]);
+            nextNet[s] = std::max(nextNet[s], net[s]);
+            nextPeak[s] = std::max(nextPeak[s], peak[s]);
+        }
+        net = nextNet;
+        peak = nextPeak;
+    }
+    
+    int netDepth = 0, peakDepth = 0;
+    walk(axiom_, net, peak, netDepth, peakDepth);
+    return peakDepth;
+}
+
+int LSystem::clampToBudget(int iterations) const {
+    std::vector<unsigned char> alphabet;
+    std::vector<double> expected, upper, counts;
+    productionMatrices(alphabet, expected, upper, counts);
+    
+    // Every intermediate generation is materialized too, so check each one
+    // against the upper-bound matrix (exact for deterministic rule sets)
+    for (int i = 0; i < iterations; ++i) {
+        multiplyVector(upper, counts, counts, alphabet.size());
+        double length = 0.0;
+        for (double c : counts) length += c;
+        if (length > static_cast<double>(symbolBudget_)) {
+            return i;
+        }
+    }
+    return iterations;
+}
+
+bool LSystem::isDeterministic() const {
+    if (!contextRules_.empty()) return false;
+    for (const auto& entry : rules_) {
+        if (entry.second.productions.size() > 1) return false;
+    }
+    return true;
+}
+
+const std::string* LSystem::getSuccessor(char symbol) const {
+    auto it = rules_.find(symbol);
+    if (it == rules_.end() || it->second.productions.size() != 1) {
+        return nullptr;
+    }
+    return &it->second.productions[0].first;
 }
 
 void LSystem::reset() {
     currentString_ = axiom_;
+    current_ = &currentString_;
     currentIterations_ = 0;
 }
 
-std::string LSystem::generate(int iterations) {
+const std::string& LSystem::generate(int iterations) {
     reset();
-    for (int i = 0; i < iterations; ++i) {
-        currentString_ = applyRules(currentString_);
-        currentIterations_++;
-    }
-    return currentString_;
-}
-
-std::string LSystem::applyRules(const std::string& input) {
-    std::stringstream output;
-    
-    for (char symbol : input) {
-        char result = applyRule(symbol);
-        
-        // If there's a rule, apply it; otherwise keep the symbol
-        if (rules_.find(symbol) != rules_.end()) {
-            const Rule& rule = rules_[symbol];
-            
-            if (rule.productions.size() == 1) {
-                // Deterministic rule
-                output << rule.productions[0].first;
-            } else {
-                // Stochastic rule
-                float rand = dist_(rng_);
-                float cumulative = 0.0f;
-                bool applied = false;
-                
-                for (const auto& prod : rule.productions) {
-                    cumulative += prod.second;
-                    if (rand <= cumulative) {
-                        output << prod.first;
-                        applied = true;
-                        break;
-                    }
-                }
-                
-                if (!applied) {
-                    output << rule.productions.back().first;
-                }
+    if (rulesDirty_) {
+        compileRules();
+    }
+    
+    clamped_ = false;
+    if (symbolBudget_ > 0) {
+        int allowed = clampToBudget(iterations);
+        if (allowed < iterations) {
+            std::cerr << "L-system: " << iterations << " iterations exceed the symbol budget of "
+                      << symbolBudget_ << ", clamping to " << allowed << std::endl;
+            iterations = allowed;
+            clamped_ = true;
+        }
+    }
+    
+    if (!cacheEnabled_) {
+        for (int i = 0; i < iterations; ++i) {
+            applyRules(currentString_, scratchString_, static_cast<uint32_t>(currentIterations_));
+            currentString_.swap(scratchString_);
+            currentIterations_++;
+        }
+        return currentString_;
+    }
+    
+    // Extend the cached derivation by only the missing generations
+    std::deque<std::string>& generations = cachedDerivation().generations;
+    while (static_cast<int>(generations.size()) <= iterations) {
+        uint32_t generation = static_cast<uint32_t>(generations.size() - 1);
+        generations.emplace_back();
+        applyRules(generations[generation], generations.back(), generation);
+    }
+    
+    currentIterations_ = iterations;
+    current_ = &generations[iterations];
+    return *current_;
+}
+
+void LSystem::setCacheEnabled(bool enabled) {
+    cacheEnabled_ = enabled;
+    if (!enabled) {
+        clearCache();
+    }
+}
+
+void LSystem::clearCache() {
+    cache_.clear();
+    reset();
+}
+
+uint64_t LSystem::derivationKey() {
+    if (keyDirty_) {
+        uint64_t hash = 0xCBF29CE484222325ull;
+        hash = hashBytes(hash, axiom_.data(), axiom_.size());
+        for (const auto& entry : rules_) {
+            hash = hashBytes(hash, &entry.first, sizeof(entry.first));
+            for (const auto& production : entry.second.productions) {
+                uint64_t length = production.first.size();
+                hash = hashBytes(hash, &length, sizeof(length));
+                hash = hashBytes(hash, production.first.data(), production.first.size());
+                hash = hashBytes(hash, &production.second, sizeof(production.second));
+            }
+        }
+        for (const auto& rule : contextRules_) {
+            for (const std::string* part : {&rule.left, &rule.right, &rule.successor}) {
+                uint64_t length = part->size();
+                hash = hashBytes(hash, &length, sizeof(length));
+                hash = hashBytes(hash, part->data(), part->size());
             }
+            hash = hashBytes(hash, &rule.predecessor, sizeof(rule.predecessor));
+        }
+        hash = hashBytes(hash, contextIgnore_.data(), contextIgnore_.size());
+        hash = hashBytes(hash, &seed_, sizeof(seed_));
+        key_ = hash;
+        keyDirty_ = false;
+    }
+    return key_;
+}
+
+LSystem::CachedDerivation& LSystem::cachedDerivation() {
+    uint64_t key = derivationKey();
+    
+    for (auto it = cache_.begin(); it != cache_.end(); ++it) {
+        if (it->key == key) {
+            // Move to front (most recently used)
+            cache_.splice(cache_.begin(), cache_, it);
+            return cache_.front();
+        }
+    }
+    
+    if (cache_.size() >= kMaxCachedDerivations) {
+        cache_.pop_back();
+    }
+    cache_.push_front(CachedDerivation());
+    cache_.front().key = key;
+    cache_.front().generations.push_back(axiom_);
+    return cache_.front();
+}
+
+void LSystem::derive(int iterations, SymbolSink& sink) {
+    if (rulesDirty_) {
+        compileRules();
+    }
+    if (!contextRules_.empty()) {
+        const std::string& result = generate(iterations);
+        sink.consume(result.data(), result.size());
+        return;
+    }
+    if (iterations <= 0) {
+        sink.consume(axiom_.data(), axiom_.size());
+        return;
+    }
+    
+    // One frame per generation being expanded: the unread part of a successor
+    // (or the axiom). Symbols in frame `generation` belong to that generation.
+    struct Frame {
+        const char* next;
+        const char* end;
+        int generation;
+    };
+    
+    uint32_t target = static_cast<uint32_t>(iterations);
+    std::vector<Frame> stack;
+    stack.reserve(iterations + 1);
+    stack.push_back({axiom_.data(), axiom_.data() + axiom_.size(), 0});
+    
+    // Running symbol index per generation; depth-first order visits each
+    // generation left to right, so these match generate()'s indices
+    std::vector<uint64_t> index(iterations + 1, 0);
+    const char* pool = successorPool_.data();
+    
+    while (!stack.empty()) {
+        Frame& frame = stack.back();
+        if (frame.next == frame.end) {
+            stack.pop_back();
+            continue;
+        }
+        
+        uint32_t generation = static_cast<uint32_t>(frame.generation);
+        if (generation == target) {
+            // Fully derived: emit the rest of this successor at once
+            sink.consume(frame.next, frame.end - frame.next);
+            index[generation] += frame.end - frame.next;
+            frame.next = frame.end;
+            continue;
+        }
+        
+        const CompiledRule& entry = dispatch_[static_cast<unsigned char>(*frame.next)];
+        if (entry.kind == CompiledRule::Identity) {
+            // Symbols without a rule survive every remaining generation unchanged
+            const char* run = frame.next;
+            while (frame.next != frame.end &&
+                   dispatch_[static_cast<unsigned char>(*frame.next)].kind == CompiledRule::Identity) {
+                ++frame.next;
+            }
+            size_t count = frame.next - run;
+            for (uint32_t g = generation; g <= target; ++g) {
+                index[g] += count;
+            }
+            sink.consume(run, count);
+            continue;
+        }
+        
+        uint64_t symbolIndex = index[generation]++;
+        uint32_t id = entry.kind == CompiledRule::Deterministic
+                    ? entry.first : sampleProduction(entry, generation, symbolIndex);
+        ++frame.next;
+        
+        const auto& successor = successors_[id];
+        stack.push_back({pool + successor.first, pool + successor.first + successor.second,
+                         static_cast<int>(generation + 1)});
+    }
+}
+
+void LSystem::compileRules() {
+    dispatch_.fill(CompiledRule());
+    successorPool_.clear();
+    successors_.clear();
+    aliasTable_.clear();
+    
+    for (const auto& entry : rules_) {
+        const Rule& rule = entry.second;
+        if (rule.productions.empty()) continue;
+        
+        CompiledRule& slot = dispatch_[static_cast<unsigned char>(entry.first)];
+        if (rule.productions.size() == 1) {
+            slot.kind = CompiledRule::Deterministic;
+            slot.first = addSuccessor(rule.productions[0].first);
         } else {
-            output << symbol;
+            slot.kind = CompiledRule::Stochastic;
+            buildAliasTable(rule, slot);
+        }
+    }
+    
+    // Symbols with context rules dispatch to their (contiguous) list of
+    // context rules, keeping the context-free entry as fallback
+    compiledContext_.clear();
+    contextFallback_.fill(CompiledRule());
+    for (int symbol = 0; symbol < 256; ++symbol) {
+        uint32_t first = static_cast<uint32_t>(compiledContext_.size());
+        for (const auto& rule : contextRules_) {
+            if (static_cast<unsigned char>(rule.predecessor) == symbol) {
+                compiledContext_.push_back({&rule, addSuccessor(rule.successor)});
+            }
+        }
+        uint32_t count = static_cast<uint32_t>(compiledContext_.size()) - first;
+        if (count == 0) continue;
+        
+        CompiledRule& slot = dispatch_[symbol];
+        contextFallback_[symbol] = slot;
+        if (slot.kind == CompiledRule::Identity) {
+            // Identity as an explicit one-symbol successor keeps selection uniform
+            contextFallback_[symbol].kind = CompiledRule::Deterministic;
+            contextFallback_[symbol].first = addSuccessor(std::string(1, static_cast<char>(symbol)));
+        }
+        slot.kind = CompiledRule::Contextual;
+        slot.first = first;
+        slot.count = count;
+    }
+    
+    rulesDirty_ = false;
+}
+
+uint32_t LSystem::addSuccessor(const std::string& successor) {
+    uint32_t id = static_cast<uint32_t>(successors_.size());
+    successors_.push_back({static_cast<uint32_t>(successorPool_.size()),
+                           static_cast<uint32_t>(successor.size())});
+    successorPool_ += successor;
+    return id;
+}
+
+void LSystem::buildAliasTable(const Rule& rule, CompiledRule& entry) {
+    size_t n = rule.productions.size();
+    
+    // Effective probabilities of the cumulative walk used for stochastic rules:
+    // weights are clipped at a total of 1 and any shortfall goes to the last production
+    std::vector<double> probability(n);
+    double cumulative = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        double next = std::min(cumulative + std::max(rule.productions[i].second, 0.0f), 1.0);
+        probability[i] = next - cumulative;
+        cumulative = next;
+    }
+    probability[n - 1] += 1.0 - cumulative;
+    
+    entry.first = static_cast<uint32_t>(aliasTable_.size());
+    entry.count = static_cast<uint32_t>(n);
+    
+    // Vose's method: split columns into under- and over-full, pair them up
+    std::vector<double> scaled(n);
+    std::vector<size_t> small, large;
+    for (size_t i = 0; i < n; ++i) {
+        scaled[i] = probability[i] * n;
+        (scaled[i] < 1.0 ? small : large).push_back(i);
+    }
+    
+    std::vector<AliasEntry> columns(n);
+    std::vector<uint32_t> ids(n);
+    for (size_t i = 0; i < n; ++i) {
+        ids[i] = addSuccessor(rule.productions[i].first);
+    }
+    
+    while (!small.empty() && !large.empty()) {
+        size_t s = small.back(); small.pop_back();
+        size_t l = large.back();
+        
+        columns[s].threshold = static_cast<float>(scaled[s]);
+        columns[s].primary = ids[s];
+        columns[s].alias = ids[l];
+        
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    
+    // Leftovers are full columns (up to rounding)
+    for (size_t i : small) columns[i] = {1.0f, ids[i], ids[i]};
+    for (size_t i : large) columns[i] = {1.0f, ids[i], ids[i]};
+    
+    aliasTable_.insert(aliasTable_.end(), columns.begin(), columns.end());
+}
+
+uint32_t LSystem::sampleProduction(const CompiledRule& entry, uint32_t generation, uint64_t index) const {
+    // One uniform draw picks the column (integer part) and flips its coin (fraction)
+    float x = counterUniform(seed_, generation, index) * entry.count;
+    uint32_t column = std::min(static_cast<uint32_t>(x), entry.count - 1);
+    const AliasEntry& alias = aliasTable_[entry.first + column];
+    return (x - column) < alias.threshold ? alias.primary : alias.alias;
+}
+
+size_t LSystem::measureRange(const std::string& input, size_t begin, size_t end, uint32_t generation) const {
+    size_t length = 0;
+    
+    for (size_t i = begin; i < end; ++i) {
+        const CompiledRule& entry = dispatch_[static_cast<unsigned char>(input[i])];
+        switch (entry.kind) {
+            case CompiledRule::Identity:
+                length += 1;
+                break;
+            case CompiledRule::Deterministic:
+                length += successors_[entry.first].second;
+                break;
+            default:
+                length += successors_[selectSuccessor(entry, input, i, generation)].second;
+                break;
+        }
+    }
+    return length;
+}
+
+void LSystem::writeRange(const std::string& input, size_t begin, size_t end, uint32_t generation, char* out) const {
+    const char* pool = successorPool_.data();
+    
+    size_t i = begin;
+    while (i < end) {
+        // Bulk-copy runs of symbols without a rule
+        size_t run = i;
+        while (i < end && dispatch_[static_cast<unsigned char>(input[i])].kind == CompiledRule::Identity) {
+            ++i;
+        }
+        if (i != run) {
+            std::memcpy(out, input.data() + run, i - run);
+            out += i - run;
+            if (i == end) break;
+        }
+        
+        const CompiledRule& entry = dispatch_[static_cast<unsigned char>(input[i])];
+        uint32_t id = entry.kind == CompiledRule::Deterministic
+                    ? entry.first : selectSuccessor(entry, input, i, generation);
+        const auto& successor = successors_[id];
+        std::memcpy(out, pool + successor.first, successor.second);
+        out += successor.second;
+        ++i;
+    }
+}
+
+void LSystem::buildContextTables(const std::string& input) {
+    size_t n = input.size();
+    leftContext_.resize(n);
+    rightContext_.resize(n);
+    std::vector<uint32_t> saved;
+    
+    // Left context: the last non-ignored symbol on the path back toward the
+    // root. Entering a branch keeps the parent's context; leaving it restores
+    // the context from before the branch, so sibling subtrees are skipped.
+    uint32_t last = kNoContext;
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char symbol = static_cast<unsigned char>(input[i]);
+        leftContext_[i] = last;
+        if (symbol == '[') {
+            saved.push_back(last);
+        } else if (symbol == ']') {
+            if (!saved.empty()) {
+                last = saved.back();
+                saved.pop_back();
+            }
+        } else if (!contextIgnore_[symbol]) {
+            last = static_cast<uint32_t>(i);
         }
     }
     
-    return output.str();
+    // Right context: the next non-ignored symbol on the same branch, skipping
+    // whole bracketed subtrees; the end of a branch has none
+    saved.clear();
+    uint32_t next = kNoContext;
+    for (size_t i = n; i-- > 0;) {
+        unsigned char symbol = static_cast<unsigned char>(input[i]);
+        rightContext_[i] = next;
+        if (symbol == ']') {
+            saved.push_back(next);
+            next = kNoContext;
+        } else if (symbol == '[') {
+            if (!saved.empty()) {
+                next = saved.back();
+                saved.pop_back();
+            }
+        } else if (!contextIgnore_[symbol]) {
+            next = static_cast<uint32_t>(i);
+        }
+    }
 }
 
-char LSystem::applyRule(char symbol) {
-    return symbol; // Not used in current implementation
+bool LSystem::matchesContext(const ContextRule& rule, const std::string& input, size_t index) const {
+    uint32_t j = leftContext_[index];
+    for (size_t k = rule.left.size(); k-- > 0;) {
+        if (j == kNoContext || input[j] != rule.left[k]) return false;
+        j = leftContext_[j];
+    }
+    
+    j = rightContext_[index];
+    for (size_t k = 0; k < rule.right.size(); ++k) {
+        if (j == kNoContext || input[j] != rule.right[k]) return false;
+        j = rightContext_[j];
+    }
+    return true;
+}
+
+uint32_t LSystem::selectSuccessor(const CompiledRule& entry, const std::string& input, size_t index,
+                                  uint32_t generation) const {
+    const CompiledRule* rule = &entry;
+    if (entry.kind == CompiledRule::Contextual) {
+        for (uint32_t c = entry.first; c < entry.first + entry.count; ++c) {
+            if (matchesContext(*compiledContext_[c].first, input, index)) {
+                return compiledContext_[c].second;
+            }
+        }
+        rule = &contextFallback_[static_cast<unsigned char>(input[index])];
+    }
+    return rule->kind == CompiledRule::Deterministic
+         ? rule->first : sampleProduction(*rule, generation, index);
+}
+
+void LSystem::applyRules(const std::string& input, std::string& output, uint32_t generation) {
+    // Context tables are built once per generation, so each context lookup
+    // is a couple of array reads
+    if (!contextRules_.empty()) {
+        buildContextTables(input);
+    }
+    
+    // Split into chunks; a single chunk when the input is small or we run serially
+    int threads = resolveThreadCount(threadCount_);
+    size_t chunks = 1;
+    if (threads > 1 && input.size() >= kParallelMinSymbols) {
+        chunks = std::min(threads * kChunksPerThread, input.size() / 1024);
+    }
+    size_t chunkSize = (input.size() + chunks - 1) / std::max<size_t>(chunks, 1);
+    
+    // Sizing pass: exact output length of every chunk
+    chunkOffsets_.assign(chunks + 1, 0);
+    parallelFor(chunks, threads, [&](size_t c) {
+        size_t begin = std::min(c * chunkSize, input.size());
+        size_t end = std::min(begin + chunkSize, input.size());
+        chunkOffsets_[c + 1] = measureRange(input, begin, end, generation);
+    });
+    
+    // Prefix sum turns lengths into output offsets
+    for (size_t c = 0; c < chunks; ++c) {
+        chunkOffsets_[c + 1] += chunkOffsets_[c];
+    }
+    
+    // Write pass into the reused back buffer (no per-symbol allocation)
+    output.resize(chunkOffsets_[chunks]);
+    char* out = &output[0];
+    parallelFor(chunks, threads, [&](size_t c) {
+        size_t begin = std::min(c * chunkSize, input.size());
+        size_t end = std::min(begin + chunkSize, input.size());
+        writeRange(input, begin, end, generation, out + chunkOffsets_[c]);
+    });
 }
 
 void LSystem::loadPreset(const std::string& presetName) {
+    if (library_ && library_->apply(presetName, *this)) {
+        return;
+    }
+    
     clearRules();
     
     if (presetName == "Simple Branch") {
@@ -143,6 +847,21 @@ void LSystem::loadPreset(const std::string& presetName) {
         addRule('F', "F[+FL][-FL]F");
         addRule('L', "L");
         
+    } else if (presetName == "Signal Propagation") {
+        // Context-sensitive plant driven by 0/1 signals (ABOP fig. 1.31a)
+        setAxiom("F1F1F1");
+        setContextIgnore("+-F");
+        addContextRule("0", '0', "0", "0");
+        addContextRule("0", '0', "1", "1[+F1F1]");
+        addContextRule("0", '1', "0", "1");
+        addContextRule("0", '1', "1", "1");
+        addContextRule("1", '0', "0", "0");
+        addContextRule("1", '0', "1", "1F1");
+        addContextRule("1", '1', "0", "0");
+        addContextRule("1", '1', "1", "0");
+        addRule('+', "-");
+        addRule('-', "+");
+        
     } else {
         // Default: simple tree
         setAxiom("F");
@@ -151,6 +870,10 @@ void LSystem::loadPreset(const std::string& presetName) {
 }
 
 std::vector<std::string> LSystem::getAvailablePresets() const {
+    if (library_ && library_->size() > 0) {
+        return library_->getNames();
+    }
+    
     return {
         "Simple Branch",
         "Fractal Tree",
@@ -159,6 +882,7 @@ std::vector<std::string> LSystem::getAvailablePresets() const {
         "3D Tree",
         "Stochastic Tree",
         "Complex 3D Plant",
-        "Leaf Pattern"
+        "Leaf Pattern",
+        "Signal Propagation"
     };
 }
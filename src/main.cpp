@@ -1,6 +1,11 @@
-#include "LSystem.h"
-#include "Turtle.h"
-#include "Renderer.h"
+#include "lsystem.h"
+#include "turtle.h"
+#include "renderer.h"
+#include "softwarerenderer.h"
+#include "presetlibrary.h"
+#include "bvh.h"
+#include "scene.h"
+#include "catalog.h"
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
 #include <imgui_impl_opengl3.h>
@@ -8,7 +13,33 @@
 #include <cmath>
 #include <algorithm>
 
-int main() {
+static void printUsage() {
+    std::cerr << "Usage: plant_modeler [--headless [--output DIR] [--size WxH] [--format png|ppm]\n"
+                 "                     [--preset NAME]... [--iterations N] [--camera DIST,PITCH,YAW]\n"
+                 "                     [--instanced] [--parametric] [--software [--threads N]]]\n";
+}
+
+const char* instancedPath(const Renderer& renderer) {
+    return renderer.isGpuInstancing() ? "instanced calls" : "flattened buffers";
+}
+
+int main(int argc, char** argv) {
+    bool headless = false;
+    HeadlessOptions headlessOptions;
+    if (!parseHeadlessOptions(argc, argv, headless, headlessOptions)) {
+        printUsage();
+        return -1;
+    }
+    if (headless && headlessOptions.software) {
+        SoftwareRenderer renderer;
+        renderer.setThreadCount(headlessOptions.threads);
+        return renderCatalog(renderer, headlessOptions);
+    }
+    if (headless) {
+        Renderer renderer;
+        return renderCatalog(renderer, headlessOptions);
+    }
+    
     // Initialize renderer
     Renderer renderer;
     if (!renderer.initialize(1280, 720, "Procedural Plant Modeling - L-Systems")) {
@@ -26,7 +57,22 @@ int main() {
     
     // Create L-system and turtle
     LSystem lsystem;
+    lsystem.setSymbolBudget(64u << 20);  // Clamp iterations past 64M symbols
     Turtle turtle;
+    turtle.setMergeStraightRuns(true);  // One cylinder per straight F run
+    InstancedPlant instancedPlant;
+    bool shareSubtrees = false;  // Instanced DAG when the grammar allows it; drops tropism,
+                                 // which bends each copy of a subtree differently
+    bool instanced = false;
+    PlantLOD plantLOD;           // Welded stem meshes at decreasing detail
+    bool useBranchMesh = true;   // Draw 3D stems from plantLOD instead of per cylinder
+    PlantBVH plantBVH;           // Spatial index over the turtle's cylinders and leaves
+    bool hasSelection = false;   // Last right click hit the plant
+    RayHit selection = {};
+    Scene forest;                // Instances of the current and next two presets
+    bool forestMode = false;
+    bool forestStale = true;     // Species or their parameters changed
+    const size_t forestInstances = 2000;  // CUSTOMIZATION: plants in the forest
     
     // UI state
     int iterations = 4;
@@ -38,12 +84,39 @@ int main() {
     glm::vec3 tropism(0.0f, -0.1f, 0.0f);
     bool mode3D = true;
     bool autoRegenerate = true;
-    bool needsRegenerate = true;
+    bool needsDerivation = true;      // Grammar or iteration count changed
+    bool needsInterpretation = true;  // Only turtle parameters changed
+    bool programStale = true;         // Turtle's compiled program isn't of the derived string
+    const std::string* derived = nullptr;
+    GenerationStats prediction = {};
+    bool streamed = false;            // Interpreted from the derivation, past the symbol budget
     
-    // Preset management
+    // Preset management: grammars come from the compiled preset library when
+    // it is available, the built-in presets otherwise
+    PresetLibrary presetLibrary;
+    if (PresetLibrary::compile("presets/plants.lsys", "build/plants.lsyb") &&
+        presetLibrary.open("build/plants.lsyb")) {
+        lsystem.setPresetLibrary(&presetLibrary);
+    }
     std::vector<std::string> presets = lsystem.getAvailablePresets();
     int currentPreset = 0;
-    lsystem.loadPreset(presets[currentPreset]);
+    forest.setPresetLibrary(presetLibrary.isOpen() ? &presetLibrary : nullptr);
+    
+    // Load a preset along with any turtle parameters it specifies
+    auto loadPreset = [&](const std::string& name) {
+        lsystem.loadPreset(name);
+        PresetTurtle params;
+        if (!presetLibrary.isOpen() || !presetLibrary.getTurtle(name, params)) return;
+        if (params.mask & PresetTurtle::Angle) angle = params.angle;
+        if (params.mask & PresetTurtle::StepLength) stepLength = params.stepLength;
+        if (params.mask & PresetTurtle::StepWidth) stepWidth = params.stepWidth;
+        if (params.mask & PresetTurtle::LengthScale) lengthScale = params.lengthScale;
+        if (params.mask & PresetTurtle::WidthScale) widthScale = params.widthScale;
+        if (params.mask & PresetTurtle::Tropism) {
+            tropism = glm::vec3(params.tropism[0], params.tropism[1], params.tropism[2]);
+        }
+    };
+    loadPreset(presets[currentPreset]);
     
     // Custom rule editing
     char axiomBuffer[256] = "F";
@@ -60,49 +133,125 @@ int main() {
         float deltaTime = currentTime - lastFrameTime;
         lastFrameTime = currentTime;
         
-        // Regenerate L-system if needed
-        if (needsRegenerate) {
-            std::string result = lsystem.generate(iterations);
-            
+        // Re-derive only when the grammar or iteration count changed; the
+        // L-system cache makes N -> N+1 a single rewrite step
+        if (needsDerivation) {
+            prediction = lsystem.predict(iterations);
+            derived = &lsystem.generate(iterations);
+            streamed = shouldStream(lsystem, turtle, prediction);
+            needsDerivation = false;
+            needsInterpretation = true;
+            programStale = true;
+            plantBVH.clear();
+        }
+        
+        // Turtle-only edits reuse the derived string as is
+        if (needsInterpretation) {
             turtle.setAngle(angle);
             turtle.setStepLength(stepLength);
             turtle.setStepWidth(stepWidth);
             turtle.setLengthScale(lengthScale);
             turtle.setWidthScale(widthScale);
-            turtle.setTropism(tropism);
+            turtle.setTropism(shareSubtrees ? glm::vec3(0.0f) : tropism);
             turtle.set3DMode(mode3D);
             
-            turtle.interpret(result);
+            int depth = streamed ? iterations : lsystem.getIterations();
+            instanced = shareSubtrees && turtle.interpretInstanced(lsystem, depth, instancedPlant);
+            if (!instanced && streamed) {
+                turtle.interpret(lsystem, depth);   // Keeps no program, so nothing to replay
+            } else if (!instanced && (programStale || !turtle.reinterpret())) {
+                turtle.interpret(*derived);
+                programStale = false;
+            }
+            plantLOD.clear();
+            if (!instanced && mode3D && useBranchMesh) {
+                plantLOD.build(turtle.getSegments(), turtle.getLeaves(), turtle.getMinBounds(), turtle.getMaxBounds());
+            }
             
-            // Auto-center camera around the plant root (bottom-most point)
-            glm::vec3 minBounds = turtle.getMinBounds();
-            glm::vec3 maxBounds = turtle.getMaxBounds();
-            glm::vec3 center = (minBounds + maxBounds) * 0.5f;
-            glm::vec3 size = maxBounds - minBounds;
-            glm::vec3 rootPosition = turtle.getRootPosition();
-            glm::vec3 rootTarget(rootPosition.x, rootPosition.y, rootPosition.z);
-            float horizontalSpan = std::max(size.x, size.z);
-            float dominantSpan = std::max(horizontalSpan, size.y);
+            // Same string, same primitives: parameter edits only move them
+            if (instanced) {
+                plantBVH.clear();
+            } else if (!plantBVH.refit(turtle.getSegments(), turtle.getLeaves()) || plantBVH.empty()) {
+                plantBVH.build(turtle.getSegments(), turtle.getLeaves());
+            }
+            hasSelection = false;
             
-            // Set camera to look at the root while keeping the entire plant in view
+            // Auto-center camera around the plant root (bottom-most point)
             const float targetOffsetX = -8.0f; // CUSTOMIZATION: shift to nudge root horizontally in viewport
-            const float targetOffsetY = 0.0f; // CUSTOMIZATION: shift to raise/lower root framing
-            renderer.cameraTarget_ = rootTarget + glm::vec3(targetOffsetX, targetOffsetY, 0.0f);
-            const float zoomTightness = 1.85f; // CUSTOMIZATION: raise/lower to change auto zoom framing
-            const float minZoom = 3.0f;        // CUSTOMIZATION: lowest camera distance allowed on regen
-            renderer.cameraDistance = std::max(dominantSpan * zoomTightness, minZoom);
-            renderer.cameraRotationX = 25.0f;
-            renderer.cameraRotationY = 45.0f;
+            frameCamera(renderer, turtle, targetOffsetX);
+            
+            needsInterpretation = false;
+            forestStale = true;
+        }
+        
+        // The forest mixes the current plant, as edited, with the next two
+        // presets as their grammars define them; geometry of keys seen
+        // before is reused
+        if (forestMode && forestStale) {
+            ScatterOptions options;
+            options.count = forestInstances;
+            for (size_t k = 0; k < std::min<size_t>(3, presets.size()); ++k) {
+                PlantKey key;
+                key.preset = presets[(currentPreset + k) % presets.size()];
+                key.iterations = iterations;
+                PresetTurtle params;
+                if (k == 0) {
+                    key.angle = angle;
+                    key.stepLength = stepLength;
+                    key.stepWidth = stepWidth;
+                    key.lengthScale = lengthScale;
+                    key.widthScale = widthScale;
+                    key.tropism = tropism;
+                } else if (presetLibrary.isOpen() && presetLibrary.getTurtle(key.preset, params)) {
+                    if (params.mask & PresetTurtle::Angle) key.angle = params.angle;
+                    if (params.mask & PresetTurtle::StepLength) key.stepLength = params.stepLength;
+                    if (params.mask & PresetTurtle::StepWidth) key.stepWidth = params.stepWidth;
+                    if (params.mask & PresetTurtle::LengthScale) key.lengthScale = params.lengthScale;
+                    if (params.mask & PresetTurtle::WidthScale) key.widthScale = params.widthScale;
+                    if (params.mask & PresetTurtle::Tropism) {
+                        key.tropism = glm::vec3(params.tropism[0], params.tropism[1], params.tropism[2]);
+                    }
+                }
+                options.species.push_back(key);
+            }
+            forest.scatter(options);
             
-            needsRegenerate = false;
+            // Overlook the whole forest
+            renderer.cameraTarget_ = glm::vec3(-options.extent * 0.3f, 0.0f, 0.0f);
+            renderer.cameraDistance = options.extent * 2.2f;
+            renderer.cameraRotationX = 30.0f;
+            renderer.cameraRotationY = 45.0f;
+            hasSelection = false;
+            forestStale = false;
         }
         
         // Update camera
         renderer.updateCamera(deltaTime);
         
+        // Right click picks the branch or leaf under the cursor
+        if (!forestMode && !io.WantCaptureMouse && ImGui::IsMouseClicked(1)) {
+            glm::vec3 rayOrigin, rayDirection;
+            hasSelection = renderer.getViewRay(io.MousePos.x, io.MousePos.y, rayOrigin, rayDirection) &&
+                           plantBVH.intersect(rayOrigin, rayDirection, selection);
+        }
+        
         // Render
+        double drawStarted = glfwGetTime();
+        double drawTime = 0.0;
         renderer.beginFrame();
-        renderer.render(turtle);
+        if (forestMode) {
+            renderer.render(forest);
+            // Wait for the GPU, so the time covers the draw rather than its
+            // submission; the loop's own period is pinned to vsync
+            glFinish();
+            drawTime = glfwGetTime() - drawStarted;
+        } else if (instanced) {
+            renderer.render(instancedPlant);
+        } else if (mode3D && useBranchMesh) {
+            renderer.render(plantLOD);
+        } else {
+            renderer.render(turtle);
+        }
         
         // ImGui UI
         ImGui_ImplOpenGL3_NewFrame();
@@ -129,7 +278,7 @@ int main() {
         // Action buttons
         ImGui::Separator();
         if (!autoRegenerate && ImGui::Button("Regenerate Plant")) {
-            needsRegenerate = true;
+            needsDerivation = true;
         }
         
         if (ImGui::Button("Reset to Default")) {
@@ -141,17 +290,29 @@ int main() {
             widthScale = 0.7f;
             tropism = glm::vec3(0.0f, -0.1f, 0.0f);
             mode3D = true;
+            shareSubtrees = false;
             currentPreset = 0;
-            lsystem.loadPreset(presets[currentPreset]);
+            loadPreset(presets[currentPreset]);
             autoRegenerate = true;
             renderer.resetCamera();
-            needsRegenerate = true;
+            needsDerivation = true;
+        }
+        
+        if (ImGui::Button(shareSubtrees ? "Apply Tropism" : "Share Subtrees (No Tropism)")) {
+            shareSubtrees = !shareSubtrees;
+            needsInterpretation = true;
+        }
+        
+        if (ImGui::Button(forestMode ? "Show Single Plant" : "Show Forest")) {
+            forestMode = !forestMode;
+            needsInterpretation = true;     // Reframes the camera either way
         }
         
         ImGui::Separator();
         ImGui::Text("Controls:");
         ImGui::BulletText("Left Mouse: Rotate camera");
         ImGui::BulletText("Scroll: Zoom in/out");
+        ImGui::BulletText("Right Mouse: Select branch or leaf");
         
         ImGui::End();
         
@@ -165,18 +326,57 @@ int main() {
         ImGui::Begin("Plant Information", nullptr, ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoResize);
         ImGui::Text("Current Preset: %s", presets[currentPreset].c_str());
         ImGui::Text("Axiom: %s", lsystem.getAxiom().c_str());
-        ImGui::Text("Generation: %d", iterations);
+        ImGui::Text("Generation: %d", lsystem.getIterations());
         ImGui::Text("String Length: %zu", lsystem.getCurrentString().length());
+        if (streamed) {
+            ImGui::TextColored(ImVec4(1.0f, 0.6f, 0.2f, 1.0f), "Streamed at %d iterations (past symbol budget)",
+                               iterations);
+        } else if (lsystem.wasClamped()) {
+            ImGui::TextColored(ImVec4(1.0f, 0.6f, 0.2f, 1.0f), "Clamped from %d iterations (symbol budget)",
+                               iterations);
+        }
+        ImGui::Text("Predicted at %d: %.3g symbols%s", prediction.iterations, prediction.length,
+                    prediction.exact ? "" : " (expected)");
+        ImGui::Text("Predicted memory: %.1f MB string, %.1f MB geometry",
+                    prediction.stringBytes / (1024.0 * 1024.0),
+                    turtle.projectedGeometryBytes(prediction) / (1024.0 * 1024.0));
         
-        if (mode3D) {
-            ImGui::Text("Cylinders: %zu", turtle.getCylinders().size());
+        if (forestMode) {
+            ImGui::Text("Forest: %zu instances of %zu geometries", forest.getInstances().size(),
+                        forest.getGeometries().size());
+            ImGui::Text("Triangles: %zu (%zu drawn from %zu instances)", forest.getTriangleCount(),
+                        renderer.getSceneTrianglesDrawn(), renderer.getSceneInstancesDrawn());
+            ImGui::Text("Draw time: %.2f ms", drawTime * 1000.0);
+        } else if (instanced) {
+            ImGui::Text("Cylinders: %zu", instancedPlant.getCylinderCount());
+            ImGui::Text("Leaves: %zu", instancedPlant.getLeafCount());
+            ImGui::Text("Prototypes: %zu (%zu placements)", instancedPlant.getPrototypes().size(),
+                        instancedPlant.getPlacementCount());
+            ImGui::Text("Drawn with: %s", instancedPath(renderer));
+        } else if (mode3D) {
+            if (shareSubtrees) {
+                ImGui::TextColored(ImVec4(1.0f, 0.6f, 0.2f, 1.0f), "Subtrees not shared (stochastic or context rules)");
+            }
+            ImGui::Text("Cylinders: %zu", turtle.getSegments().size());
             ImGui::Text("Leaves: %zu", turtle.getLeaves().size());
+            if (useBranchMesh && plantLOD.getLevelCount() > 0) {
+                const LODLevel& level = plantLOD.getLevel(renderer.getSelectedLOD());
+                ImGui::Text("LOD %zu (error %.4f): %zu vertices, %zu triangles", renderer.getSelectedLOD(),
+                            level.error, level.mesh.getVertexCount(), level.mesh.getTriangleCount());
+            }
         } else {
-            ImGui::Text("Line Segments: %zu", turtle.getLines().size());
+            ImGui::Text("Line Segments: %zu", turtle.getSegments().size());
         }
+        const CullStats& culling = renderer.getCullStats();
+        ImGui::Text("Clusters: %zu of %zu drawn (%zu off-screen, %zu sub-pixel, %zu occluded)",
+                    culling.drawn(), culling.tested, culling.outsideFrustum, culling.subPixel, culling.occluded);
         
         glm::vec3 bounds = turtle.getMaxBounds() - turtle.getMinBounds();
         ImGui::Text("Plant Size: %.2f x %.2f x %.2f", bounds.x, bounds.y, bounds.z);
+        if (hasSelection) {
+            ImGui::Text("Selected: %s %u, symbol %u", selection.primitive.kind == PrimitiveRef::Segment
+                        ? "cylinder" : "leaf", selection.primitive.index, selection.symbol);
+        }
         ImGui::End();
         
         ImGui::Render();
@@ -0,0 +1,521 @@
+#include "parametric.h"
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+// Deepest operand stack any compiled expression may need
+static const int kMaxStackDepth = 32;
+
+std::string ModuleString::toString() const {
+    std::ostringstream out;
+    for (size_t i = 0; i < symbols.size(); ++i) {
+        out << symbols[i];
+        size_t count = paramCount(i);
+        if (count == 0) continue;
+
+        out << '(';
+        for (size_t p = 0; p < count; ++p) {
+            if (p > 0) out << ',';
+            out << paramsOf(i)[p];
+        }
+        out << ')';
+    }
+    return out.str();
+}
+
+namespace {
+
+// Recursive-descent compiler from infix expressions to stack bytecode.
+// Precedence (low to high): || && comparisons + - * / unary ^
+class ExpressionCompiler {
+public:
+    ExpressionCompiler(const std::string& text, size_t pos,
+                       const std::vector<std::string>& params,
+                       const std::map<std::string, float>& constants,
+                       std::vector<Instruction>& code)
+        : text_(text), pos_(pos), params_(params), constants_(constants),
+          code_(code), depth_(0), maxDepth_(0), error_() {}
+
+    // Compile one expression starting at the current position
+    bool compile() {
+        parseOr();
+        if (error_.empty() && maxDepth_ > kMaxStackDepth) {
+            error_ = "expression too deeply nested";
+        }
+        return error_.empty();
+    }
+
+    size_t position() const { return pos_; }
+    const std::string& error() const { return error_; }
+
+private:
+    const std::string& text_;
+    size_t pos_;
+    const std::vector<std::string>& params_;
+    const std::map<std::string, float>& constants_;
+    std::vector<Instruction>& code_;
+    int depth_;
+    int maxDepth_;
+    std::string error_;
+
+    void skipSpace() {
+        while (pos_ < text_.size() && std::isspace(static_cast<unsigned char>(text_[pos_]))) ++pos_;
+    }
+
+    bool match(const char* token) {
+        skipSpace();
+        size_t length = std::strlen(token);
+        if (text_.compare(pos_, length, token) == 0) {
+            pos_ += length;
+            return true;
+        }
+        return false;
+    }
+
+    void emit(OpCode op, uint32_t index = 0, float value = 0.0f) {
+        code_.push_back({op, index, value});
+        if (op == OpCode::PushConst || op == OpCode::PushParam) {
+            maxDepth_ = std::max(maxDepth_, ++depth_);
+        } else if (op != OpCode::Neg && op != OpCode::Not) {
+            --depth_;  // Binary operators pop two and push one
+        }
+    }
+
+    void parseOr() {
+        parseAnd();
+        while (error_.empty() && match("||")) { parseAnd(); emit(OpCode::Or); }
+    }
+
+    void parseAnd() {
+        parseComparison();
+        while (error_.empty() && match("&&")) { parseComparison(); emit(OpCode::And); }
+    }
+
+    void parseComparison() {
+        parseAdditive();
+        if (!error_.empty()) return;
+
+        // Two-character operators first so "<=" is not read as "<"
+        OpCode op;
+        if (match("<=")) op = OpCode::LessEqual;
+        else if (match(">=")) op = OpCode::GreaterEqual;
+        else if (match("==")) op = OpCode::Equal;
+        else if (match("!=")) op = OpCode::NotEqual;
+        else if (match("<")) op = OpCode::Less;
+        else if (match(">")) op = OpCode::Greater;
+        else return;
+
+        parseAdditive();
+        emit(op);
+    }
+
+    void parseAdditive() {
+        parseMultiplicative();
+        while (error_.empty()) {
+            if (match("+")) { parseMultiplicative(); emit(OpCode::Add); }
+            else if (match("-")) { parseMultiplicative(); emit(OpCode::Sub); }
+            else break;
+        }
+    }
+
+    void parseMultiplicative() {
+        parseUnary();
+        while (error_.empty()) {
+            if (match("*")) { parseUnary(); emit(OpCode::Mul); }
+            else if (match("/")) { parseUnary(); emit(OpCode::Div); }
+            else break;
+        }
+    }
+
+    void parseUnary() {
+        if (match("-")) { parseUnary(); emit(OpCode::Neg); return; }
+        if (match("!")) { parseUnary(); emit(OpCode::Not); return; }
+        parsePower();
+    }
+
+    void parsePower() {
+        parsePrimary();
+        if (error_.empty() && match("^")) { parseUnary(); emit(OpCode::Pow); }
+    }
+
+    void parsePrimary() {
+        skipSpace();
+        if (pos_ >= text_.size()) {
+            error_ = "unexpected end of expression";
+            return;
+        }
+
+        char c = text_[pos_];
+        if (c == '(') {
+            ++pos_;
+            parseOr();
+            if (error_.empty() && !match(")")) error_ = "expected ')'";
+            return;
+        }
+
+        if (std::isdigit(static_cast<unsigned char>(c)) || c == '.') {
+            const char* begin = text_.c_str() + pos_;
+            char* end = nullptr;
+            float value = std::strtof(begin, &end);
+            pos_ += end - begin;
+            emit(OpCode::PushConst, 0, value);
+            return;
+        }
+
+        if (std::isalpha(static_cast<unsigned char>(c)) || c == '_') {
+            size_t start = pos_;
+            while (pos_ < text_.size() &&
+                   (std::isalnum(static_cast<unsigned char>(text_[pos_])) || text_[pos_] == '_')) {
+                ++pos_;
+            }
+            std::string name = text_.substr(start, pos_ - start);
+
+            for (size_t i = 0; i < params_.size(); ++i) {
+                if (params_[i] == name) {
+                    emit(OpCode::PushParam, static_cast<uint32_t>(i));
+                    return;
+                }
+            }
+            auto constant = constants_.find(name);
+            if (constant != constants_.end()) {
+                emit(OpCode::PushConst, 0, constant->second);
+                return;
+            }
+            error_ = "unknown name '" + name + "'";
+            return;
+        }
+
+        error_ = std::string("unexpected '") + c + "'";
+    }
+};
+
+// Evaluate bytecode on a fixed-size operand stack
+inline float runBytecode(const Instruction* code, uint32_t count, const float* params) {
+    float stack[kMaxStackDepth];
+    int top = -1;
+
+    for (const Instruction* ins = code, *end = code + count; ins != end; ++ins) {
+        switch (ins->op) {
+            case OpCode::PushConst: stack[++top] = ins->value; break;
+            case OpCode::PushParam: stack[++top] = params[ins->index]; break;
+            case OpCode::Add: --top; stack[top] += stack[top + 1]; break;
+            case OpCode::Sub: --top; stack[top] -= stack[top + 1]; break;
+            case OpCode::Mul: --top; stack[top] *= stack[top + 1]; break;
+            case OpCode::Div: --top; stack[top] /= stack[top + 1]; break;
+            case OpCode::Pow: --top; stack[top] = std::pow(stack[top], stack[top + 1]); break;
+            case OpCode::Neg: stack[top] = -stack[top]; break;
+            case OpCode::Less: --top; stack[top] = stack[top] < stack[top + 1]; break;
+            case OpCode::Greater: --top; stack[top] = stack[top] > stack[top + 1]; break;
+            case OpCode::LessEqual: --top; stack[top] = stack[top] <= stack[top + 1]; break;
+            case OpCode::GreaterEqual: --top; stack[top] = stack[top] >= stack[top + 1]; break;
+            case OpCode::Equal: --top; stack[top] = stack[top] == stack[top + 1]; break;
+            case OpCode::NotEqual: --top; stack[top] = stack[top] != stack[top + 1]; break;
+            case OpCode::And: --top; stack[top] = (stack[top] != 0.0f) && (stack[top + 1] != 0.0f); break;
+            case OpCode::Or: --top; stack[top] = (stack[top] != 0.0f) || (stack[top + 1] != 0.0f); break;
+            case OpCode::Not: stack[top] = stack[top] == 0.0f; break;
+        }
+    }
+    return stack[0];
+}
+
+void skipSpace(const std::string& text, size_t& pos) {
+    while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) ++pos;
+}
+
+} // namespace
+
+ParametricLSystem::ParametricLSystem() : currentIterations_(0) {
+    setAxiom("F");
+}
+
+bool ParametricLSystem::setAxiom(const std::string& axiom) {
+    // Axiom parameters are constant expressions, evaluated right away
+    ModuleString parsed;
+    std::vector<Instruction> code;
+    std::vector<std::string> noParams;
+    std::vector<float> values;
+
+    size_t pos = 0;
+    skipSpace(axiom, pos);
+    while (pos < axiom.size()) {
+        char symbol = axiom[pos++];
+        values.clear();
+
+        skipSpace(axiom, pos);
+        if (pos < axiom.size() && axiom[pos] == '(') {
+            ++pos;
+            for (;;) {
+                code.clear();
+                ExpressionCompiler compiler(axiom, pos, noParams, constants_, code);
+                if (!compiler.compile()) {
+                    std::cerr << "Axiom error: " << compiler.error() << std::endl;
+                    return false;
+                }
+                values.push_back(runBytecode(code.data(), static_cast<uint32_t>(code.size()), nullptr));
+                pos = compiler.position();
+                skipSpace(axiom, pos);
+                if (pos < axiom.size() && axiom[pos] == ',') { ++pos; continue; }
+                if (pos < axiom.size() && axiom[pos] == ')') { ++pos; break; }
+                std::cerr << "Axiom error: expected ',' or ')'" << std::endl;
+                return false;
+            }
+        }
+
+        parsed.append(symbol, values.data(), values.size());
+        skipSpace(axiom, pos);
+    }
+
+    axiom_ = parsed;
+    current_ = axiom_;
+    currentIterations_ = 0;
+    return true;
+}
+
+bool ParametricLSystem::addRule(const std::string& rule) {
+    size_t arrow = rule.find("->");
+    if (arrow == std::string::npos) {
+        std::cerr << "Rule error: missing '->' in \"" << rule << "\"" << std::endl;
+        return false;
+    }
+
+    // Predecessor: symbol with optional formal parameter list
+    size_t pos = 0;
+    skipSpace(rule, pos);
+    if (pos >= arrow) {
+        std::cerr << "Rule error: missing predecessor" << std::endl;
+        return false;
+    }
+    char predecessor = rule[pos++];
+    std::vector<std::string> params;
+
+    skipSpace(rule, pos);
+    if (pos < arrow && rule[pos] == '(') {
+        size_t close = rule.find(')', pos);
+        if (close == std::string::npos || close > arrow) {
+            std::cerr << "Rule error: unterminated parameter list" << std::endl;
+            return false;
+        }
+        std::stringstream list(rule.substr(pos + 1, close - pos - 1));
+        std::string name;
+        while (std::getline(list, name, ',')) {
+            size_t first = name.find_first_not_of(" \t");
+            size_t last = name.find_last_not_of(" \t");
+            if (first == std::string::npos) {
+                std::cerr << "Rule error: empty parameter name" << std::endl;
+                return false;
+            }
+            params.push_back(name.substr(first, last - first + 1));
+        }
+        pos = close + 1;
+    }
+
+    // Compile into scratch copies so a failed rule leaves no partial state
+    std::vector<Instruction> code = code_;
+    std::vector<Expression> expressions = expressions_;
+    std::vector<SuccessorModule> modules = modules_;
+
+    auto compileAt = [&](const std::string& text, size_t& at) -> bool {
+        uint32_t first = static_cast<uint32_t>(code.size());
+        ExpressionCompiler compiler(text, at, params, constants_, code);
+        if (!compiler.compile()) {
+            std::cerr << "Rule error: " << compiler.error() << " in \"" << rule << "\"" << std::endl;
+            return false;
+        }
+        at = compiler.position();
+        expressions.push_back({first, static_cast<uint32_t>(code.size()) - first});
+        return true;
+    };
+
+    CompiledRule compiled;
+    compiled.arity = static_cast<uint32_t>(params.size());
+    compiled.condition = -1;
+
+    // Optional guard between the predecessor and the arrow
+    skipSpace(rule, pos);
+    if (pos < arrow && rule[pos] == ':') {
+        ++pos;
+        std::string guard = rule.substr(0, arrow);
+        skipSpace(guard, pos);
+        if (guard.compare(pos, 1, "*") != 0) {
+            compiled.condition = static_cast<int32_t>(expressions.size());
+            if (!compileAt(guard, pos)) return false;
+            skipSpace(guard, pos);
+            if (pos != guard.size()) {
+                std::cerr << "Rule error: unexpected text after condition in \"" << rule << "\"" << std::endl;
+                return false;
+            }
+        }
+    }
+
+    // Successor modules with actual parameter expressions
+    compiled.firstModule = static_cast<uint32_t>(modules.size());
+    compiled.paramTotal = 0;
+    pos = arrow + 2;
+    skipSpace(rule, pos);
+    while (pos < rule.size()) {
+        SuccessorModule module;
+        module.symbol = rule[pos++];
+        module.firstExpression = static_cast<uint32_t>(expressions.size());
+
+        skipSpace(rule, pos);
+        if (pos < rule.size() && rule[pos] == '(') {
+            ++pos;
+            for (;;) {
+                if (!compileAt(rule, pos)) return false;
+                skipSpace(rule, pos);
+                if (pos < rule.size() && rule[pos] == ',') { ++pos; continue; }
+                if (pos < rule.size() && rule[pos] == ')') { ++pos; break; }
+                std::cerr << "Rule error: expected ',' or ')' in \"" << rule << "\"" << std::endl;
+                return false;
+            }
+        }
+
+        module.expressionCount = static_cast<uint32_t>(expressions.size()) - module.firstExpression;
+        compiled.paramTotal += module.expressionCount;
+        modules.push_back(module);
+        skipSpace(rule, pos);
+    }
+    compiled.moduleCount = static_cast<uint32_t>(modules.size()) - compiled.firstModule;
+
+    code_.swap(code);
+    expressions_.swap(expressions);
+    modules_.swap(modules);
+    rulesBySymbol_[static_cast<unsigned char>(predecessor)].push_back(static_cast<uint32_t>(rules_.size()));
+    rules_.push_back(compiled);
+    return true;
+}
+
+void ParametricLSystem::clearRules() {
+    code_.clear();
+    expressions_.clear();
+    modules_.clear();
+    rules_.clear();
+    for (auto& list : rulesBySymbol_) {
+        list.clear();
+    }
+}
+
+const ModuleString& ParametricLSystem::generate(int iterations) {
+    current_ = axiom_;
+    currentIterations_ = 0;
+    for (int i = 0; i < iterations; ++i) {
+        applyRules(current_, scratch_);
+        std::swap(current_, scratch_);
+        currentIterations_++;
+    }
+    return current_;
+}
+
+float ParametricLSystem::evaluate(const Expression& expression, const float* params) const {
+    return runBytecode(code_.data() + expression.first, expression.count, params);
+}
+
+int32_t ParametricLSystem::matchRule(char symbol, const float* params, size_t count) const {
+    // First rule (in insertion order) whose arity and guard both match
+    for (uint32_t index : rulesBySymbol_[static_cast<unsigned char>(symbol)]) {
+        const CompiledRule& rule = rules_[index];
+        if (rule.arity != count) continue;
+        if (rule.condition >= 0 && evaluate(expressions_[rule.condition], params) == 0.0f) continue;
+        return static_cast<int32_t>(index);
+    }
+    return -1;
+}
+
+void ParametricLSystem::applyRules(const ModuleString& input, ModuleString& output) {
+    size_t count = input.size();
+
+    // Matching pass: pick a rule per module and size the output exactly
+    choices_.resize(count);
+    size_t moduleTotal = 0;
+    size_t paramTotal = 0;
+    for (size_t i = 0; i < count; ++i) {
+        int32_t choice = matchRule(input.symbols[i], input.paramsOf(i), input.paramCount(i));
+        choices_[i] = choice;
+        if (choice < 0) {
+            moduleTotal += 1;
+            paramTotal += input.paramCount(i);
+        } else {
+            moduleTotal += rules_[choice].moduleCount;
+            paramTotal += rules_[choice].paramTotal;
+        }
+    }
+
+    output.symbols.resize(moduleTotal);
+    output.offsets.resize(moduleTotal + 1);
+    output.params.resize(paramTotal);
+
+    // Write pass: run successor bytecode straight into the output arrays
+    char* symbols = &output.symbols[0];
+    uint32_t* offsets = output.offsets.data();
+    float* params = output.params.data();
+    uint32_t written = 0;
+    offsets[0] = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        const float* actual = input.paramsOf(i);
+        int32_t choice = choices_[i];
+
+        if (choice < 0) {
+            // No rule: copy the module through
+            size_t n = input.paramCount(i);
+            *symbols++ = input.symbols[i];
+            std::memcpy(params + written, actual, n * sizeof(float));
+            written += static_cast<uint32_t>(n);
+            *++offsets = written;
+            continue;
+        }
+
+        const CompiledRule& rule = rules_[choice];
+        const SuccessorModule* module = modules_.data() + rule.firstModule;
+        for (uint32_t m = 0; m < rule.moduleCount; ++m, ++module) {
+            *symbols++ = module->symbol;
+            const Expression* expression = expressions_.data() + module->firstExpression;
+            for (uint32_t e = 0; e < module->expressionCount; ++e) {
+                params[written++] = evaluate(expression[e], actual);
+            }
+            *++offsets = written;
+        }
+    }
+}
+
+void ParametricLSystem::loadPreset(const std::string& presetName) {
+    clearRules();
+
+    if (presetName == "Parametric Monopodial") {
+        // Honda's monopodial tree (ABOP fig. 2.6)
+        setConstant("r1", 0.9f);
+        setConstant("r2", 0.6f);
+        setConstant("a0", 45.0f);
+        setConstant("a2", 45.0f);
+        setConstant("d", 137.5f);
+        setConstant("wr", 0.707f);
+        setAxiom("A(1,10)");
+        addRule("A(l,w) -> !(w)F(l)[&(a0)B(l*r2,w*wr)]/(d)A(l*r1,w*wr)");
+        addRule("B(l,w) -> !(w)F(l)[-(a2)C(l*r2,w*wr)]C(l*r1,w*wr)");
+        addRule("C(l,w) -> !(w)F(l)[+(a2)B(l*r2,w*wr)]B(l*r1,w*wr)");
+
+    } else if (presetName == "Parametric Growth") {
+        // Internodes elongate each step; apices branch until they get too short
+        setConstant("R", 1.456f);
+        setAxiom("!(2)A(1)");
+        addRule("A(s) : s >= 0.2 -> F(s)[+A(s/R)][-A(s/R)]");
+        addRule("F(s) -> F(s*R)");
+
+    } else {
+        // Default: parametric variant of the simple branch
+        setAxiom("!(4)F(27)");
+        addRule("F(l) -> F(l/3)[+F(l/3)]F(l/3)[-F(l/3)]F(l/3)");
+    }
+}
+
+std::vector<std::string> ParametricLSystem::getAvailablePresets() const {
+    return {
+        "Parametric Branch",
+        "Parametric Monopodial",
+        "Parametric Growth"
+    };
+}
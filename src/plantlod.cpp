@@ -0,0 +1,135 @@
+#include "plantlod.h"
+#include <cmath>
+#include <algorithm>
+#include <unordered_map>
+
+// Longest run of segments merged into one
+static const size_t kMaxMergeRun = 64;
+
+// Distance from p to the line through a and b
+static float distanceToLine(const glm::vec3& p, const glm::vec3& a, const glm::vec3& b) {
+    glm::vec3 axis = b - a;
+    float length = glm::length(axis);
+    if (length < 1e-6f) return glm::length(p - a);
+    return glm::length(glm::cross(p - a, axis)) / length;
+}
+
+PlantLOD::PlantLOD() : version_(0) {}
+
+void PlantLOD::clear() {
+    levels_.clear();
+    ++version_;
+}
+
+void PlantLOD::build(const SegmentBuffer& cylinders, const LeafBuffer& leaves,
+                     const glm::vec3& minBounds, const glm::vec3& maxBounds) {
+    levels_.resize(kLevelCount);
+    ++version_;
+    float size = std::max(glm::length(maxBounds - minBounds), 1e-3f);
+
+    float maxRadius = 0.0f;
+    for (float radius : cylinders.radii) {
+        maxRadius = std::max(maxRadius, radius);
+    }
+
+    for (int k = 0; k < kLevelCount; ++k) {
+        LODLevel& level = levels_[k];
+        level.error = k == 0 ? 0.0f : size * kBaseError * std::pow(4.0f, static_cast<float>(k - 1));
+
+        // An n-gon inscribed in radius r deviates from the circle by r(1 - cos(pi / n))
+        level.radialSegments = 8;
+        while (level.radialSegments > 3 &&
+               maxRadius * (1.0f - std::cos(static_cast<float>(M_PI) / (level.radialSegments - 1))) <= level.error) {
+            --level.radialSegments;
+        }
+
+        if (k == 0) {
+            level.cylinders = cylinders;
+            level.leaves = leaves;
+        } else {
+            simplify(cylinders, leaves, level.error, level);
+        }
+        builder_.setRadialSegments(level.radialSegments);
+        builder_.build(level.cylinders, level.mesh);
+    }
+}
+
+void PlantLOD::simplify(const SegmentBuffer& cylinders, const LeafBuffer& leaves,
+                        float tolerance, LODLevel& level) {
+    level.cylinders.clear();
+    level.leaves.clear();
+
+    // Reach of everything grown from each point: turtle output lists a
+    // segment before the ones that continue from its end, so one backward
+    // pass sees every descendant first. Leaves span twice their size.
+    std::unordered_map<glm::vec3, float, PointHash> reach;
+    reach.reserve(cylinders.size() + leaves.size());
+    for (size_t i = leaves.size(); i-- > 0;) {
+        float& r = reach[leaves.positions[i]];
+        r = std::max(r, 2.0f * leaves.sizes[i]);
+    }
+    std::vector<float> segmentReach(cylinders.size());
+    for (size_t i = cylinders.size(); i-- > 0;) {
+        auto found = reach.find(cylinders.end(i));
+        float beyond = found != reach.end() ? found->second : 0.0f;
+        segmentReach[i] = glm::length(cylinders.end(i) - cylinders.start(i)) + beyond;
+        float& r = reach[cylinders.start(i)];
+        r = std::max(r, segmentReach[i]);
+    }
+
+    // A subtree that fits inside the tolerance around its base is dropped
+    for (size_t i = 0; i < leaves.size(); ++i) {
+        if (2.0f * leaves.sizes[i] > tolerance) {
+            level.leaves.push(leaves.positions[i], leaves.normals[i], leaves.sizes[i], leaves.colors[i],
+                              leaves.symbols[i]);
+        }
+    }
+    std::vector<uint32_t> kept;
+    kept.reserve(cylinders.size());
+    for (size_t i = 0; i < cylinders.size(); ++i) {
+        if (segmentReach[i] + 2.0f * cylinders.radii[i] > tolerance) {
+            kept.push_back(static_cast<uint32_t>(i));
+        }
+    }
+
+    // Welded runs then collapse
+    size_t i = 0;
+    while (i < kept.size()) {
+        uint32_t first = kept[i];
+        const glm::vec3& start = cylinders.start(first);
+        float radius = cylinders.radii[first];
+        const glm::vec3& color = cylinders.colors[first];
+
+        // Extend while the next segment continues the chain with a close
+        // radius and every inner joint stays near the merged axis
+        size_t last = i;
+        while (last + 1 < kept.size() && last + 1 - i < kMaxMergeRun) {
+            uint32_t next = kept[last + 1];
+            if (cylinders.start(next) != cylinders.end(kept[last]) ||
+                std::fabs(cylinders.radii[next] - radius) > tolerance ||
+                cylinders.colors[next] != color) {
+                break;
+            }
+            const glm::vec3& end = cylinders.end(next);
+            bool straight = true;
+            for (size_t j = i; j <= last && straight; ++j) {
+                straight = distanceToLine(cylinders.end(kept[j]), start, end) <= tolerance;
+            }
+            if (!straight) break;
+            ++last;
+        }
+
+        level.cylinders.push(start, cylinders.end(kept[last]), radius, color, cylinders.symbols[first]);
+        i = last + 1;
+    }
+}
+
+size_t PlantLOD::selectLevel(float pixelsPerUnit, float maxPixels) const {
+    size_t selected = 0;
+    for (size_t k = 1; k < levels_.size(); ++k) {
+        if (levels_[k].error * pixelsPerUnit <= maxPixels) {
+            selected = k;
+        }
+    }
+    return selected;
+}
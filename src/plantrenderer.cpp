@@ -0,0 +1,27 @@
+#include "catalog.h"
+#include "softwarerenderer.h"
+#include <iostream>
+
+// Catalog renderer for machines without a usable GL: the same images as
+// plant_modeler --headless --software, linked without GL, GLFW or imgui
+
+static void printUsage() {
+    std::cerr << "Usage: plant_renderer [--output DIR] [--size WxH] [--format png|ppm]\n"
+                 "                      [--preset NAME]... [--iterations N] [--camera DIST,PITCH,YAW]\n"
+                 "                      [--instanced] [--parametric] [--threads N]\n";
+}
+
+int main(int argc, char** argv) {
+    // --headless and --software are implied, and accepted for symmetry
+    bool headless = false;
+    HeadlessOptions options;
+    if (!parseHeadlessOptions(argc, argv, headless, options)) {
+        printUsage();
+        return -1;
+    }
+    options.software = true;
+
+    SoftwareRenderer renderer;
+    renderer.setThreadCount(options.threads);
+    return renderCatalog(renderer, options);
+}
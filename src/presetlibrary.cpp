@@ -0,0 +1,427 @@
+#include "presetlibrary.h"
+#include "lsystem.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Binary layout, all offsets from the start of the file:
+//   FileHeader | EntryRecord[count] | uint32 sorted[count] | RuleRecord[rules] | strings
+static const char kMagic[8] = {'L', 'S', 'Y', 'S', 'L', 'I', 'B', '\0'};
+static const uint32_t kVersion = 1;
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t ruleCount;
+    uint32_t entriesOffset;
+    uint32_t sortedOffset;      // Entry indices ordered by name
+    uint32_t rulesOffset;
+    uint32_t stringsOffset;
+    uint32_t fileSize;
+};
+
+struct StringRef {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct EntryRecord {
+    StringRef name;
+    StringRef axiom;
+    StringRef ignore;
+    uint32_t firstRule;
+    uint32_t ruleCount;
+    uint32_t turtleMask;
+    float turtle[8];            // angle, step, width, length/width scale, tropism
+};
+
+struct RuleRecord {
+    StringRef left;
+    StringRef right;
+    StringRef successor;
+    float probability;
+    char predecessor;
+    char padding[3];
+};
+
+static std::string toString(const unsigned char* data, const StringRef& ref) {
+    return std::string(reinterpret_cast<const char*>(data) + ref.offset, ref.length);
+}
+
+// Read a number token; false if it is not one
+static bool parseFloat(const std::string& token, float& value) {
+    char* end = nullptr;
+    value = std::strtof(token.c_str(), &end);
+    return !token.empty() && end == token.c_str() + token.size();
+}
+
+// Parse the part of a rule line left of "->": [left <] pred [> right] [weight]
+static bool parseRuleHead(const std::vector<std::string>& tokens, PresetRule& rule) {
+    size_t i = 0;
+    if (tokens.size() >= 3 && tokens[1] == "<") {
+        rule.left = tokens[0];
+        i = 2;
+    }
+    if (i >= tokens.size() || tokens[i].size() != 1) return false;
+    rule.predecessor = tokens[i++][0];
+    if (i + 1 < tokens.size() && tokens[i] == ">") {
+        rule.right = tokens[i + 1];
+        i += 2;
+    }
+    if (i < tokens.size()) {
+        // Context rules are always deterministic
+        if (!rule.left.empty() || !rule.right.empty()) return false;
+        if (!parseFloat(tokens[i++], rule.probability)) return false;
+    }
+    return i == tokens.size();
+}
+
+bool PresetLibrary::parse(const std::string& text, std::vector<PresetDefinition>& presets) {
+    std::istringstream input(text);
+    std::string line;
+    int lineNumber = 0;
+    bool inPreset = false;
+    PresetDefinition current;
+
+    auto fail = [&](const std::string& message) {
+        std::cerr << "Grammar error (line " << lineNumber << "): " << message << std::endl;
+        return false;
+    };
+
+    while (std::getline(input, line)) {
+        ++lineNumber;
+        std::istringstream words(line);
+        std::vector<std::string> tokens;
+        std::string token;
+        while (words >> token && token[0] != '#') {
+            tokens.push_back(token);
+        }
+        if (tokens.empty()) continue;
+
+        const std::string& keyword = tokens[0];
+        if (keyword == "preset") {
+            if (inPreset) return fail("missing 'end' before 'preset'");
+            size_t open = line.find('"');
+            size_t close = open == std::string::npos ? open : line.find('"', open + 1);
+            if (close == std::string::npos || close == open + 1) return fail("expected preset \"name\"");
+            current = PresetDefinition();
+            current.name = line.substr(open + 1, close - open - 1);
+            inPreset = true;
+            continue;
+        }
+        if (!inPreset) return fail("'" + keyword + "' outside a preset");
+
+        if (keyword == "end") {
+            if (current.axiom.empty()) return fail("preset \"" + current.name + "\" has no axiom");
+            presets.push_back(current);
+            inPreset = false;
+        } else if (keyword == "axiom" || keyword == "ignore") {
+            if (tokens.size() != 2) return fail("expected '" + keyword + " <symbols>'");
+            (keyword == "axiom" ? current.axiom : current.ignore) = tokens[1];
+        } else if (keyword == "rule") {
+            auto arrow = std::find(tokens.begin(), tokens.end(), "->");
+            if (arrow == tokens.end() || tokens.end() - arrow > 2) return fail("expected 'rule <head> -> <successor>'");
+            PresetRule rule;
+            rule.probability = -1.0f;
+            if (!parseRuleHead(std::vector<std::string>(tokens.begin() + 1, arrow), rule)) {
+                return fail("malformed rule head");
+            }
+            rule.successor = arrow + 1 == tokens.end() ? std::string() : *(arrow + 1);
+            current.rules.push_back(rule);
+        } else {
+            // Turtle parameters
+            static const struct { const char* name; uint32_t field; float PresetTurtle::*member; } kParams[] = {
+                {"angle", PresetTurtle::Angle, &PresetTurtle::angle},
+                {"step", PresetTurtle::StepLength, &PresetTurtle::stepLength},
+                {"width", PresetTurtle::StepWidth, &PresetTurtle::stepWidth},
+                {"length_scale", PresetTurtle::LengthScale, &PresetTurtle::lengthScale},
+                {"width_scale", PresetTurtle::WidthScale, &PresetTurtle::widthScale},
+            };
+            bool known = false;
+            for (const auto& param : kParams) {
+                if (keyword != param.name) continue;
+                if (tokens.size() != 2 || !parseFloat(tokens[1], current.turtle.*param.member)) {
+                    return fail("expected '" + keyword + " <number>'");
+                }
+                current.turtle.mask |= param.field;
+                known = true;
+            }
+            if (keyword == "tropism") {
+                if (tokens.size() != 4) return fail("expected 'tropism <x> <y> <z>'");
+                for (int i = 0; i < 3; ++i) {
+                    if (!parseFloat(tokens[i + 1], current.turtle.tropism[i])) return fail("bad tropism");
+                }
+                current.turtle.mask |= PresetTurtle::Tropism;
+                known = true;
+            }
+            if (!known) return fail("unknown statement '" + keyword + "'");
+        }
+    }
+
+    if (inPreset) return fail("missing 'end' after preset \"" + current.name + "\"");
+    return true;
+}
+
+bool PresetLibrary::parseFile(const std::string& path, std::vector<PresetDefinition>& presets) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Cannot open grammar file " << path << std::endl;
+        return false;
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    return parse(contents.str(), presets);
+}
+
+bool PresetLibrary::write(const std::vector<PresetDefinition>& presets, const std::string& path) {
+    std::vector<EntryRecord> entries(presets.size());
+    std::vector<RuleRecord> rules;
+    std::string strings;
+
+    size_t ruleTotal = 0;
+    for (const auto& preset : presets) ruleTotal += preset.rules.size();
+
+    FileHeader header;
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.count = static_cast<uint32_t>(presets.size());
+    header.ruleCount = static_cast<uint32_t>(ruleTotal);
+    header.entriesOffset = sizeof(FileHeader);
+    header.sortedOffset = header.entriesOffset + header.count * sizeof(EntryRecord);
+    header.rulesOffset = header.sortedOffset + header.count * sizeof(uint32_t);
+    header.stringsOffset = header.rulesOffset + header.ruleCount * sizeof(RuleRecord);
+
+    auto addString = [&](const std::string& value) {
+        StringRef ref;
+        ref.offset = header.stringsOffset + static_cast<uint32_t>(strings.size());
+        ref.length = static_cast<uint32_t>(value.size());
+        strings += value;
+        return ref;
+    };
+
+    for (size_t i = 0; i < presets.size(); ++i) {
+        const PresetDefinition& preset = presets[i];
+        EntryRecord& entry = entries[i];
+        entry.name = addString(preset.name);
+        entry.axiom = addString(preset.axiom);
+        entry.ignore = addString(preset.ignore);
+        entry.firstRule = static_cast<uint32_t>(rules.size());
+        entry.ruleCount = static_cast<uint32_t>(preset.rules.size());
+        entry.turtleMask = preset.turtle.mask;
+        const PresetTurtle& t = preset.turtle;
+        float values[8] = {t.angle, t.stepLength, t.stepWidth, t.lengthScale, t.widthScale,
+                           t.tropism[0], t.tropism[1], t.tropism[2]};
+        std::memcpy(entry.turtle, values, sizeof(values));
+
+        for (const auto& rule : preset.rules) {
+            RuleRecord record;
+            std::memset(&record, 0, sizeof(record));
+            record.left = addString(rule.left);
+            record.right = addString(rule.right);
+            record.successor = addString(rule.successor);
+            record.probability = rule.probability;
+            record.predecessor = rule.predecessor;
+            rules.push_back(record);
+        }
+    }
+    header.fileSize = header.stringsOffset + static_cast<uint32_t>(strings.size());
+
+    // Name index for binary search; first definition wins on duplicates
+    std::vector<uint32_t> sorted(presets.size());
+    for (size_t i = 0; i < sorted.size(); ++i) sorted[i] = static_cast<uint32_t>(i);
+    std::stable_sort(sorted.begin(), sorted.end(), [&](uint32_t a, uint32_t b) {
+        return presets[a].name < presets[b].name;
+    });
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cerr << "Cannot write preset library " << path << std::endl;
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(EntryRecord));
+    file.write(reinterpret_cast<const char*>(sorted.data()), sorted.size() * sizeof(uint32_t));
+    file.write(reinterpret_cast<const char*>(rules.data()), rules.size() * sizeof(RuleRecord));
+    file.write(strings.data(), strings.size());
+    return static_cast<bool>(file);
+}
+
+bool PresetLibrary::compile(const std::string& textPath, const std::string& binaryPath) {
+    struct stat textInfo, binaryInfo;
+    if (stat(textPath.c_str(), &textInfo) != 0) {
+        std::cerr << "Cannot open grammar file " << textPath << std::endl;
+        return false;
+    }
+    if (stat(binaryPath.c_str(), &binaryInfo) == 0 && binaryInfo.st_mtime >= textInfo.st_mtime) {
+        return true;
+    }
+
+    std::vector<PresetDefinition> presets;
+    return parseFile(textPath, presets) && write(presets, binaryPath);
+}
+
+PresetLibrary::PresetLibrary() : data_(nullptr), size_(0) {}
+
+PresetLibrary::~PresetLibrary() {
+    close();
+}
+
+bool PresetLibrary::open(const std::string& path) {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Cannot open preset library " << path << std::endl;
+        return false;
+    }
+    struct stat info;
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size >= static_cast<off_t>(sizeof(FileHeader))) {
+        mapping = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Cannot map preset library " << path << std::endl;
+        return false;
+    }
+    data_ = static_cast<const unsigned char*>(mapping);
+    size_ = static_cast<size_t>(info.st_size);
+
+    // Check the layout once so lookups can trust every offset
+    const FileHeader* header = reinterpret_cast<const FileHeader*>(data_);
+    bool valid = std::memcmp(header->magic, kMagic, sizeof(kMagic)) == 0 &&
+                 header->version == kVersion && header->fileSize == size_ &&
+                 header->entriesOffset + header->count * sizeof(EntryRecord) <= header->sortedOffset &&
+                 header->sortedOffset + header->count * sizeof(uint32_t) <= header->rulesOffset &&
+                 header->rulesOffset + header->ruleCount * sizeof(RuleRecord) <= header->stringsOffset &&
+                 header->stringsOffset <= size_;
+    auto inStrings = [&](const StringRef& ref) {
+        return ref.offset >= header->stringsOffset && ref.offset + static_cast<size_t>(ref.length) <= size_;
+    };
+    const EntryRecord* entries = reinterpret_cast<const EntryRecord*>(data_ + (valid ? header->entriesOffset : 0));
+    const uint32_t* sorted = reinterpret_cast<const uint32_t*>(data_ + (valid ? header->sortedOffset : 0));
+    const RuleRecord* rules = reinterpret_cast<const RuleRecord*>(data_ + (valid ? header->rulesOffset : 0));
+    for (uint32_t i = 0; valid && i < header->count; ++i) {
+        const EntryRecord& entry = entries[i];
+        valid = sorted[i] < header->count && inStrings(entry.name) && inStrings(entry.axiom) &&
+                inStrings(entry.ignore) && entry.firstRule + static_cast<size_t>(entry.ruleCount) <= header->ruleCount;
+    }
+    for (uint32_t i = 0; valid && i < header->ruleCount; ++i) {
+        valid = inStrings(rules[i].left) && inStrings(rules[i].right) && inStrings(rules[i].successor);
+    }
+    if (!valid) {
+        std::cerr << "Invalid preset library " << path << std::endl;
+        close();
+        return false;
+    }
+    return true;
+}
+
+void PresetLibrary::close() {
+    if (data_) {
+        munmap(const_cast<unsigned char*>(data_), size_);
+    }
+    data_ = nullptr;
+    size_ = 0;
+}
+
+size_t PresetLibrary::size() const {
+    return data_ ? reinterpret_cast<const FileHeader*>(data_)->count : 0;
+}
+
+std::string PresetLibrary::getName(size_t index) const {
+    const FileHeader* header = reinterpret_cast<const FileHeader*>(data_);
+    const EntryRecord* entries = reinterpret_cast<const EntryRecord*>(data_ + header->entriesOffset);
+    return toString(data_, entries[index].name);
+}
+
+std::vector<std::string> PresetLibrary::getNames() const {
+    std::vector<std::string> names;
+    names.reserve(size());
+    for (size_t i = 0; i < size(); ++i) {
+        names.push_back(getName(i));
+    }
+    return names;
+}
+
+long PresetLibrary::find(const std::string& name) const {
+    if (!data_) return -1;
+    const FileHeader* header = reinterpret_cast<const FileHeader*>(data_);
+    const EntryRecord* entries = reinterpret_cast<const EntryRecord*>(data_ + header->entriesOffset);
+    const uint32_t* sorted = reinterpret_cast<const uint32_t*>(data_ + header->sortedOffset);
+
+    // Lower bound over the name index, comparing in place
+    auto compare = [&](uint32_t entry) {
+        const StringRef& ref = entries[entry].name;
+        int order = std::memcmp(text(ref.offset), name.data(), std::min<size_t>(ref.length, name.size()));
+        if (order != 0) return order;
+        return ref.length < name.size() ? -1 : (ref.length > name.size() ? 1 : 0);
+    };
+    size_t low = 0, high = header->count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (compare(sorted[mid]) < 0) low = mid + 1;
+        else high = mid;
+    }
+    if (low < header->count && compare(sorted[low]) == 0) {
+        return static_cast<long>(sorted[low]);
+    }
+    return -1;
+}
+
+bool PresetLibrary::apply(const std::string& name, LSystem& lsystem, PresetTurtle* turtle) const {
+    long index = find(name);
+    if (index < 0) return false;
+
+    const FileHeader* header = reinterpret_cast<const FileHeader*>(data_);
+    const EntryRecord& entry = reinterpret_cast<const EntryRecord*>(data_ + header->entriesOffset)[index];
+    const RuleRecord* rules = reinterpret_cast<const RuleRecord*>(data_ + header->rulesOffset) + entry.firstRule;
+
+    lsystem.clearRules();
+    lsystem.setAxiom(toString(data_, entry.axiom));
+    if (entry.ignore.length > 0) {
+        lsystem.setContextIgnore(toString(data_, entry.ignore));
+    }
+    for (uint32_t i = 0; i < entry.ruleCount; ++i) {
+        const RuleRecord& rule = rules[i];
+        std::string successor = toString(data_, rule.successor);
+        if (rule.left.length > 0 || rule.right.length > 0) {
+            lsystem.addContextRule(toString(data_, rule.left), rule.predecessor,
+                                   toString(data_, rule.right), successor);
+        } else if (rule.probability < 0.0f) {
+            lsystem.addRule(rule.predecessor, successor);
+        } else {
+            lsystem.addStochasticRule(rule.predecessor, successor, rule.probability);
+        }
+    }
+
+    if (turtle) {
+        getTurtle(name, *turtle);
+    }
+    return true;
+}
+
+bool PresetLibrary::getTurtle(const std::string& name, PresetTurtle& turtle) const {
+    long index = find(name);
+    if (index < 0) return false;
+
+    const FileHeader* header = reinterpret_cast<const FileHeader*>(data_);
+    const EntryRecord& entry = reinterpret_cast<const EntryRecord*>(data_ + header->entriesOffset)[index];
+    turtle = PresetTurtle();
+    turtle.mask = entry.turtleMask;
+    turtle.angle = entry.turtle[0];
+    turtle.stepLength = entry.turtle[1];
+    turtle.stepWidth = entry.turtle[2];
+    turtle.lengthScale = entry.turtle[3];
+    turtle.widthScale = entry.turtle[4];
+    std::memcpy(turtle.tropism, entry.turtle + 5, sizeof(turtle.tropism));
+    return true;
+}
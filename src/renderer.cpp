@@ -1,16 +1,194 @@
-#include "Renderer.h"
+#include "renderer.h"
+#if defined(__APPLE__)
 #include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>      // Buffer and shader entry points need GL_GLEXT_PROTOTYPES (see Makefile)
+#endif
 #include <cmath>
+#include <algorithm>
 #include <iostream>
+#include <cstddef>
+#include <cfloat>
 
 static Renderer* g_renderer = nullptr;
 
+// Sides of a drawn cylinder
+static const int kCylinderSides = 8;
+
+// Leaf triangle height over its half-width
+static const float kLeafHeight = 1.5f;
+
+// Indices per retained cluster and instances per instanced cluster: small
+// enough to cull a zoomed-in view finely, large enough that a fully visible
+// plant still goes out in a few calls once neighbours are merged
+static const size_t kClusterIndices = 3072;
+static const size_t kClusterInstances = 256;
+
+// Thickest cylinders of a plant kept as occluders
+static const size_t kMaxOccluders = 512;
+
+// Scene instances nearest the camera whose trunks are used as occluders
+static const size_t kSceneOccluderPlants = 64;
+
+// Keep the kMaxOccluders thickest of candidates
+static void selectOccluders(std::vector<Occluder>& occluders) {
+    if (occluders.size() <= kMaxOccluders) return;
+    std::nth_element(occluders.begin(), occluders.begin() + kMaxOccluders, occluders.end(),
+                     [](const Occluder& a, const Occluder& b) { return a.radius > b.radius; });
+    occluders.resize(kMaxOccluders);
+}
+
+static void collectOccluders(const SegmentBuffer& cylinders, std::vector<Occluder>& occluders) {
+    occluders.clear();
+    for (size_t i = 0; i < cylinders.size(); ++i) {
+        occluders.push_back({cylinders.start(i), cylinders.end(i), cylinders.radii[i]});
+    }
+    selectOccluders(occluders);
+}
+
+// Unit vectors u, v completing an orthonormal frame around direction
+static void cylinderBasis(const glm::vec3& direction, glm::vec3& u, glm::vec3& v) {
+    glm::vec3 reference = fabs(direction.y) < 0.999f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+    u = glm::normalize(glm::cross(reference, direction));
+    v = glm::cross(direction, u);
+}
+
+// Two triangles per side of a ring of (bottom, top) vertex pairs starting
+// at base, counter-clockwise from outside
+static void appendRingIndices(uint32_t base, std::vector<uint32_t>& indices, size_t& count) {
+    for (int k = 0; k < kCylinderSides; ++k) {
+        uint32_t bottom = base + 2 * k;
+        uint32_t next = base + 2 * ((k + 1) % kCylinderSides);
+        uint32_t quad[6] = {bottom, next, bottom + 1, next, next + 1, bottom + 1};
+        for (uint32_t index : quad) {
+            indices[count++] = index;
+        }
+    }
+}
+
+// EXT_framebuffer_object entry points and tokens, loaded at run time
+typedef void (*GenObjectsFn)(GLsizei n, GLuint* objects);
+typedef void (*DeleteObjectsFn)(GLsizei n, const GLuint* objects);
+typedef void (*BindObjectFn)(GLenum target, GLuint object);
+typedef void (*RenderbufferStorageFn)(GLenum target, GLenum format, GLsizei width, GLsizei height);
+typedef void (*FramebufferRenderbufferFn)(GLenum target, GLenum attachment, GLenum renderbufferTarget, GLuint renderbuffer);
+typedef GLenum (*CheckFramebufferStatusFn)(GLenum target);
+static GenObjectsFn g_genFramebuffers = nullptr;
+static GenObjectsFn g_genRenderbuffers = nullptr;
+static DeleteObjectsFn g_deleteFramebuffers = nullptr;
+static DeleteObjectsFn g_deleteRenderbuffers = nullptr;
+static BindObjectFn g_bindFramebuffer = nullptr;
+static BindObjectFn g_bindRenderbuffer = nullptr;
+static RenderbufferStorageFn g_renderbufferStorage = nullptr;
+static FramebufferRenderbufferFn g_framebufferRenderbuffer = nullptr;
+static CheckFramebufferStatusFn g_checkFramebufferStatus = nullptr;
+static const GLenum kFramebuffer = 0x8D40;
+static const GLenum kRenderbuffer = 0x8D41;
+static const GLenum kColorAttachment0 = 0x8CE0;
+static const GLenum kDepthAttachment = 0x8D00;
+static const GLenum kFramebufferComplete = 0x8CD5;
+static const GLenum kRGBA8 = 0x8058;
+static const GLenum kDepthComponent24 = 0x81A6;
+
+// ARB_instanced_arrays entry points, loaded at run time
+typedef void (*VertexAttribDivisorFn)(GLuint index, GLuint divisor);
+typedef void (*DrawElementsInstancedFn)(GLenum mode, GLsizei count, GLenum type, const void* indices, GLsizei instances);
+static VertexAttribDivisorFn g_vertexAttribDivisor = nullptr;
+static DrawElementsInstancedFn g_drawElementsInstanced = nullptr;
+
+// Attribute slots of the instancing shader
+enum InstanceAttribute {
+    kAttribPosition, kAttribNormal, kAttribVertexColor, kAttribOrigin, kAttribAxisX, kAttribAxisY, kAttribAxisZ,
+    kAttribColor
+};
+
+// GLSL 1.20 so it runs in a 2.1 context (and on Mesa's llvmpipe). Lighting
+// reproduces the fixed pipeline for light 0 with the material of
+// applyVertexColorMaterial: ambient 0.3 * color, diffuse color, specular and
+// shininess from the current glMaterial. The color is the instance's times
+// the vertex's, so unit meshes (white) and scene meshes (white instances)
+// share the program
+static const char* kInstanceVertexShader = R"(
+#version 120
+attribute vec3 position;
+attribute vec3 normal;
+attribute vec3 vertexColor;
+attribute vec3 instanceOrigin;
+attribute vec3 instanceAxisX;
+attribute vec3 instanceAxisY;
+attribute vec3 instanceAxisZ;
+attribute vec3 instanceColor;
+
+void main() {
+    mat3 frame = mat3(instanceAxisX, instanceAxisY, instanceAxisZ);
+    vec4 eyePosition = gl_ModelViewMatrix * vec4(instanceOrigin + frame * position, 1.0);
+    vec3 n = normalize(gl_NormalMatrix * (frame * normal));
+    vec3 base = instanceColor * vertexColor;
+    
+    vec3 l = normalize(gl_LightSource[0].position.xyz);
+    float diffuse = max(dot(n, l), 0.0);
+    float specular = 0.0;
+    if (diffuse > 0.0) {
+        specular = pow(max(dot(n, normalize(gl_LightSource[0].halfVector.xyz)), 0.0), gl_FrontMaterial.shininess);
+    }
+    vec3 color = 0.3 * base * (gl_LightModel.ambient.rgb + gl_LightSource[0].ambient.rgb)
+               + base * gl_LightSource[0].diffuse.rgb * diffuse
+               + gl_FrontMaterial.specular.rgb * gl_LightSource[0].specular.rgb * specular;
+    
+    gl_FrontColor = vec4(color, 1.0);
+    gl_BackColor = gl_FrontColor;
+    gl_Position = gl_ProjectionMatrix * eyePosition;
+}
+)";
+
+static const char* kInstanceFragmentShader = R"(
+#version 120
+void main() {
+    gl_FragColor = gl_Color;
+}
+)";
+
+static GLuint compileShader(GLenum type, const char* source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, nullptr);
+    glCompileShader(shader);
+    
+    GLint compiled = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (!compiled) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+        std::cerr << "Instancing shader failed to compile: " << log << std::endl;
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+// Stem and leaf material, with the diffuse color taken from the color
+// array; callers disable GL_COLOR_MATERIAL afterwards
+static void applyVertexColorMaterial(GLenum face, const glm::vec3& color, float specular, float shininess) {
+    float mat_ambient[] = {color.r * 0.3f, color.g * 0.3f, color.b * 0.3f, 1.0f};
+    float mat_specular[] = {specular, specular, specular, 1.0f};
+    glMaterialfv(face, GL_AMBIENT, mat_ambient);
+    glMaterialfv(face, GL_SPECULAR, mat_specular);
+    glMaterialf(face, GL_SHININESS, shininess);
+    glColorMaterial(face, GL_DIFFUSE);
+    glEnable(GL_COLOR_MATERIAL);
+}
+
 Renderer::Renderer() 
-        : window_(nullptr), width_(1280), height_(720),
+        : window_(nullptr), width_(1280), height_(720), headless_(false), framebuffer_(0),
+      colorRenderbuffer_(0), depthRenderbuffer_(0),
             cameraPos_(0.0f, 0.0f, 6.0f), cameraTarget_(0.0f, 0.0f, 0.0f),
       cameraUp_(0.0f, 1.0f, 0.0f), lastMouseX_(0.0), lastMouseY_(0.0),
             mousePressed_(false), cameraDistance(6.0f), 
-      cameraRotationX(20.0f), cameraRotationY(45.0f), autoRotate(false) {
+      cameraRotationX(20.0f), cameraRotationY(45.0f), autoRotate(false),
+      lodPixelError(1.0f), selectedLOD_(0), instancingChecked_(false), instanceProgram_(0),
+      unitVertexBuffer_(0), unitIndexBuffer_(0), instanceBuffer_(0), sceneInstanceBuffer_(0), instanceSource_(nullptr),
+      instanceVersion_(0), cylinderInstances_(0), leafInstances_(0), cullingEnabled(true),
+      occlusionCulling(true), sceneOffset_(0.0f), view_(1.0f), projection_(1.0f), sceneInstancesDrawn_(0),
+      sceneTrianglesDrawn_(0) {
     g_renderer = this;
 }
 
@@ -46,6 +224,116 @@ bool Renderer::initialize(int width, int height, const char* title) {
     glfwSetCursorPosCallback(window_, cursorPosCallback);
     glfwSetScrollCallback(window_, scrollCallback);
     
+    setupContext();
+    return true;
+}
+
+bool Renderer::initializeHeadless(int width, int height) {
+    width_ = width;
+    height_ = height;
+    headless_ = true;
+    
+    // A hidden window supplies the context; without a display, GLFW 3.4's
+    // null platform with an OSMesa context renders on the CPU
+    bool initialized = glfwInit();
+    if (initialized) {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+        window_ = glfwCreateWindow(width_, height_, "Headless", nullptr, nullptr);
+    }
+#if defined(GLFW_PLATFORM_NULL) && defined(GLFW_OSMESA_CONTEXT_API)
+    if (!window_) {
+        if (initialized) glfwTerminate();
+        glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+        initialized = glfwInit();
+        if (initialized) {
+            glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+            glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+            glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+            glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+            window_ = glfwCreateWindow(width_, height_, "Headless", nullptr, nullptr);
+        }
+    }
+#endif
+    if (!window_) {
+        std::cerr << "Failed to create a headless GL context" << std::endl;
+        if (initialized) glfwTerminate();
+        return false;
+    }
+    
+    glfwMakeContextCurrent(window_);
+    if (!createFramebuffer()) {
+        // The hidden window's own buffer still works at its size
+        std::cerr << "Offscreen framebuffer unavailable, rendering to the hidden window" << std::endl;
+        glfwGetFramebufferSize(window_, &width_, &height_);
+    }
+    
+    setupContext();
+    return true;
+}
+
+bool Renderer::createFramebuffer() {
+    if (!glfwExtensionSupported("GL_EXT_framebuffer_object")) return false;
+    g_genFramebuffers = (GenObjectsFn)glfwGetProcAddress("glGenFramebuffersEXT");
+    g_genRenderbuffers = (GenObjectsFn)glfwGetProcAddress("glGenRenderbuffersEXT");
+    g_deleteFramebuffers = (DeleteObjectsFn)glfwGetProcAddress("glDeleteFramebuffersEXT");
+    g_deleteRenderbuffers = (DeleteObjectsFn)glfwGetProcAddress("glDeleteRenderbuffersEXT");
+    g_bindFramebuffer = (BindObjectFn)glfwGetProcAddress("glBindFramebufferEXT");
+    g_bindRenderbuffer = (BindObjectFn)glfwGetProcAddress("glBindRenderbufferEXT");
+    g_renderbufferStorage = (RenderbufferStorageFn)glfwGetProcAddress("glRenderbufferStorageEXT");
+    g_framebufferRenderbuffer = (FramebufferRenderbufferFn)glfwGetProcAddress("glFramebufferRenderbufferEXT");
+    g_checkFramebufferStatus = (CheckFramebufferStatusFn)glfwGetProcAddress("glCheckFramebufferStatusEXT");
+    if (!g_genFramebuffers || !g_genRenderbuffers || !g_deleteFramebuffers || !g_deleteRenderbuffers ||
+        !g_bindFramebuffer || !g_bindRenderbuffer || !g_renderbufferStorage || !g_framebufferRenderbuffer ||
+        !g_checkFramebufferStatus) {
+        return false;
+    }
+    
+    g_genRenderbuffers(1, &colorRenderbuffer_);
+    g_bindRenderbuffer(kRenderbuffer, colorRenderbuffer_);
+    g_renderbufferStorage(kRenderbuffer, kRGBA8, width_, height_);
+    g_genRenderbuffers(1, &depthRenderbuffer_);
+    g_bindRenderbuffer(kRenderbuffer, depthRenderbuffer_);
+    g_renderbufferStorage(kRenderbuffer, kDepthComponent24, width_, height_);
+    g_bindRenderbuffer(kRenderbuffer, 0);
+    
+    g_genFramebuffers(1, &framebuffer_);
+    g_bindFramebuffer(kFramebuffer, framebuffer_);
+    g_framebufferRenderbuffer(kFramebuffer, kColorAttachment0, kRenderbuffer, colorRenderbuffer_);
+    g_framebufferRenderbuffer(kFramebuffer, kDepthAttachment, kRenderbuffer, depthRenderbuffer_);
+    if (g_checkFramebufferStatus(kFramebuffer) != kFramebufferComplete) {
+        g_bindFramebuffer(kFramebuffer, 0);
+        g_deleteFramebuffers(1, &framebuffer_);
+        g_deleteRenderbuffers(1, &colorRenderbuffer_);
+        g_deleteRenderbuffers(1, &depthRenderbuffer_);
+        framebuffer_ = colorRenderbuffer_ = depthRenderbuffer_ = 0;
+        return false;
+    }
+    
+    // Stays bound: every frame goes offscreen
+    return true;
+}
+
+bool Renderer::readImage(Image& image) const {
+    int uiPanelWidth = headless_ ? 0 : 400;  // Must match beginFrame()
+    int viewportWidth = width_ - uiPanelWidth;
+    if (viewportWidth <= 0 || height_ <= 0) return false;
+    
+    image = Image(viewportWidth, height_);
+    std::vector<uint8_t> flipped(image.pixels.size());
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(uiPanelWidth, 0, viewportWidth, height_, GL_RGB, GL_UNSIGNED_BYTE, flipped.data());
+    
+    // GL rows run bottom to top
+    size_t stride = static_cast<size_t>(viewportWidth) * 3;
+    for (int y = 0; y < height_; ++y) {
+        std::copy_n(flipped.data() + stride * (height_ - 1 - y), stride, image.row(y));
+    }
+    return true;
+}
+
+void Renderer::setupContext() {
     // OpenGL settings
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_MULTISAMPLE);
@@ -53,12 +341,18 @@ bool Renderer::initialize(int width, int height, const char* title) {
     glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    
-    return true;
 }
 
 void Renderer::shutdown() {
     if (window_) {
+        releaseBuffers();   // Needs the window's context
+        if (framebuffer_) {
+            g_bindFramebuffer(kFramebuffer, 0);
+            g_deleteFramebuffers(1, &framebuffer_);
+            g_deleteRenderbuffers(1, &colorRenderbuffer_);
+            g_deleteRenderbuffers(1, &depthRenderbuffer_);
+            framebuffer_ = colorRenderbuffer_ = depthRenderbuffer_ = 0;
+        }
         glfwDestroyWindow(window_);
         window_ = nullptr;
     }
@@ -98,8 +392,9 @@ void Renderer::beginFrame() {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     
     // CUSTOMIZATION: Change the 400 value to adjust the UI panel width
-    // Set viewport to right side only (leave 400px for UI on left)
-    int uiPanelWidth = 400;  // <- CHANGE THIS VALUE to adjust split position
+    // Set viewport to right side only (leave 400px for UI on left); headless
+    // frames have no UI
+    int uiPanelWidth = headless_ ? 0 : 400;  // <- CHANGE THIS VALUE to adjust split position
     int viewportWidth = width_ - uiPanelWidth;
     int viewportHeight = height_;
     glViewport(uiPanelWidth, 0, viewportWidth, viewportHeight);
@@ -126,129 +421,825 @@ void Renderer::beginFrame() {
         -glm::dot(s, pos), -glm::dot(u, pos), glm::dot(f, pos), 1
     };
     glMultMatrixf(m);
+    glTranslatef(sceneOffset_.x, sceneOffset_.y, sceneOffset_.z);
+    glm::vec3 offset(glm::dot(s, sceneOffset_), glm::dot(u, sceneOffset_), -glm::dot(f, sceneOffset_));
+    view_ = glm::mat4(glm::vec4(m[0], m[1], m[2], m[3]), glm::vec4(m[4], m[5], m[6], m[7]),
+                      glm::vec4(m[8], m[9], m[10], m[11]),
+                      glm::vec4(m[12] + offset.x, m[13] + offset.y, m[14] + offset.z, m[15]));
+    
+    // Must match fov in setupProjection()
+    float focalPixels = viewportHeight / (2.0f * tan(glm::radians(45.0f) * 0.5f));
+    culler_.begin(projection_ * view_, viewportWidth, viewportHeight, focalPixels);
+    culler_.setOcclusionEnabled(occlusionCulling);
     
     setupLighting();
 }
 
 void Renderer::endFrame() {
+    if (headless_) return;     // Nothing is shown; readImage() takes the frame
     glfwSwapBuffers(window_);
     glfwPollEvents();
 }
 
 void Renderer::render(const Turtle& turtle) {
+    uint64_t version = turtle.getGeometryVersion();
+    
     if (!turtle.is3DMode()) {
-        renderLines(turtle.getLines());
-    } else {
-        renderCylinders(turtle.getCylinders());
-        renderLeaves(turtle.getLeaves());
+        if (stemBuffers_.source != &turtle || stemBuffers_.version != version) {
+            stageLines(turtle.getSegments(), stemBuffers_);
+            buildClusters(stemBuffers_, 2);
+            upload(stemBuffers_, &turtle, version);
+            stemBuffers_.occluders.clear();
+        }
+        glDisable(GL_LIGHTING);
+        culler_.setOccluders(stemBuffers_.occluders);
+        drawMesh(stemBuffers_, GL_LINES);
+        return;
+    }
+    
+    if (stemBuffers_.source != &turtle || stemBuffers_.version != version) {
+        stageCylinders(turtle.getSegments(), stemBuffers_);
+        buildClusters(stemBuffers_, 6 * kCylinderSides);
+        upload(stemBuffers_, &turtle, version);
+        stageLeaves(turtle.getLeaves(), leafBuffers_);
+        buildClusters(leafBuffers_, 3);
+        upload(leafBuffers_, &turtle, version);
+        collectOccluders(turtle.getSegments(), stemBuffers_.occluders);
     }
+    
+    glEnable(GL_LIGHTING);
+    culler_.setOccluders(stemBuffers_.occluders);
+    applyVertexColorMaterial(GL_FRONT, stemBuffers_.baseColor, 0.2f, 20.0f);
+    drawMesh(stemBuffers_, GL_TRIANGLES);
+    applyVertexColorMaterial(GL_FRONT_AND_BACK, leafBuffers_.baseColor, 0.1f, 10.0f);
+    drawMesh(leafBuffers_, GL_TRIANGLES);
+    glDisable(GL_COLOR_MATERIAL);
 }
 
-void Renderer::renderLines(const std::vector<LineSegment>& lines) {
-    glDisable(GL_LIGHTING);
+void Renderer::render(const InstancedPlant& plant) {
+    uint64_t version = plant.getVersion();
     
-    for (const auto& line : lines) {
-        glLineWidth(line.width * 2.0f);
-        glBegin(GL_LINES);
-        glColor3f(line.color.r, line.color.g, line.color.b);
-        glVertex3f(line.start.x, line.start.y, line.start.z);
-        glVertex3f(line.end.x, line.end.y, line.end.z);
-        glEnd();
+    if (!initInstancing()) {
+        // No instanced calls: flatten once into the retained buffers
+        if (stemBuffers_.source != &plant || stemBuffers_.version != version) {
+            SegmentBuffer cylinders;
+            LeafBuffer leaves;
+            plant.flatten(cylinders, leaves);
+            stageCylinders(cylinders, stemBuffers_);
+            buildClusters(stemBuffers_, 6 * kCylinderSides);
+            upload(stemBuffers_, &plant, version);
+            stageLeaves(leaves, leafBuffers_);
+            buildClusters(leafBuffers_, 3);
+            upload(leafBuffers_, &plant, version);
+            collectOccluders(cylinders, stemBuffers_.occluders);
+        }
+        glEnable(GL_LIGHTING);
+        culler_.setOccluders(stemBuffers_.occluders);
+        applyVertexColorMaterial(GL_FRONT, stemBuffers_.baseColor, 0.2f, 20.0f);
+        drawMesh(stemBuffers_, GL_TRIANGLES);
+        applyVertexColorMaterial(GL_FRONT_AND_BACK, leafBuffers_.baseColor, 0.1f, 10.0f);
+        drawMesh(leafBuffers_, GL_TRIANGLES);
+        glDisable(GL_COLOR_MATERIAL);
+        return;
     }
+    
+    if (instanceSource_ != &plant || instanceVersion_ != version) {
+        stageInstances(plant);
+        instanceSource_ = &plant;
+        instanceVersion_ = version;
+    }
+    
+    // Specular and shininess come from the material; ambient and diffuse
+    // from each instance's color
+    float stem_specular[] = {0.2f, 0.2f, 0.2f, 1.0f};
+    float leaf_specular[] = {0.1f, 0.1f, 0.1f, 1.0f};
+    culler_.setOccluders(instanceOccluders_);
+    glUseProgram(instanceProgram_);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, stem_specular);
+    glMaterialf(GL_FRONT, GL_SHININESS, 20.0f);
+    drawInstanceClusters(cylinderClusters_, 0, 6 * kCylinderSides);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, leaf_specular);
+    glMaterialf(GL_FRONT, GL_SHININESS, 10.0f);
+    drawInstanceClusters(leafClusters_, 6 * kCylinderSides, 3);
+    glUseProgram(0);
 }
 
-void Renderer::renderCylinders(const std::vector<Cylinder>& cylinders) {
-    glEnable(GL_LIGHTING);
+void Renderer::render(const PlantLOD& lod) {
+    if (lod.getLevelCount() == 0) return;
+    
+    selectedLOD_ = lod.selectLevel(getPixelsPerUnit(), lodPixelError);
+    const LODLevel& level = lod.getLevel(selectedLOD_);
     
-    for (const auto& cyl : cylinders) {
-        drawCylinder(cyl.start, cyl.end, cyl.radius, cyl.color);
+    // Levels are uploaded as they are first selected
+    if (lodStemBuffers_.size() < lod.getLevelCount()) {
+        lodStemBuffers_.resize(lod.getLevelCount());
+        lodLeafBuffers_.resize(lod.getLevelCount());
     }
+    GpuMesh& stems = lodStemBuffers_[selectedLOD_];
+    GpuMesh& leaves = lodLeafBuffers_[selectedLOD_];
+    if (stems.source != &level || stems.version != lod.getVersion()) {
+        stageBranchMesh(level.mesh, stems);
+        buildClusters(stems, 3);
+        upload(stems, &level, lod.getVersion());
+        stageLeaves(level.leaves, leaves);
+        buildClusters(leaves, 3);
+        upload(leaves, &level, lod.getVersion());
+        collectOccluders(level.cylinders, stems.occluders);
+    }
+    
+    glEnable(GL_LIGHTING);
+    culler_.setOccluders(stems.occluders);
+    applyVertexColorMaterial(GL_FRONT, stems.baseColor, 0.2f, 20.0f);
+    drawMesh(stems, GL_TRIANGLES);
+    applyVertexColorMaterial(GL_FRONT_AND_BACK, leaves.baseColor, 0.1f, 10.0f);
+    drawMesh(leaves, GL_TRIANGLES);
+    glDisable(GL_COLOR_MATERIAL);
 }
 
-void Renderer::renderLeaves(const std::vector<Leaf>& leaves) {
+void Renderer::render(const Scene& scene) {
+    const std::vector<std::unique_ptr<PlantGeometry>>& geometries = scene.getGeometries();
+    const std::vector<SceneInstance>& instances = scene.getInstances();
+    const uint32_t levels = PlantLOD::kLevelCount;
+    sceneInstancesDrawn_ = sceneTrianglesDrawn_ = 0;
+    // Slots follow the scene's geometry; buffers of dropped geometry are freed
+    if (sceneStemBuffers_.size() != geometries.size() * levels) {
+        for (size_t slot = geometries.size() * levels; slot < sceneStemBuffers_.size(); ++slot) {
+            releaseMesh(sceneStemBuffers_[slot]);
+            releaseMesh(sceneLeafBuffers_[slot]);
+        }
+        sceneStemBuffers_.resize(geometries.size() * levels);
+        sceneLeafBuffers_.resize(geometries.size() * levels);
+    }
+    
+    // Camera in scene coordinates, and pixels per unit at unit distance
+    glm::vec3 eye = cameraPos_ - sceneOffset_;
+    float focalPixels = getPixelsPerUnit() * std::max(cameraDistance, 0.1f);
+    
+    // Trunks of the nearest plants hide what stands behind them
+    sceneOccluders_.clear();
+    if (occlusionCulling && !instances.empty()) {
+        std::vector<std::pair<float, uint32_t>> nearest(instances.size());
+        for (size_t i = 0; i < instances.size(); ++i) {
+            glm::vec3 toEye = instances[i].position - eye;
+            nearest[i] = {glm::dot(toEye, toEye), static_cast<uint32_t>(i)};
+        }
+        size_t count = std::min(kSceneOccluderPlants, nearest.size());
+        std::partial_sort(nearest.begin(), nearest.begin() + count, nearest.end());
+        for (size_t k = 0; k < count; ++k) {
+            const SceneInstance& instance = instances[nearest[k].second];
+            for (const Occluder& occluder : geometries[instance.geometry]->occluders) {
+                sceneOccluders_.push_back({Scene::transform(instance, occluder.start),
+                                           Scene::transform(instance, occluder.end),
+                                           occluder.radius * instance.scale});
+            }
+        }
+    }
+    culler_.setOccluders(sceneOccluders_);
+    
+    // Cull whole instances and pick their levels, then group them
+    sceneDraws_.clear();
+    for (size_t i = 0; i < instances.size(); ++i) {
+        const SceneInstance& instance = instances[i];
+        const PlantLOD& lod = geometries[instance.geometry]->lod;
+        if (lod.getLevelCount() == 0) continue;
+        glm::vec3 minBounds, maxBounds;
+        scene.getInstanceBounds(instance, minBounds, maxBounds);
+        if (cullingEnabled && !culler_.isVisible(minBounds, maxBounds)) continue;
+        
+        float distance = std::max(glm::length((minBounds + maxBounds) * 0.5f - eye), 0.1f);
+        size_t level = lod.selectLevel(focalPixels / distance * instance.scale, lodPixelError);
+        sceneDraws_.push_back({instance.geometry * levels + static_cast<uint32_t>(level), static_cast<uint32_t>(i)});
+    }
+    std::sort(sceneDraws_.begin(), sceneDraws_.end());
+    
+    // With instanced calls each group is one draw per mesh, placed by the
+    // instancing shader from one transform per visible instance
+    bool instanced = initInstancing();
+    if (instanced) {
+        sceneInstanceScratch_.resize(sceneDraws_.size());
+        for (size_t k = 0; k < sceneDraws_.size(); ++k) {
+            const SceneInstance& instance = instances[sceneDraws_[k].second];
+            float c = std::cos(instance.rotation) * instance.scale;
+            float s = std::sin(instance.rotation) * instance.scale;
+            GpuInstance& placement = sceneInstanceScratch_[k];
+            placement.origin = instance.position;
+            placement.axes[0] = glm::vec3(c, 0.0f, -s);     // As Scene::transform
+            placement.axes[1] = glm::vec3(0.0f, instance.scale, 0.0f);
+            placement.axes[2] = glm::vec3(s, 0.0f, c);
+            placement.color = glm::vec3(1.0f);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, sceneInstanceBuffer_);
+        glBufferData(GL_ARRAY_BUFFER, sceneInstanceScratch_.size() * sizeof(GpuInstance),
+                     sceneInstanceScratch_.data(), GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glUseProgram(instanceProgram_);
+    }
+    
     glEnable(GL_LIGHTING);
+    glEnable(GL_NORMALIZE);     // Instances are scaled
+    glMatrixMode(GL_MODELVIEW);
+    for (size_t first = 0, last = 0; first < sceneDraws_.size(); first = last) {
+        uint32_t slot = sceneDraws_[first].first;
+        while (last < sceneDraws_.size() && sceneDraws_[last].first == slot) ++last;
+        
+        // Object-space buffers, uploaded as each level is first selected and
+        // drawn whole: the instance has already been culled
+        const LODLevel& level = geometries[slot / levels]->lod.getLevel(slot % levels);
+        GpuMesh& stems = sceneStemBuffers_[slot];
+        GpuMesh& leaves = sceneLeafBuffers_[slot];
+        if (stems.source != &level || stems.version != scene.getVersion()) {
+            stageBranchMesh(level.mesh, stems);
+            upload(stems, &level, scene.getVersion());
+            stageLeaves(level.leaves, leaves);
+            upload(leaves, &level, scene.getVersion());
+        }
+        
+        auto drawGroup = [&](const GpuMesh& mesh, GLenum face, float specular, float shininess) {
+            if (mesh.batches.empty() || mesh.batches[0].count == 0) return;
+            applyVertexColorMaterial(face, mesh.baseColor, specular, shininess);
+            if (instanced) {
+                drawInstances(mesh.vertexBuffer, mesh.indexBuffer, sceneInstanceBuffer_, first, last - first,
+                              0, mesh.batches[0].count);
+                return;
+            }
+            bindMesh(mesh);
+            for (size_t k = first; k < last; ++k) {
+                const SceneInstance& instance = instances[sceneDraws_[k].second];
+                glPushMatrix();
+                glTranslatef(instance.position.x, instance.position.y, instance.position.z);
+                glRotatef(glm::degrees(instance.rotation), 0.0f, 1.0f, 0.0f);
+                glScalef(instance.scale, instance.scale, instance.scale);
+                glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(mesh.batches[0].count), GL_UNSIGNED_INT, nullptr);
+                glPopMatrix();
+            }
+            unbindMesh();
+        };
+        drawGroup(stems, GL_FRONT, 0.2f, 20.0f);
+        drawGroup(leaves, GL_FRONT_AND_BACK, 0.1f, 10.0f);
+        
+        sceneInstancesDrawn_ += last - first;
+        sceneTrianglesDrawn_ += (last - first) * (level.mesh.getTriangleCount() + level.leaves.size());
+    }
+    if (instanced) glUseProgram(0);
+    glDisable(GL_NORMALIZE);
+    glDisable(GL_COLOR_MATERIAL);
+}
+
+float Renderer::getPixelsPerUnit() const {
+    // Must match fov in setupProjection()
+    float fov = 45.0f;
+    float distance = std::max(cameraDistance, 0.1f);
+    return height_ / (2.0f * tan(glm::radians(fov) * 0.5f) * distance);
+}
+
+bool Renderer::getViewRay(double x, double y, glm::vec3& origin, glm::vec3& direction) const {
+    // Must match uiPanelWidth in beginFrame() and fov in setupProjection()
+    int uiPanelWidth = headless_ ? 0 : 400;
+    float fov = 45.0f;
+    int viewportWidth = width_ - uiPanelWidth;
+    if (x < uiPanelWidth || viewportWidth <= 0 || height_ <= 0) return false;
+    
+    float aspect = (float)viewportWidth / (float)height_;
+    float halfHeight = tan(glm::radians(fov) * 0.5f);
+    float ndcX = 2.0f * (float)(x - uiPanelWidth) / viewportWidth - 1.0f;
+    float ndcY = 1.0f - 2.0f * (float)y / height_;
     
-    for (const auto& leaf : leaves) {
-        drawLeaf(leaf.position, leaf.normal, leaf.size, leaf.color);
+    // Same basis as the lookAt in beginFrame()
+    glm::vec3 f = glm::normalize(cameraTarget_ - cameraPos_);
+    glm::vec3 s = glm::normalize(glm::cross(f, cameraUp_));
+    glm::vec3 u = glm::cross(s, f);
+    
+    origin = cameraPos_ - sceneOffset_;
+    direction = glm::normalize(f + s * (ndcX * halfHeight * aspect) + u * (ndcY * halfHeight));
+    return true;
+}
+
+void Renderer::stageLines(const SegmentBuffer& lines, GpuMesh& mesh) {
+    vertexScratch_.resize(2 * lines.size());
+    indexScratch_.resize(2 * lines.size());
+    mesh.batches.clear();
+    
+    // Vertices in segment order; indices sorted by width, one batch per width
+    for (size_t i = 0; i < lines.size(); ++i) {
+        GpuVertex vertex;
+        vertex.normal = glm::vec3(0.0f, 0.0f, 1.0f);
+        vertex.color = lines.colors[i];
+        vertex.position = lines.start(i);
+        vertexScratch_[2 * i] = vertex;
+        vertex.position = lines.end(i);
+        vertexScratch_[2 * i + 1] = vertex;
+    }
+    std::vector<uint32_t> order(lines.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = static_cast<uint32_t>(i);
     }
+    std::stable_sort(order.begin(), order.end(),
+                     [&](uint32_t a, uint32_t b) { return lines.radii[a] < lines.radii[b]; });
+    for (size_t i = 0; i < order.size(); ++i) {
+        indexScratch_[2 * i] = 2 * order[i];
+        indexScratch_[2 * i + 1] = 2 * order[i] + 1;
+        float width = lines.radii[order[i]] * 2.0f;
+        if (mesh.batches.empty() || mesh.batches.back().lineWidth != width) {
+            mesh.batches.push_back({width, 2 * i, 0});
+        }
+        mesh.batches.back().count += 2;
+    }
+    mesh.baseColor = lines.empty() ? glm::vec3(0.0f) : lines.colors[0];
 }
 
-void Renderer::drawCylinder(const glm::vec3& start, const glm::vec3& end, float radius, const glm::vec3& color) {
-    glm::vec3 direction = end - start;
-    float height = glm::length(direction);
+void Renderer::stageCylinders(const SegmentBuffer& cylinders, GpuMesh& mesh) {
+    static const int kRingVertices = 2 * kCylinderSides;
+    vertexScratch_.resize(kRingVertices * cylinders.size());
+    indexScratch_.resize(6 * kCylinderSides * cylinders.size());
     
-    if (height < 0.001f) return;
+    float ringCos[kCylinderSides], ringSin[kCylinderSides];
+    for (int k = 0; k < kCylinderSides; ++k) {
+        float angle = (float)k / kCylinderSides * 2.0f * M_PI;
+        ringCos[k] = cos(angle);
+        ringSin[k] = sin(angle);
+    }
     
-    direction = glm::normalize(direction);
+    // kCylinderSides sides with smooth normals, in world space
+    size_t vertexCount = 0, indexCount = 0;
+    for (size_t i = 0; i < cylinders.size(); ++i) {
+        const glm::vec3& start = cylinders.start(i);
+        glm::vec3 axis = cylinders.end(i) - start;
+        if (glm::length(axis) < 0.001f) continue;
+        
+        glm::vec3 u, v;
+        cylinderBasis(glm::normalize(axis), u, v);
+        float radius = cylinders.radii[i];
+        
+        uint32_t base = static_cast<uint32_t>(vertexCount);
+        for (int k = 0; k < kCylinderSides; ++k) {
+            GpuVertex vertex;
+            vertex.normal = ringCos[k] * u + ringSin[k] * v;
+            vertex.color = cylinders.colors[i];
+            vertex.position = start + vertex.normal * radius;
+            vertexScratch_[vertexCount++] = vertex;
+            vertex.position += axis;
+            vertexScratch_[vertexCount++] = vertex;
+        }
+        appendRingIndices(base, indexScratch_, indexCount);
+    }
+    vertexScratch_.resize(vertexCount);
+    indexScratch_.resize(indexCount);
     
-    glPushMatrix();
-    glTranslatef(start.x, start.y, start.z);
+    mesh.batches.assign(1, GpuBatch{1.0f, 0, indexCount});
+    mesh.baseColor = cylinders.empty() ? glm::vec3(0.0f) : cylinders.colors[0];
+}
+
+void Renderer::stageLeaves(const LeafBuffer& leaves, GpuMesh& mesh) {
+    vertexScratch_.resize(3 * leaves.size());
+    indexScratch_.resize(3 * leaves.size());
     
-    // Align cylinder with direction
-    glm::vec3 up(0.0f, 1.0f, 0.0f);
-    if (fabs(glm::dot(direction, up)) < 0.999f) {
-        glm::vec3 axis = glm::cross(up, direction);
-        float angle = acos(glm::dot(up, direction));
-        glRotatef(glm::degrees(angle), axis.x, axis.y, axis.z);
-    } else if (direction.y < 0) {
-        glRotatef(180.0f, 1.0f, 0.0f, 0.0f);
+    // Each leaf a triangle kLeafHeight times as tall as its half-width,
+    // unrotated, translated into place
+    for (size_t i = 0; i < leaves.size(); ++i) {
+        float size = leaves.sizes[i];
+        GpuVertex vertex;
+        vertex.normal = leaves.normals[i];
+        vertex.color = leaves.colors[i];
+        vertex.position = leaves.positions[i] + glm::vec3(-size, 0.0f, 0.0f);
+        vertexScratch_[3 * i] = vertex;
+        vertex.position = leaves.positions[i] + glm::vec3(size, 0.0f, 0.0f);
+        vertexScratch_[3 * i + 1] = vertex;
+        vertex.position = leaves.positions[i] + glm::vec3(0.0f, size * kLeafHeight, 0.0f);
+        vertexScratch_[3 * i + 2] = vertex;
+    }
+    for (size_t i = 0; i < indexScratch_.size(); ++i) {
+        indexScratch_[i] = static_cast<uint32_t>(i);
     }
     
-    // Set material color
-    float mat_ambient[] = {color.r * 0.3f, color.g * 0.3f, color.b * 0.3f, 1.0f};
-    float mat_diffuse[] = {color.r, color.g, color.b, 1.0f};
-    float mat_specular[] = {0.2f, 0.2f, 0.2f, 1.0f};
-    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
-    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
-    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
-    glMaterialf(GL_FRONT, GL_SHININESS, 20.0f);
+    mesh.batches.assign(1, GpuBatch{1.0f, 0, indexScratch_.size()});
+    mesh.baseColor = leaves.empty() ? glm::vec3(0.0f) : leaves.colors[0];
+}
+
+void Renderer::stageBranchMesh(const BranchMesh& branches, GpuMesh& mesh) {
+    vertexScratch_.resize(branches.getVertexCount());
+    for (size_t i = 0; i < vertexScratch_.size(); ++i) {
+        vertexScratch_[i].position = branches.positions[i];
+        vertexScratch_[i].normal = branches.normals[i];
+        vertexScratch_[i].color = branches.colors[i];
+    }
+    indexScratch_.assign(branches.indices.begin(), branches.indices.end());
     
-    // Draw cylinder using triangle strips
-    int segments = 8;
-    for (int i = 0; i < segments; ++i) {
-        float angle1 = (float)i / segments * 2.0f * M_PI;
-        float angle2 = (float)(i + 1) / segments * 2.0f * M_PI;
+    mesh.batches.assign(1, GpuBatch{1.0f, 0, indexScratch_.size()});
+    mesh.baseColor = branches.colors.empty() ? glm::vec3(0.0f) : branches.colors[0];
+}
+
+void Renderer::buildClusters(GpuMesh& mesh, size_t primitiveIndices) {
+    if (vertexScratch_.empty()) {
+        mesh.batches.clear();
+        return;
+    }
+    glm::vec3 lower(FLT_MAX), upper(-FLT_MAX);
+    for (const GpuVertex& vertex : vertexScratch_) {
+        lower = glm::min(lower, vertex.position);
+        upper = glm::max(upper, vertex.position);
+    }
+    glm::vec3 scale = 1.0f / glm::max(upper - lower, glm::vec3(1e-6f));
+    
+    // Within each batch, order primitives along a Morton curve through their
+    // centroids and cut the result into boxed clusters
+    size_t clusterPrimitives = std::max<size_t>(kClusterIndices / primitiveIndices, 1);
+    std::vector<GpuBatch> clusters;
+    std::vector<std::pair<uint32_t, uint32_t>> keys;
+    std::vector<uint32_t> sorted;
+    for (const GpuBatch& batch : mesh.batches) {
+        size_t primitives = batch.count / primitiveIndices;
+        const uint32_t* indices = indexScratch_.data() + batch.first;
+        keys.resize(primitives);
+        for (size_t p = 0; p < primitives; ++p) {
+            glm::vec3 centroid(0.0f);
+            for (size_t k = 0; k < primitiveIndices; ++k) {
+                centroid += vertexScratch_[indices[p * primitiveIndices + k]].position;
+            }
+            centroid /= static_cast<float>(primitiveIndices);
+            keys[p] = {mortonCode((centroid - lower) * scale), static_cast<uint32_t>(p)};
+        }
+        std::sort(keys.begin(), keys.end());
         
-        float x1 = radius * cos(angle1);
-        float z1 = radius * sin(angle1);
-        float x2 = radius * cos(angle2);
-        float z2 = radius * sin(angle2);
+        sorted.resize(primitives * primitiveIndices);
+        for (size_t p = 0; p < primitives; ++p) {
+            std::copy(indices + keys[p].second * primitiveIndices, indices + (keys[p].second + 1) * primitiveIndices,
+                      sorted.begin() + p * primitiveIndices);
+        }
+        std::copy(sorted.begin(), sorted.end(), indexScratch_.begin() + batch.first);
         
-        glBegin(GL_TRIANGLE_STRIP);
-        glNormal3f(cos(angle1), 0.0f, sin(angle1));
-        glVertex3f(x1, 0.0f, z1);
-        glVertex3f(x1, height, z1);
-        glNormal3f(cos(angle2), 0.0f, sin(angle2));
-        glVertex3f(x2, 0.0f, z2);
-        glVertex3f(x2, height, z2);
-        glEnd();
+        for (size_t p = 0; p < primitives; p += clusterPrimitives) {
+            GpuBatch cluster;
+            cluster.lineWidth = batch.lineWidth;
+            cluster.first = batch.first + p * primitiveIndices;
+            cluster.count = std::min(clusterPrimitives, primitives - p) * primitiveIndices;
+            cluster.minBounds = glm::vec3(FLT_MAX);
+            cluster.maxBounds = glm::vec3(-FLT_MAX);
+            for (size_t i = cluster.first; i < cluster.first + cluster.count; ++i) {
+                cluster.minBounds = glm::min(cluster.minBounds, vertexScratch_[indexScratch_[i]].position);
+                cluster.maxBounds = glm::max(cluster.maxBounds, vertexScratch_[indexScratch_[i]].position);
+            }
+            clusters.push_back(cluster);
+        }
+    }
+    mesh.batches.swap(clusters);
+}
+
+void Renderer::upload(GpuMesh& mesh, const void* source, uint64_t version) {
+    if (!mesh.vertexBuffer) {
+        glGenBuffers(1, &mesh.vertexBuffer);
+        glGenBuffers(1, &mesh.indexBuffer);
     }
     
-    glPopMatrix();
+    // Orphan and refill; the staging vectors keep their capacity
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, vertexScratch_.size() * sizeof(GpuVertex), vertexScratch_.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexScratch_.size() * sizeof(uint32_t), indexScratch_.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    
+    mesh.source = source;
+    mesh.version = version;
+}
+
+void Renderer::bindMesh(const GpuMesh& mesh) {
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBuffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(GpuVertex), (const void*)offsetof(GpuVertex, position));
+    glNormalPointer(GL_FLOAT, sizeof(GpuVertex), (const void*)offsetof(GpuVertex, normal));
+    glColorPointer(3, GL_FLOAT, sizeof(GpuVertex), (const void*)offsetof(GpuVertex, color));
 }
 
-void Renderer::drawLeaf(const glm::vec3& position, const glm::vec3& normal, float size, const glm::vec3& color) {
-    glPushMatrix();
-    glTranslatef(position.x, position.y, position.z);
+void Renderer::unbindMesh() {
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void Renderer::drawMesh(const GpuMesh& mesh, GLenum mode) {
+    if (mesh.batches.empty() || !mesh.vertexBuffer) return;
     
-    // Set material color for leaves
-    float mat_ambient[] = {color.r * 0.3f, color.g * 0.3f, color.b * 0.3f, 1.0f};
-    float mat_diffuse[] = {color.r, color.g, color.b, 1.0f};
-    float mat_specular[] = {0.1f, 0.1f, 0.1f, 1.0f};
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, mat_ambient);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, mat_diffuse);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, mat_specular);
-    glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 10.0f);
+    bindMesh(mesh);
     
-    // Draw simple quad for leaf
-    glBegin(GL_TRIANGLES);
-    glNormal3f(normal.x, normal.y, normal.z);
-    glVertex3f(-size, 0.0f, 0.0f);
-    glVertex3f(size, 0.0f, 0.0f);
-    glVertex3f(0.0f, size * 1.5f, 0.0f);
-    glEnd();
+    // Visible clusters that are neighbours in the index buffer and share a
+    // width go out as one call
+    size_t runFirst = 0, runCount = 0;
+    float runWidth = 0.0f;
+    auto flush = [&]() {
+        if (runCount == 0) return;
+        if (mode == GL_LINES) {
+            glLineWidth(runWidth);
+        }
+        glDrawElements(mode, static_cast<GLsizei>(runCount), GL_UNSIGNED_INT,
+                       (const void*)(runFirst * sizeof(uint32_t)));
+        runCount = 0;
+    };
+    for (const GpuBatch& batch : mesh.batches) {
+        if (batch.count == 0) continue;
+        if (cullingEnabled && !culler_.isVisible(batch.minBounds, batch.maxBounds)) continue;
+        if (runCount > 0 && batch.first == runFirst + runCount && batch.lineWidth == runWidth) {
+            runCount += batch.count;
+            continue;
+        }
+        flush();
+        runFirst = batch.first;
+        runCount = batch.count;
+        runWidth = batch.lineWidth;
+    }
+    flush();
     
-    glPopMatrix();
+    unbindMesh();
+}
+
+void Renderer::releaseMesh(GpuMesh& mesh) {
+    if (mesh.vertexBuffer) {
+        glDeleteBuffers(1, &mesh.vertexBuffer);
+        glDeleteBuffers(1, &mesh.indexBuffer);
+    }
+    mesh = GpuMesh();
+}
+
+void Renderer::releaseBuffers() {
+    releaseMesh(stemBuffers_);
+    releaseMesh(leafBuffers_);
+    for (GpuMesh& mesh : lodStemBuffers_) releaseMesh(mesh);
+    for (GpuMesh& mesh : lodLeafBuffers_) releaseMesh(mesh);
+    for (GpuMesh& mesh : sceneStemBuffers_) releaseMesh(mesh);
+    for (GpuMesh& mesh : sceneLeafBuffers_) releaseMesh(mesh);
+    lodStemBuffers_.clear();
+    lodLeafBuffers_.clear();
+    sceneStemBuffers_.clear();
+    sceneLeafBuffers_.clear();
+    
+    if (instanceProgram_) {
+        glDeleteProgram(instanceProgram_);
+        glDeleteBuffers(1, &unitVertexBuffer_);
+        glDeleteBuffers(1, &unitIndexBuffer_);
+        glDeleteBuffers(1, &instanceBuffer_);
+        glDeleteBuffers(1, &sceneInstanceBuffer_);
+    }
+    instancingChecked_ = false;
+    instanceProgram_ = 0;
+    unitVertexBuffer_ = unitIndexBuffer_ = instanceBuffer_ = sceneInstanceBuffer_ = 0;
+    instanceSource_ = nullptr;
+}
+
+bool Renderer::initInstancing() {
+    if (instancingChecked_) return instanceProgram_ != 0;
+    instancingChecked_ = true;
+    
+    if (!glfwExtensionSupported("GL_ARB_instanced_arrays")) {
+        std::cerr << "GL_ARB_instanced_arrays unavailable, drawing instanced plants from flattened buffers" << std::endl;
+        return false;
+    }
+    g_vertexAttribDivisor = (VertexAttribDivisorFn)glfwGetProcAddress("glVertexAttribDivisorARB");
+    g_drawElementsInstanced = (DrawElementsInstancedFn)glfwGetProcAddress("glDrawElementsInstancedARB");
+    if (!g_vertexAttribDivisor || !g_drawElementsInstanced) return false;
+    
+    GLuint vertexShader = compileShader(GL_VERTEX_SHADER, kInstanceVertexShader);
+    GLuint fragmentShader = compileShader(GL_FRAGMENT_SHADER, kInstanceFragmentShader);
+    if (!vertexShader || !fragmentShader) {
+        if (vertexShader) glDeleteShader(vertexShader);
+        if (fragmentShader) glDeleteShader(fragmentShader);
+        return false;
+    }
+    
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertexShader);
+    glAttachShader(program, fragmentShader);
+    glBindAttribLocation(program, kAttribPosition, "position");
+    glBindAttribLocation(program, kAttribNormal, "normal");
+    glBindAttribLocation(program, kAttribVertexColor, "vertexColor");
+    glBindAttribLocation(program, kAttribOrigin, "instanceOrigin");
+    glBindAttribLocation(program, kAttribAxisX, "instanceAxisX");
+    glBindAttribLocation(program, kAttribAxisY, "instanceAxisY");
+    glBindAttribLocation(program, kAttribAxisZ, "instanceAxisZ");
+    glBindAttribLocation(program, kAttribColor, "instanceColor");
+    glLinkProgram(program);
+    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+    
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        char log[1024];
+        glGetProgramInfoLog(program, sizeof(log), nullptr, log);
+        std::cerr << "Instancing shader failed to link: " << log << std::endl;
+        glDeleteProgram(program);
+        return false;
+    }
+    instanceProgram_ = program;
+    
+    // Unit cylinder along +z with radius 1 and height 1, then stageLeaves'
+    // triangle at size 1 facing +z
+    std::vector<GpuVertex> vertices(2 * kCylinderSides + 3);
+    std::vector<uint32_t> indices(6 * kCylinderSides + 3);
+    for (int k = 0; k < kCylinderSides; ++k) {
+        float angle = (float)k / kCylinderSides * 2.0f * M_PI;
+        GpuVertex vertex;
+        vertex.normal = glm::vec3(cos(angle), sin(angle), 0.0f);
+        vertex.color = glm::vec3(1.0f);
+        vertex.position = vertex.normal;
+        vertices[2 * k] = vertex;
+        vertex.position.z = 1.0f;
+        vertices[2 * k + 1] = vertex;
+    }
+    size_t indexCount = 0;
+    appendRingIndices(0, indices, indexCount);
+    
+    const glm::vec3 leafCorners[3] = {glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(1.0f, 0.0f, 0.0f),
+                                      glm::vec3(0.0f, kLeafHeight, 0.0f)};
+    for (int k = 0; k < 3; ++k) {
+        GpuVertex& vertex = vertices[2 * kCylinderSides + k];
+        vertex.position = leafCorners[k];
+        vertex.normal = glm::vec3(0.0f, 0.0f, 1.0f);
+        vertex.color = glm::vec3(1.0f);
+        indices[indexCount++] = 2 * kCylinderSides + k;
+    }
+    
+    glGenBuffers(1, &unitVertexBuffer_);
+    glGenBuffers(1, &unitIndexBuffer_);
+    glGenBuffers(1, &instanceBuffer_);
+    glGenBuffers(1, &sceneInstanceBuffer_);
+    glBindBuffer(GL_ARRAY_BUFFER, unitVertexBuffer_);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GpuVertex), vertices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, unitIndexBuffer_);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    return true;
+}
+
+void Renderer::stageInstances(const InstancedPlant& plant) {
+    instanceScratch_.clear();
+    instanceScratch_.reserve(plant.getCylinderCount() + plant.getLeafCount());
+    
+    // Cylinders first, placed as stageCylinders would
+    plant.forEachInstance([this](const Prototype& prototype, const InstanceTransform& transform) {
+        const SegmentBuffer& cylinders = prototype.cylinders;
+        for (size_t i = 0; i < cylinders.size(); ++i) {
+            glm::vec3 start = transform.origin + transform.frame * cylinders.start(i);
+            glm::vec3 axis = transform.frame * (cylinders.end(i) - cylinders.start(i));
+            if (glm::length(axis) < 0.001f) continue;
+            
+            glm::vec3 u, v;
+            cylinderBasis(glm::normalize(axis), u, v);
+            float radius = cylinders.radii[i] * transform.widthScale;
+            GpuInstance instance;
+            instance.origin = start;
+            instance.axes[0] = u * radius;
+            instance.axes[1] = v * radius;
+            instance.axes[2] = axis;
+            instance.color = cylinders.colors[i];
+            instanceScratch_.push_back(instance);
+        }
+    });
+    cylinderInstances_ = instanceScratch_.size();
+    
+    // Then leaves: scaled, unrotated triangles carrying their normal in the
+    // third axis
+    plant.forEachInstance([this](const Prototype& prototype, const InstanceTransform& transform) {
+        const LeafBuffer& leaves = prototype.leaves;
+        for (size_t i = 0; i < leaves.size(); ++i) {
+            float size = leaves.sizes[i] * transform.widthScale;
+            GpuInstance instance;
+            instance.origin = transform.origin + transform.frame * leaves.positions[i];
+            instance.axes[0] = glm::vec3(size, 0.0f, 0.0f);
+            instance.axes[1] = glm::vec3(0.0f, size, 0.0f);
+            instance.axes[2] = glm::normalize(transform.frame * leaves.normals[i]);
+            instance.color = leaves.colors[i];
+            instanceScratch_.push_back(instance);
+        }
+    });
+    leafInstances_ = instanceScratch_.size() - cylinderInstances_;
+    
+    clusterInstances(0, cylinderInstances_, false, cylinderClusters_);
+    clusterInstances(cylinderInstances_, leafInstances_, true, leafClusters_);
+    instanceOccluders_.clear();
+    for (size_t i = 0; i < cylinderInstances_; ++i) {
+        const GpuInstance& instance = instanceScratch_[i];
+        instanceOccluders_.push_back({instance.origin, instance.origin + instance.axes[2], glm::length(instance.axes[0])});
+    }
+    selectOccluders(instanceOccluders_);
+    
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer_);
+    glBufferData(GL_ARRAY_BUFFER, instanceScratch_.size() * sizeof(GpuInstance), instanceScratch_.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void Renderer::clusterInstances(size_t first, size_t count, bool leaves, std::vector<GpuBatch>& clusters) {
+    clusters.clear();
+    if (count == 0) return;
+    
+    // Box of each instance: a cylinder's axis padded by its radius, or the
+    // leaf triangle's extent
+    std::vector<glm::vec3> minBounds(count), maxBounds(count);
+    glm::vec3 lower(FLT_MAX), upper(-FLT_MAX);
+    for (size_t i = 0; i < count; ++i) {
+        const GpuInstance& instance = instanceScratch_[first + i];
+        if (leaves) {
+            float size = instance.axes[0].x;
+            minBounds[i] = instance.origin - glm::vec3(size, 0.0f, 0.0f);
+            maxBounds[i] = instance.origin + glm::vec3(size, size * kLeafHeight, 0.0f);
+        } else {
+            glm::vec3 end = instance.origin + instance.axes[2];
+            glm::vec3 padding(glm::length(instance.axes[0]));
+            minBounds[i] = glm::min(instance.origin, end) - padding;
+            maxBounds[i] = glm::max(instance.origin, end) + padding;
+        }
+        lower = glm::min(lower, minBounds[i]);
+        upper = glm::max(upper, maxBounds[i]);
+    }
+    glm::vec3 scale = 1.0f / glm::max(upper - lower, glm::vec3(1e-6f));
+    
+    // Morton order of box centers, then boxed runs of kClusterInstances
+    std::vector<std::pair<uint32_t, uint32_t>> keys(count);
+    for (size_t i = 0; i < count; ++i) {
+        glm::vec3 center = (minBounds[i] + maxBounds[i]) * 0.5f;
+        keys[i] = {mortonCode((center - lower) * scale), static_cast<uint32_t>(i)};
+    }
+    std::sort(keys.begin(), keys.end());
+    std::vector<GpuInstance> sorted(count);
+    for (size_t i = 0; i < count; ++i) {
+        sorted[i] = instanceScratch_[first + keys[i].second];
+    }
+    std::copy(sorted.begin(), sorted.end(), instanceScratch_.begin() + first);
+    
+    for (size_t i = 0; i < count; i += kClusterInstances) {
+        GpuBatch cluster;
+        cluster.lineWidth = 1.0f;
+        cluster.first = first + i;
+        cluster.count = std::min(kClusterInstances, count - i);
+        cluster.minBounds = glm::vec3(FLT_MAX);
+        cluster.maxBounds = glm::vec3(-FLT_MAX);
+        for (size_t k = i; k < i + cluster.count; ++k) {
+            cluster.minBounds = glm::min(cluster.minBounds, minBounds[keys[k].second]);
+            cluster.maxBounds = glm::max(cluster.maxBounds, maxBounds[keys[k].second]);
+        }
+        clusters.push_back(cluster);
+    }
+}
+
+void Renderer::drawInstanceClusters(const std::vector<GpuBatch>& clusters, size_t indexFirst, size_t indexCount) {
+    // As drawMesh: neighbouring visible clusters are drawn together
+    size_t runFirst = 0, runCount = 0;
+    for (const GpuBatch& cluster : clusters) {
+        if (cullingEnabled && !culler_.isVisible(cluster.minBounds, cluster.maxBounds)) continue;
+        if (runCount > 0 && cluster.first == runFirst + runCount) {
+            runCount += cluster.count;
+            continue;
+        }
+        drawInstances(unitVertexBuffer_, unitIndexBuffer_, instanceBuffer_, runFirst, runCount, indexFirst, indexCount);
+        runFirst = cluster.first;
+        runCount = cluster.count;
+    }
+    drawInstances(unitVertexBuffer_, unitIndexBuffer_, instanceBuffer_, runFirst, runCount, indexFirst, indexCount);
+}
+
+void Renderer::drawInstances(GLuint vertexBuffer, GLuint indexBuffer, GLuint instances,
+                             size_t first, size_t count, size_t indexFirst, size_t indexCount) {
+    if (count == 0) return;
+    
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    glVertexAttribPointer(kAttribPosition, 3, GL_FLOAT, GL_FALSE, sizeof(GpuVertex),
+                          (const void*)offsetof(GpuVertex, position));
+    glVertexAttribPointer(kAttribNormal, 3, GL_FLOAT, GL_FALSE, sizeof(GpuVertex),
+                          (const void*)offsetof(GpuVertex, normal));
+    glVertexAttribPointer(kAttribVertexColor, 3, GL_FLOAT, GL_FALSE, sizeof(GpuVertex),
+                          (const void*)offsetof(GpuVertex, color));
+    
+    // Instance attributes start at this range's first instance
+    glBindBuffer(GL_ARRAY_BUFFER, instances);
+    size_t base = first * sizeof(GpuInstance);
+    glVertexAttribPointer(kAttribOrigin, 3, GL_FLOAT, GL_FALSE, sizeof(GpuInstance),
+                          (const void*)(base + offsetof(GpuInstance, origin)));
+    for (int k = 0; k < 3; ++k) {
+        glVertexAttribPointer(kAttribAxisX + k, 3, GL_FLOAT, GL_FALSE, sizeof(GpuInstance),
+                              (const void*)(base + offsetof(GpuInstance, axes) + k * sizeof(glm::vec3)));
+    }
+    glVertexAttribPointer(kAttribColor, 3, GL_FLOAT, GL_FALSE, sizeof(GpuInstance),
+                          (const void*)(base + offsetof(GpuInstance, color)));
+    
+    for (GLuint attribute = kAttribPosition; attribute <= kAttribColor; ++attribute) {
+        glEnableVertexAttribArray(attribute);
+        g_vertexAttribDivisor(attribute, attribute >= kAttribOrigin ? 1 : 0);
+    }
+    
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+    g_drawElementsInstanced(GL_TRIANGLES, static_cast<GLsizei>(indexCount), GL_UNSIGNED_INT,
+                            (const void*)(indexFirst * sizeof(uint32_t)), static_cast<GLsizei>(count));
+    
+    for (GLuint attribute = kAttribPosition; attribute <= kAttribColor; ++attribute) {
+        g_vertexAttribDivisor(attribute, 0);
+        glDisableVertexAttribArray(attribute);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
 void Renderer::setupLighting() {
@@ -273,7 +1264,7 @@ void Renderer::setupProjection() {
     
     // CUSTOMIZATION: Must match the uiPanelWidth in beginFrame()
     // Calculate aspect ratio based on the actual viewport size (right side only)
-    int uiPanelWidth = 400;  // <- CHANGE THIS to match beginFrame() value
+    int uiPanelWidth = headless_ ? 0 : 400;  // <- CHANGE THIS to match beginFrame() value
     int viewportWidth = width_ - uiPanelWidth;
     int viewportHeight = height_;
     float aspect = (float)viewportWidth / (float)viewportHeight;
@@ -287,6 +1278,12 @@ void Renderer::setupProjection() {
     float left = -right;
     
     glFrustum(left, right, bottom, top, near, far);
+    
+    // The same matrix for culling
+    projection_ = glm::mat4(glm::vec4(2.0f * near / (right - left), 0.0f, 0.0f, 0.0f),
+                            glm::vec4(0.0f, 2.0f * near / (top - bottom), 0.0f, 0.0f),
+                            glm::vec4(0.0f, 0.0f, -(far + near) / (far - near), -1.0f),
+                            glm::vec4(0.0f, 0.0f, -2.0f * far * near / (far - near), 0.0f));
 }
 
 bool Renderer::shouldClose() const {
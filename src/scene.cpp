@@ -0,0 +1,191 @@
+#include "scene.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include <tuple>
+
+// Thickest cylinders of each geometry kept as occluders
+static const size_t kGeometryOccluders = 8;
+
+PlantKey::PlantKey()
+    : seed(0), iterations(4), angle(25.0f), stepLength(0.5f), stepWidth(0.05f), lengthScale(0.9f),
+      widthScale(0.7f), tropism(0.0f, -0.1f, 0.0f) {}
+
+bool PlantKey::operator<(const PlantKey& other) const {
+    return std::tie(preset, seed, iterations, angle, stepLength, stepWidth, lengthScale, widthScale,
+                    tropism.x, tropism.y, tropism.z) <
+           std::tie(other.preset, other.seed, other.iterations, other.angle, other.stepLength, other.stepWidth,
+                    other.lengthScale, other.widthScale, other.tropism.x, other.tropism.y, other.tropism.z);
+}
+
+Scene::Scene() : triangles_(0), minBounds_(0.0f), maxBounds_(0.0f), version_(0) {
+    // Each grammar is derived once per key; the strings aren't needed after
+    lsystem_.setCacheEnabled(false);
+    lsystem_.setSymbolBudget(64u << 20);
+    turtle_.setMergeStraightRuns(true);
+}
+
+uint32_t Scene::acquire(const PlantKey& key) {
+    // Seeds only matter to stochastic grammars
+    PlantKey canonical = key;
+    lsystem_.loadPreset(key.preset);
+    if (lsystem_.isDeterministic()) canonical.seed = 0;
+    auto found = cache_.find(canonical);
+    if (found != cache_.end()) return found->second;
+
+    lsystem_.setSeed(canonical.seed);
+    const std::string& derived = lsystem_.generate(canonical.iterations);
+    turtle_.setAngle(canonical.angle);
+    turtle_.setStepLength(canonical.stepLength);
+    turtle_.setStepWidth(canonical.stepWidth);
+    turtle_.setLengthScale(canonical.lengthScale);
+    turtle_.setWidthScale(canonical.widthScale);
+    turtle_.setTropism(canonical.tropism);
+    turtle_.set3DMode(true);
+    turtle_.interpret(derived);
+
+    std::unique_ptr<PlantGeometry> geometry(new PlantGeometry());
+    geometry->key = canonical;
+    geometry->minBounds = turtle_.getMinBounds();
+    geometry->maxBounds = turtle_.getMaxBounds();
+    geometry->lod.build(turtle_.getSegments(), turtle_.getLeaves(), geometry->minBounds, geometry->maxBounds);
+    const LODLevel& full = geometry->lod.getLevel(0);
+    geometry->triangles = full.mesh.getTriangleCount() + full.leaves.size();
+
+    const SegmentBuffer& cylinders = full.cylinders;
+    for (size_t i = 0; i < cylinders.size(); ++i) {
+        geometry->occluders.push_back({cylinders.start(i), cylinders.end(i), cylinders.radii[i]});
+    }
+    size_t kept = std::min(kGeometryOccluders, geometry->occluders.size());
+    std::partial_sort(geometry->occluders.begin(), geometry->occluders.begin() + kept, geometry->occluders.end(),
+                      [](const Occluder& a, const Occluder& b) { return a.radius > b.radius; });
+    geometry->occluders.resize(kept);
+
+    uint32_t index = static_cast<uint32_t>(geometries_.size());
+    geometries_.push_back(std::move(geometry));
+    cache_[canonical] = index;
+    return index;
+}
+
+void Scene::addInstance(uint32_t geometry, const glm::vec3& position, float rotation, float scale) {
+    SceneInstance instance = {geometry, position, rotation, scale};
+    glm::vec3 minBounds, maxBounds;
+    getInstanceBounds(instance, minBounds, maxBounds);
+    if (instances_.empty()) {
+        minBounds_ = minBounds;
+        maxBounds_ = maxBounds;
+    } else {
+        minBounds_ = glm::min(minBounds_, minBounds);
+        maxBounds_ = glm::max(maxBounds_, maxBounds);
+    }
+    instances_.push_back(instance);
+    triangles_ += geometries_[geometry]->triangles;
+}
+
+void Scene::scatter(const ScatterOptions& options) {
+    clearInstances();
+
+    // Geometry for every species and seed variant, before any placement
+    std::vector<uint32_t> variants;
+    if (options.count > 0) {
+        for (const PlantKey& species : options.species) {
+            for (int v = 0; v < std::max(options.seedsPerSpecies, 1); ++v) {
+                PlantKey key = species;
+                key.seed = species.seed + v;
+                variants.push_back(acquire(key));
+            }
+        }
+    }
+    dropUnused(variants);
+    if (variants.empty()) return;
+
+    // A random subset of the cells of the smallest square grid that holds
+    // count plants, each jittered inside the middle of its cell so
+    // neighbours keep some distance
+    std::mt19937_64 rng(options.seed);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    size_t side = static_cast<size_t>(std::ceil(std::sqrt(static_cast<double>(options.count))));
+    float cellSize = 2.0f * options.extent / side;
+    std::vector<uint32_t> cells(side * side);
+    std::iota(cells.begin(), cells.end(), 0u);
+    std::shuffle(cells.begin(), cells.end(), rng);
+    cells.resize(options.count);
+    std::sort(cells.begin(), cells.end());
+
+    instances_.reserve(options.count);
+    for (uint32_t cell : cells) {
+        float x = -options.extent + (cell % side + 0.15f + 0.7f * unit(rng)) * cellSize;
+        float z = -options.extent + (cell / side + 0.15f + 0.7f * unit(rng)) * cellSize;
+        uint32_t geometry = variants[rng() % variants.size()];
+        float rotation = unit(rng) * 2.0f * static_cast<float>(M_PI);
+        float scale = options.minScale + (options.maxScale - options.minScale) * unit(rng);
+        float height = geometries_[geometry]->maxBounds.y;
+        if (options.height > 0.0f && height > 0.0f) scale *= options.height / height;
+        addInstance(geometry, glm::vec3(x, 0.0f, z), rotation, scale);
+    }
+}
+
+void Scene::dropUnused(std::vector<uint32_t>& used) {
+    std::vector<uint32_t> remap(geometries_.size(), UINT32_MAX);
+    for (uint32_t geometry : used) remap[geometry] = 0;
+    uint32_t kept = 0;
+    for (size_t i = 0; i < geometries_.size(); ++i) {
+        if (remap[i] == UINT32_MAX) continue;
+        remap[i] = kept;
+        if (i != kept) geometries_[kept] = std::move(geometries_[i]);
+        ++kept;
+    }
+    if (kept == geometries_.size()) return;
+
+    geometries_.resize(kept);
+    cache_.clear();
+    for (uint32_t i = 0; i < kept; ++i) {
+        cache_[geometries_[i]->key] = i;
+    }
+    for (uint32_t& geometry : used) geometry = remap[geometry];
+    ++version_;
+}
+
+void Scene::clearInstances() {
+    instances_.clear();
+    triangles_ = 0;
+    minBounds_ = maxBounds_ = glm::vec3(0.0f);
+}
+
+void Scene::clear() {
+    clearInstances();
+    geometries_.clear();
+    cache_.clear();
+    ++version_;
+}
+
+glm::vec3 Scene::transform(const SceneInstance& instance, const glm::vec3& point) {
+    // glRotatef about +y, then uniform scale
+    float c = std::cos(instance.rotation) * instance.scale;
+    float s = std::sin(instance.rotation) * instance.scale;
+    return instance.position + glm::vec3(c * point.x + s * point.z, instance.scale * point.y, -s * point.x + c * point.z);
+}
+
+void Scene::getInstanceBounds(const SceneInstance& instance, glm::vec3& minBounds, glm::vec3& maxBounds) const {
+    const PlantGeometry& geometry = *geometries_[instance.geometry];
+    float c = std::cos(instance.rotation) * instance.scale;
+    float s = std::sin(instance.rotation) * instance.scale;
+
+    // Rotating about y moves only the horizontal corners
+    minBounds = glm::vec3(FLT_MAX, geometry.minBounds.y * instance.scale, FLT_MAX);
+    maxBounds = glm::vec3(-FLT_MAX, geometry.maxBounds.y * instance.scale, -FLT_MAX);
+    for (int corner = 0; corner < 4; ++corner) {
+        float x = corner & 1 ? geometry.maxBounds.x : geometry.minBounds.x;
+        float z = corner & 2 ? geometry.maxBounds.z : geometry.minBounds.z;
+        float rx = c * x + s * z;
+        float rz = -s * x + c * z;
+        minBounds.x = std::min(minBounds.x, rx);
+        maxBounds.x = std::max(maxBounds.x, rx);
+        minBounds.z = std::min(minBounds.z, rz);
+        maxBounds.z = std::max(maxBounds.z, rz);
+    }
+    minBounds += instance.position;
+    maxBounds += instance.position;
+}
@@ -0,0 +1,561 @@
+#include "softwarerenderer.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SOFTWARE_RASTER_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SOFTWARE_RASTER_NEON
+#endif
+
+// Same view volume as Renderer::setupProjection()
+static const float kFov = 45.0f;
+static const float kNear = 0.1f;
+static const float kFar = 100.0f;
+
+// Renderer::beginFrame()'s clear color
+static const glm::vec3 kBackground(0.1f, 0.1f, 0.15f);
+
+// Renderer::setupLighting()'s light 0 plus GL's default global ambient
+static const glm::vec3 kLightDirection(2.0f, 5.0f, 3.0f);
+static const glm::vec3 kLightAmbient(0.3f + 0.2f, 0.3f + 0.2f, 0.35f + 0.2f);
+static const glm::vec3 kLightDiffuse(0.8f, 0.8f, 0.7f);
+static const float kLightSpecular = 0.5f;
+
+static const int kCylinderSides = 8;
+static const float kLeafHeight = 1.5f;
+
+// Cylinders narrower than this on screen are drawn as a camera-facing quad
+static const float kThinCylinderPixels = 0.75f;
+
+static const int kTileSize = 32;                // Multiple of 4
+static const size_t kChunkPrimitives = 256;
+static const size_t kBatchPrimitives = 1 << 14; // Bounds setup memory
+static const float kLaneOffsets[4] = {0.0f, 1.0f, 2.0f, 3.0f};
+
+// Four pixels of an edge or depth plane at a time; comparisons return one
+// bit per lane
+#if defined(SOFTWARE_RASTER_SSE2)
+struct Lane4 {
+    __m128 v;
+};
+static inline Lane4 splat(float x) { return {_mm_set1_ps(x)}; }
+static inline Lane4 load(const float* p) { return {_mm_loadu_ps(p)}; }
+static inline void store(float* p, Lane4 a) { _mm_storeu_ps(p, a.v); }
+static inline Lane4 operator+(Lane4 a, Lane4 b) { return {_mm_add_ps(a.v, b.v)}; }
+static inline Lane4 operator*(Lane4 a, Lane4 b) { return {_mm_mul_ps(a.v, b.v)}; }
+static inline int greaterMask(Lane4 a, Lane4 b) { return _mm_movemask_ps(_mm_cmpgt_ps(a.v, b.v)); }
+static inline int greaterEqualMask(Lane4 a, Lane4 b) { return _mm_movemask_ps(_mm_cmpge_ps(a.v, b.v)); }
+#elif defined(SOFTWARE_RASTER_NEON)
+struct Lane4 {
+    float32x4_t v;
+};
+static inline int laneBits(uint32x4_t mask) {
+    static const uint32_t bits[4] = {1, 2, 4, 8};
+    return static_cast<int>(vaddvq_u32(vandq_u32(mask, vld1q_u32(bits))));
+}
+static inline Lane4 splat(float x) { return {vdupq_n_f32(x)}; }
+static inline Lane4 load(const float* p) { return {vld1q_f32(p)}; }
+static inline void store(float* p, Lane4 a) { vst1q_f32(p, a.v); }
+static inline Lane4 operator+(Lane4 a, Lane4 b) { return {vaddq_f32(a.v, b.v)}; }
+static inline Lane4 operator*(Lane4 a, Lane4 b) { return {vmulq_f32(a.v, b.v)}; }
+static inline int greaterMask(Lane4 a, Lane4 b) { return laneBits(vcgtq_f32(a.v, b.v)); }
+static inline int greaterEqualMask(Lane4 a, Lane4 b) { return laneBits(vcgeq_f32(a.v, b.v)); }
+#else
+struct Lane4 {
+    float v[4];
+};
+static inline Lane4 splat(float x) { return {{x, x, x, x}}; }
+static inline Lane4 load(const float* p) { return {{p[0], p[1], p[2], p[3]}}; }
+static inline void store(float* p, Lane4 a) { std::copy(a.v, a.v + 4, p); }
+static inline Lane4 operator+(Lane4 a, Lane4 b) {
+    return {{a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3]}};
+}
+static inline Lane4 operator*(Lane4 a, Lane4 b) {
+    return {{a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3]}};
+}
+static inline int greaterMask(Lane4 a, Lane4 b) {
+    return (a.v[0] > b.v[0]) | (a.v[1] > b.v[1]) << 1 | (a.v[2] > b.v[2]) << 2 | (a.v[3] > b.v[3]) << 3;
+}
+static inline int greaterEqualMask(Lane4 a, Lane4 b) {
+    return (a.v[0] >= b.v[0]) | (a.v[1] >= b.v[1]) << 1 | (a.v[2] >= b.v[2]) << 2 | (a.v[3] >= b.v[3]) << 3;
+}
+#endif
+
+// Unit vectors u, v completing an orthonormal frame around direction
+static void cylinderBasis(const glm::vec3& direction, glm::vec3& u, glm::vec3& v) {
+    glm::vec3 reference = fabs(direction.y) < 0.999f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+    u = glm::normalize(glm::cross(reference, direction));
+    v = glm::cross(direction, u);
+}
+
+static inline uint8_t toByte(float c) {
+    return static_cast<uint8_t>(std::min(std::max(c, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+SoftwareRenderer::SoftwareRenderer()
+    : cameraDistance(6.0f), cameraRotationX(20.0f), cameraRotationY(45.0f),
+      cameraTarget_(0.0f, 0.0f, 0.0f), lodPixelError(1.0f), width_(0), height_(0),
+      selectedLOD_(0), cameraPos_(0.0f, 0.0f, 6.0f), depthStride_(0),
+      tilesX_(0), tilesY_(0) {}
+
+bool SoftwareRenderer::initializeHeadless(int width, int height) {
+    if (width <= 0 || height <= 0) return false;
+    width_ = width;
+    height_ = height;
+
+    color_ = Image(width_, height_);
+    depthStride_ = (width_ + 3) & ~3;
+    depth_.assign(static_cast<size_t>(depthStride_) * height_, 1.0f);
+    tilesX_ = (width_ + kTileSize - 1) / kTileSize;
+    tilesY_ = (height_ + kTileSize - 1) / kTileSize;
+    return true;
+}
+
+void SoftwareRenderer::updateCamera(float /*deltaTime*/) {
+    // Renderer::updateCamera()'s orbit
+    float radX = glm::radians(cameraRotationX);
+    float radY = glm::radians(cameraRotationY);
+
+    cameraPos_.x = cameraTarget_.x + cameraDistance * sin(radY) * cos(radX);
+    cameraPos_.y = cameraTarget_.y + cameraDistance * sin(radX);
+    cameraPos_.z = cameraTarget_.z + cameraDistance * cos(radY) * cos(radX);
+}
+
+float SoftwareRenderer::getPixelsPerUnit() const {
+    float distance = std::max(cameraDistance, 0.1f);
+    return height_ / (2.0f * tan(glm::radians(kFov) * 0.5f) * distance);
+}
+
+void SoftwareRenderer::beginFrame() {
+    // Same lookAt and frustum as Renderer::beginFrame(), over the whole image
+    forward_ = glm::normalize(cameraTarget_ - cameraPos_);
+    right_ = glm::normalize(glm::cross(forward_, glm::vec3(0.0f, 1.0f, 0.0f)));
+    up_ = glm::cross(right_, forward_);
+
+    float halfHeight = tan(glm::radians(kFov) * 0.5f);
+    projectionY_ = 1.0f / halfHeight;
+    projectionX_ = projectionY_ * height_ / width_;
+    focalPixels_ = 0.5f * height_ * projectionY_;
+
+    // Light 0 is fixed in world space; the viewer is at infinity
+    halfVector_ = glm::normalize(glm::normalize(kLightDirection) - forward_);
+
+    uint8_t background[3] = {toByte(kBackground.r), toByte(kBackground.g), toByte(kBackground.b)};
+    for (size_t i = 0; i < color_.pixels.size(); i += 3) {
+        std::copy(background, background + 3, color_.pixels.data() + i);
+    }
+    std::fill(depth_.begin(), depth_.end(), 1.0f);
+}
+
+void SoftwareRenderer::render(const Turtle& turtle) {
+    if (!turtle.is3DMode()) {
+        renderLines(turtle.getSegments());
+        return;
+    }
+    renderCylinders(turtle.getSegments());
+    renderLeaves(turtle.getLeaves());
+}
+
+void SoftwareRenderer::render(const InstancedPlant& plant) {
+    SegmentBuffer cylinders;
+    LeafBuffer leaves;
+    plant.flatten(cylinders, leaves);
+    renderCylinders(cylinders);
+    renderLeaves(leaves);
+}
+
+void SoftwareRenderer::render(const BranchMesh& mesh, const LeafBuffer& leaves) {
+    // Light each vertex once; triangles then share the results
+    litColors_.resize(mesh.getVertexCount());
+    size_t vertexChunks = (litColors_.size() + kBatchPrimitives - 1) / kBatchPrimitives;
+    pool_.parallelFor(vertexChunks, [&](size_t chunk) {
+        size_t end = std::min(litColors_.size(), (chunk + 1) * kBatchPrimitives);
+        for (size_t i = chunk * kBatchPrimitives; i < end; ++i) {
+            litColors_[i] = shade(mesh.normals[i], mesh.colors[i], 0.2f, 20.0f);
+        }
+    });
+
+    draw(mesh.getTriangleCount(), [&](size_t i, Chunk& chunk) {
+        const uint32_t* index = &mesh.indices[3 * i];
+        glm::vec3 positions[3] = {mesh.positions[index[0]], mesh.positions[index[1]], mesh.positions[index[2]]};
+        glm::vec3 colors[3] = {litColors_[index[0]], litColors_[index[1]], litColors_[index[2]]};
+        emitTriangle(positions, colors, chunk);
+    });
+    renderLeaves(leaves);
+}
+
+void SoftwareRenderer::render(const PlantLOD& lod) {
+    if (lod.getLevelCount() == 0) return;
+    selectedLOD_ = lod.selectLevel(getPixelsPerUnit(), lodPixelError);
+    const LODLevel& level = lod.getLevel(selectedLOD_);
+    render(level.mesh, level.leaves);
+}
+
+bool SoftwareRenderer::readImage(Image& image) const {
+    if (width_ <= 0 || height_ <= 0) return false;
+    image = color_;
+    return true;
+}
+
+void SoftwareRenderer::renderCylinders(const SegmentBuffer& cylinders) {
+    draw(cylinders.size(), [&](size_t i, Chunk& chunk) {
+        emitCylinder(cylinders.start(i), cylinders.end(i), cylinders.radii[i], cylinders.colors[i], chunk);
+    });
+}
+
+void SoftwareRenderer::renderLeaves(const LeafBuffer& leaves) {
+    draw(leaves.size(), [&](size_t i, Chunk& chunk) {
+        emitLeaf(leaves.positions[i], leaves.normals[i], leaves.sizes[i], leaves.colors[i], chunk);
+    });
+}
+
+void SoftwareRenderer::renderLines(const SegmentBuffer& lines) {
+    // glLineWidth(radius * 2), at least one pixel wide as in GL
+    draw(lines.size(), [&](size_t i, Chunk& chunk) {
+        emitLine(lines.start(i), lines.end(i), std::max(lines.radii[i] * 2.0f, 1.0f), lines.colors[i], chunk);
+    });
+}
+
+template <typename Emit>
+void SoftwareRenderer::draw(size_t primitiveCount, Emit&& emit) {
+    if (width_ <= 0 || height_ <= 0) return;
+
+    for (size_t begin = 0; begin < primitiveCount; begin += kBatchPrimitives) {
+        size_t end = std::min(primitiveCount, begin + kBatchPrimitives);
+        size_t chunkCount = (end - begin + kChunkPrimitives - 1) / kChunkPrimitives;
+        if (chunks_.size() < chunkCount) chunks_.resize(chunkCount);
+
+        // Setup: every chunk lights, clips, projects and bins its primitives
+        pool_.parallelFor(chunkCount, [&](size_t c) {
+            Chunk& chunk = chunks_[c];
+            chunk.triangles.clear();
+            chunk.binTiles.clear();
+            chunk.binTriangles.clear();
+            size_t first = begin + c * kChunkPrimitives;
+            size_t last = std::min(end, first + kChunkPrimitives);
+            for (size_t i = first; i < last; ++i) {
+                emit(i, chunk);
+            }
+        });
+
+        binChunks(chunkCount);
+
+        // Fill: tiles are disjoint, so each is owned by one thread
+        pool_.parallelFor(tileStart_.size() - 1, [this](size_t tile) { fillTile(tile); });
+    }
+}
+
+void SoftwareRenderer::binChunks(size_t chunkCount) {
+    // Counting sort by tile, chunk by chunk: each tile sees its triangles in
+    // submission order
+    size_t tileCount = static_cast<size_t>(tilesX_) * tilesY_;
+    tileStart_.assign(tileCount + 1, 0);
+    for (size_t c = 0; c < chunkCount; ++c) {
+        for (uint32_t tile : chunks_[c].binTiles) {
+            ++tileStart_[tile + 1];
+        }
+    }
+    for (size_t tile = 0; tile < tileCount; ++tile) {
+        tileStart_[tile + 1] += tileStart_[tile];
+    }
+
+    tileEntries_.resize(tileStart_[tileCount]);
+    std::vector<uint32_t> cursor(tileStart_.begin(), tileStart_.end() - 1);
+    for (size_t c = 0; c < chunkCount; ++c) {
+        const Chunk& chunk = chunks_[c];
+        for (size_t i = 0; i < chunk.binTiles.size(); ++i) {
+            tileEntries_[cursor[chunk.binTiles[i]]++] = &chunk.triangles[chunk.binTriangles[i]];
+        }
+    }
+}
+
+void SoftwareRenderer::fillTile(size_t tile) {
+    int tileMinX = static_cast<int>(tile % tilesX_) * kTileSize;
+    int tileMinY = static_cast<int>(tile / tilesX_) * kTileSize;
+    int tileMaxX = std::min(tileMinX + kTileSize, width_) - 1;
+    int tileMaxY = std::min(tileMinY + kTileSize, height_) - 1;
+    const Lane4 laneOffsets = load(kLaneOffsets);
+
+    for (uint32_t entry = tileStart_[tile]; entry < tileStart_[tile + 1]; ++entry) {
+        const RasterTriangle& tri = *tileEntries_[entry];
+        int minX = std::max(tri.minX, tileMinX) & ~3;   // Blocks stay inside the tile
+        int maxX = std::min(tri.maxX, tileMaxX);
+        int minY = std::max(tri.minY, tileMinY);
+        int maxY = std::min(tri.maxY, tileMaxY);
+
+        for (int y = minY; y <= maxY; ++y) {
+            // Narrow the row to where each edge crosses it, so slivers don't
+            // scan their whole box; a pixel of slack on either side leaves
+            // the exact test below to decide coverage
+            int rowMinX = minX, rowMaxX = maxX;
+            bool empty = false;
+            for (int e = 0; e < 3 && !empty; ++e) {
+                float a = tri.edgeA[e];
+                float value = tri.edgeB[e] * y + tri.edgeC[e];
+                float crossing = -value / a;
+                if (a > 0.0f) {
+                    empty = crossing > rowMaxX + 1;
+                    if (!empty && crossing > rowMinX) rowMinX = static_cast<int>(crossing) - 1;
+                } else if (a < 0.0f) {
+                    empty = crossing < rowMinX - 1;
+                    if (!empty && crossing < rowMaxX) rowMaxX = static_cast<int>(crossing) + 1;
+                } else {
+                    empty = value < 0.0f;
+                }
+            }
+            rowMinX = std::max(rowMinX, minX) & ~3;
+            rowMaxX = std::min(rowMaxX, maxX);
+            if (empty || rowMinX > rowMaxX) continue;
+
+            float* depthRow = depth_.data() + static_cast<size_t>(y) * depthStride_;
+            uint8_t* colorRow = color_.row(y);
+            Lane4 edgeRow[3], edgeStep[3];
+            for (int e = 0; e < 3; ++e) {
+                edgeRow[e] = splat(tri.edgeB[e] * y + tri.edgeC[e]);
+                edgeStep[e] = splat(tri.edgeA[e]);
+            }
+            Lane4 depthRowValue = splat(tri.depthB * y + tri.depthC);
+            Lane4 depthStep = splat(tri.depthA);
+
+            for (int x = rowMinX; x <= rowMaxX; x += 4) {
+                Lane4 px = splat(static_cast<float>(x)) + laneOffsets;
+
+                // Inside all three edges, on-edge pixels by the top-left rule
+                int covered = maxX - x >= 3 ? 0xF : (1 << (maxX - x + 1)) - 1;
+                Lane4 edge[3];
+                for (int e = 0; e < 3 && covered; ++e) {
+                    edge[e] = edgeStep[e] * px + edgeRow[e];
+                    covered &= tri.edgeInclusive[e] ? greaterEqualMask(edge[e], splat(0.0f))
+                                                    : greaterMask(edge[e], splat(0.0f));
+                }
+                if (!covered) continue;
+
+                Lane4 depth = depthStep * px + depthRowValue;
+                covered &= greaterMask(load(depthRow + x), depth);
+                if (!covered) continue;
+
+                float edgeValues[3][4], depthValues[4];
+                for (int e = 0; e < 3; ++e) store(edgeValues[e], edge[e]);
+                store(depthValues, depth);
+                for (int lane = 0; lane < 4; ++lane) {
+                    if (!(covered & (1 << lane))) continue;
+
+                    // Perspective-correct Gouraud color
+                    float weight[3], total = 0.0f;
+                    for (int e = 0; e < 3; ++e) {
+                        weight[e] = edgeValues[e][lane] * tri.invArea * tri.invW[e];
+                        total += weight[e];
+                    }
+                    glm::vec3 color = (tri.color[0] * weight[0] + tri.color[1] * weight[1] +
+                                       tri.color[2] * weight[2]) / total;
+
+                    depthRow[x + lane] = depthValues[lane];
+                    uint8_t* pixel = colorRow + 3 * (x + lane);
+                    pixel[0] = toByte(color.r);
+                    pixel[1] = toByte(color.g);
+                    pixel[2] = toByte(color.b);
+                }
+            }
+        }
+    }
+}
+
+glm::vec3 SoftwareRenderer::shade(const glm::vec3& normal, const glm::vec3& color, float specular, float shininess) const {
+    // Fixed-function light 0 with Renderer's applyVertexColorMaterial: ambient
+    // 0.3 * color, diffuse color, and no two-sided lighting
+    glm::vec3 lit = color * 0.3f * kLightAmbient;
+    float diffuse = glm::dot(normal, glm::normalize(kLightDirection));
+    if (diffuse > 0.0f) {
+        lit += color * kLightDiffuse * diffuse;
+        float highlight = std::max(glm::dot(normal, halfVector_), 0.0f);
+        lit += glm::vec3(specular * kLightSpecular * std::pow(highlight, shininess));
+    }
+    return glm::vec3(std::min(lit.r, 1.0f), std::min(lit.g, 1.0f), std::min(lit.b, 1.0f));
+}
+
+void SoftwareRenderer::emitTriangle(const glm::vec3 positions[3], const glm::vec3 colors[3], Chunk& chunk) const {
+    // Eye space, with depth along the view direction
+    glm::vec3 eye[3];
+    int inFront = 0;
+    for (int k = 0; k < 3; ++k) {
+        glm::vec3 offset = positions[k] - cameraPos_;
+        eye[k] = glm::vec3(glm::dot(offset, right_), glm::dot(offset, up_), glm::dot(offset, forward_));
+        inFront += eye[k].z >= kNear;
+    }
+    if (inFront == 0) return;
+    if (inFront == 3) {
+        setupTriangle(project(eye[0], colors[0]), project(eye[1], colors[1]), project(eye[2], colors[2]), chunk);
+        return;
+    }
+
+    // Clip against the near plane into a triangle or a quad
+    ScreenVertex clipped[4];
+    int count = 0;
+    for (int k = 0; k < 3; ++k) {
+        int next = (k + 1) % 3;
+        bool inside = eye[k].z >= kNear;
+        if (inside) {
+            clipped[count++] = project(eye[k], colors[k]);
+        }
+        if (inside != (eye[next].z >= kNear)) {
+            float t = (kNear - eye[k].z) / (eye[next].z - eye[k].z);
+            clipped[count++] = project(eye[k] + (eye[next] - eye[k]) * t, colors[k] + (colors[next] - colors[k]) * t);
+        }
+    }
+    for (int k = 2; k < count; ++k) {
+        setupTriangle(clipped[0], clipped[k - 1], clipped[k], chunk);
+    }
+}
+
+void SoftwareRenderer::emitCylinder(const glm::vec3& start, const glm::vec3& end, float radius,
+                                    const glm::vec3& color, Chunk& chunk) const {
+    glm::vec3 axis = end - start;
+    float height = glm::length(axis);
+    if (height < 0.001f) return;
+    glm::vec3 direction = axis / height;
+
+    // Sub-pixel cylinders: a quad facing the camera, lit as the side that
+    // faces it
+    float depth = glm::dot((start + end) * 0.5f - cameraPos_, forward_);
+    if (depth > kNear && radius * focalPixels_ < kThinCylinderPixels * depth) {
+        glm::vec3 toCamera = cameraPos_ - (start + end) * 0.5f;
+        glm::vec3 side = glm::cross(direction, toCamera);
+        float sideLength = glm::length(side);
+        if (sideLength < 1e-6f) return;     // Seen end on
+        side *= radius / sideLength;
+        glm::vec3 facing = glm::normalize(toCamera - direction * glm::dot(toCamera, direction));
+        glm::vec3 lit = shade(facing, color, 0.2f, 20.0f);
+        glm::vec3 colors[3] = {lit, lit, lit};
+        glm::vec3 first[3] = {start - side, start + side, end + side};
+        glm::vec3 second[3] = {start - side, end + side, end - side};
+        emitTriangle(first, colors, chunk);
+        emitTriangle(second, colors, chunk);
+        return;
+    }
+
+    // stageCylinders' eight smooth sides
+    glm::vec3 u, v;
+    cylinderBasis(direction, u, v);
+    glm::vec3 normals[kCylinderSides], colors[kCylinderSides];
+    for (int k = 0; k < kCylinderSides; ++k) {
+        float angle = (float)k / kCylinderSides * 2.0f * M_PI;
+        normals[k] = u * cos(angle) + v * sin(angle);
+        colors[k] = shade(normals[k], color, 0.2f, 20.0f);
+    }
+    for (int k = 0; k < kCylinderSides; ++k) {
+        int next = (k + 1) % kCylinderSides;
+        glm::vec3 bottom = start + normals[k] * radius;
+        glm::vec3 bottomNext = start + normals[next] * radius;
+        glm::vec3 first[3] = {bottom, bottomNext, bottom + axis};
+        glm::vec3 firstColors[3] = {colors[k], colors[next], colors[k]};
+        glm::vec3 second[3] = {bottomNext, bottomNext + axis, bottom + axis};
+        glm::vec3 secondColors[3] = {colors[next], colors[next], colors[k]};
+        emitTriangle(first, firstColors, chunk);
+        emitTriangle(second, secondColors, chunk);
+    }
+}
+
+void SoftwareRenderer::emitLeaf(const glm::vec3& position, const glm::vec3& normal, float size,
+                                const glm::vec3& color, Chunk& chunk) const {
+    // Renderer::stageLeaves' unrotated triangle
+    glm::vec3 lit = shade(normal, color, 0.1f, 10.0f);
+    glm::vec3 positions[3] = {position + glm::vec3(-size, 0.0f, 0.0f), position + glm::vec3(size, 0.0f, 0.0f),
+                              position + glm::vec3(0.0f, size * kLeafHeight, 0.0f)};
+    glm::vec3 colors[3] = {lit, lit, lit};
+    emitTriangle(positions, colors, chunk);
+}
+
+void SoftwareRenderer::emitLine(const glm::vec3& start, const glm::vec3& end, float width,
+                                const glm::vec3& color, Chunk& chunk) const {
+    glm::vec3 offsetStart = start - cameraPos_, offsetEnd = end - cameraPos_;
+    glm::vec3 a(glm::dot(offsetStart, right_), glm::dot(offsetStart, up_), glm::dot(offsetStart, forward_));
+    glm::vec3 b(glm::dot(offsetEnd, right_), glm::dot(offsetEnd, up_), glm::dot(offsetEnd, forward_));
+    if (a.z < kNear && b.z < kNear) return;
+    if (a.z < kNear) a = a + (b - a) * ((kNear - a.z) / (b.z - a.z));
+    if (b.z < kNear) b = b + (a - b) * ((kNear - b.z) / (a.z - b.z));
+
+    // Unlit, widened in screen space
+    ScreenVertex p = project(a, color), q = project(b, color);
+    float dx = q.x - p.x, dy = q.y - p.y;
+    float length = std::sqrt(dx * dx + dy * dy);
+    if (length < 1e-6f) return;
+    float nx = -dy / length * width * 0.5f, ny = dx / length * width * 0.5f;
+
+    ScreenVertex corners[4] = {p, p, q, q};
+    corners[0].x += nx; corners[0].y += ny;
+    corners[1].x -= nx; corners[1].y -= ny;
+    corners[2].x -= nx; corners[2].y -= ny;
+    corners[3].x += nx; corners[3].y += ny;
+    setupTriangle(corners[0], corners[1], corners[2], chunk);
+    setupTriangle(corners[0], corners[2], corners[3], chunk);
+}
+
+SoftwareRenderer::ScreenVertex SoftwareRenderer::project(const glm::vec3& eye, const glm::vec3& color) const {
+    // glFrustum, then the viewport with rows running downward
+    ScreenVertex vertex;
+    vertex.invW = 1.0f / eye.z;
+    vertex.x = (eye.x * projectionX_ * vertex.invW * 0.5f + 0.5f) * width_;
+    vertex.y = (0.5f - eye.y * projectionY_ * vertex.invW * 0.5f) * height_;
+    float ndcZ = (kFar + kNear) / (kFar - kNear) - 2.0f * kFar * kNear / (kFar - kNear) * vertex.invW;
+    vertex.z = ndcZ * 0.5f + 0.5f;
+    vertex.color = color;
+    return vertex;
+}
+
+void SoftwareRenderer::setupTriangle(ScreenVertex a, ScreenVertex b, ScreenVertex c, Chunk& chunk) const {
+    float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    if (!(std::fabs(area) > 1e-12f)) return;
+    if (area < 0.0f) {
+        std::swap(b, c);
+        area = -area;
+    }
+
+    // Pixels whose centers the triangle can cover, clamped to the screen
+    int minX = std::max(static_cast<int>(std::ceil(std::min({a.x, b.x, c.x}) - 0.5f)), 0);
+    int maxX = std::min(static_cast<int>(std::floor(std::max({a.x, b.x, c.x}) - 0.5f)), width_ - 1);
+    int minY = std::max(static_cast<int>(std::ceil(std::min({a.y, b.y, c.y}) - 0.5f)), 0);
+    int maxY = std::min(static_cast<int>(std::floor(std::max({a.y, b.y, c.y}) - 0.5f)), height_ - 1);
+    if (minX > maxX || minY > maxY) return;
+
+    RasterTriangle tri;
+    const ScreenVertex* vertices[3] = {&a, &b, &c};
+    tri.invArea = 1.0f / area;
+    tri.depthA = tri.depthB = tri.depthC = 0.0f;
+    for (int e = 0; e < 3; ++e) {
+        const ScreenVertex& from = *vertices[(e + 1) % 3];
+        const ScreenVertex& to = *vertices[(e + 2) % 3];
+        float edgeA = from.y - to.y;
+        float edgeB = to.x - from.x;
+
+        // Evaluated at integer coordinates for pixel centers
+        tri.edgeA[e] = edgeA;
+        tri.edgeB[e] = edgeB;
+        tri.edgeC[e] = -edgeA * from.x - edgeB * from.y + 0.5f * (edgeA + edgeB);
+        tri.edgeInclusive[e] = edgeA > 0.0f || (edgeA == 0.0f && edgeB > 0.0f);
+
+        // Depth is affine in screen space: sum of z_e * lambda_e
+        float z = vertices[e]->z * tri.invArea;
+        tri.depthA += z * tri.edgeA[e];
+        tri.depthB += z * tri.edgeB[e];
+        tri.depthC += z * tri.edgeC[e];
+        tri.invW[e] = vertices[e]->invW;
+        tri.color[e] = vertices[e]->color;
+    }
+    tri.minX = minX;
+    tri.minY = minY;
+    tri.maxX = maxX;
+    tri.maxY = maxY;
+
+    uint32_t index = static_cast<uint32_t>(chunk.triangles.size());
+    chunk.triangles.push_back(tri);
+    for (int ty = minY / kTileSize; ty <= maxY / kTileSize; ++ty) {
+        for (int tx = minX / kTileSize; tx <= maxX / kTileSize; ++tx) {
+            chunk.binTiles.push_back(static_cast<uint32_t>(ty * tilesX_ + tx));
+            chunk.binTriangles.push_back(index);
+        }
+    }
+}
@@ -1,12 +1,58 @@
-#include "Turtle.h"
+#include "turtle.h"
+#include "instancing.h"
+#include "parallel.h"
 #include <cmath>
 #include <cfloat>
 #include <glm/gtc/constants.hpp>
+#include <algorithm>
+
+static const glm::vec3 kStemColor(0.4f, 0.3f, 0.2f);  // Brown for stems
+static const glm::vec3 kLineColor(0.4f, 0.8f, 0.3f);  // 2D lines
+static const glm::vec3 kLeafColor(0.2f, 0.8f, 0.3f);  // Green
+
+// Rotations between re-orthonormalizations of the turtle frame
+static const uint32_t kOrthonormalizePeriod = 64;
+
+// Tropism bend per step, in radians per unit of tropism strength
+static const float kTropismStrength = 0.3f;
+
+// Programs shorter than this are interpreted serially; branches shorter than
+// kParallelMinBranch commands are never split off into their own task
+static const size_t kParallelMinCommands = 1 << 16;
+static const size_t kParallelMinBranch = 1 << 12;
+
+// Geometry emitted between two split-off branches of a task (or its ends),
+// followed by the branch task, if any
+struct InterpretRun {
+    size_t segmentBegin, segmentEnd;
+    size_t leafBegin, leafEnd;
+    float lowestY;
+    glm::vec3 lowestPoint;
+    
+    size_t childBegin, childEnd;    // Branch body, without its brackets
+    TurtleState childStart;
+    long child;                     // Task index; -1 = no branch follows
+};
+
+// A range of the program interpreted from a known start state into its own
+// buffers; big nested branches become tasks of the next round
+struct Turtle::InterpretTask {
+    size_t begin, end;
+    TurtleState start;
+    TurtleState finish;
+    SegmentBuffer segments;
+    LeafBuffer leaves;
+    glm::vec3 minBounds;
+    glm::vec3 maxBounds;
+    std::vector<InterpretRun> runs;
+};
 
 Turtle::Turtle() 
-        : angle_(25.0f), stepLength_(1.0f), stepWidth_(0.1f),
+        : stackDepth_(0), symbolIndex_(0), runOp_(-1), runCount_(0), runSymbol_(0), angle_(25.0f), stepLength_(1.0f), stepWidth_(0.1f),
             lengthScale_(0.9f), widthScale_(0.7f), tropism_(0.0f, -0.1f, 0.0f),
-            mode3D_(false), minBounds_(FLT_MAX), maxBounds_(-FLT_MAX),
+            mode3D_(false), threadCount_(0), mergeStraightRuns_(false), angleCos_(1.0f), angleSin_(0.0f),
+            tropismCos_(1.0f), tropismSin_(0.0f), tropismBend_(0.0f), tropismEnabled_(false),
+            version_(0), minBounds_(FLT_MAX), maxBounds_(-FLT_MAX),
             lowestPoint_(0.0f), lowestY_(FLT_MAX) {
     reset();
 }
@@ -14,13 +60,21 @@ Turtle::Turtle()
 Turtle::~Turtle() {}
 
 void Turtle::reset() {
+    float rad = glm::radians(angle_);
+    angleCos_ = std::cos(rad);
+    angleSin_ = std::sin(rad);
+    tropismEnabled_ = glm::length(tropism_) > 0.0001f;
+    tropismBend_ = kTropismStrength * glm::length(tropism_);
+    tropismCos_ = std::cos(tropismBend_);
+    tropismSin_ = std::sin(tropismBend_);
+    
     state_ = TurtleState();
-    while (!stateStack_.empty()) {
-        stateStack_.pop();
-    }
-    lines_.clear();
-    cylinders_.clear();
+    stackDepth_ = 0;
+    symbolIndex_ = 0;
+    runCount_ = 0;
+    segments_.clear();
     leaves_.clear();
+    ++version_;
     minBounds_ = glm::vec3(FLT_MAX);
     maxBounds_ = glm::vec3(-FLT_MAX);
     lowestPoint_ = state_.position;
@@ -28,175 +82,829 @@ void Turtle::reset() {
     updateBounds(state_.position);
 }
 
+void Turtle::reserve(size_t segments, size_t leaves, size_t depth) {
+    segments_.reserve(segments);
+    leaves_.reserve(leaves);
+    if (stateStack_.size() < depth) {
+        stateStack_.resize(depth);
+    }
+}
+
+void Turtle::reserveFor(const char* symbols, size_t count) {
+    size_t segments = 0;
+    size_t leaves = 0;
+    long depth = 0;
+    long maxDepth = 0;
+    for (const char* end = symbols + count; symbols != end; ++symbols) {
+        switch (*symbols) {
+            case 'F':
+            case 'G': ++segments; break;
+            case 'L': ++leaves; break;
+            case '[': maxDepth = std::max(maxDepth, ++depth); break;
+            case ']': --depth; break;
+            default: break;
+        }
+    }
+    reserve(segments, leaves, static_cast<size_t>(maxDepth));
+}
+
 void Turtle::interpret(const std::string& lsystemString) {
+    if (program_.compile(lsystemString.data(), lsystemString.size())) {
+        reinterpret();
+        return;
+    }
+    
+    // Too long to index: walk the characters directly
+    reset();
+    reserveFor(lsystemString.data(), lsystemString.size());
+    consume(lsystemString.data(), lsystemString.size());
+    flush();
+}
+
+bool Turtle::reinterpret() {
+    if (program_.empty()) return false;
+    
+    reset();
+    if (program_.size() >= kParallelMinCommands && program_.balanced && resolveThreadCount(threadCount_) > 1) {
+        interpretParallel(program_);
+        return true;
+    }
+    reserve(program_.segments, program_.leaves, program_.depth);
+    execute(program_, 0, program_.size());
+    return true;
+}
+
+// Program opcode of every byte, built at compile time: -1 for symbols
+// without a turtle action (A, X, Y and anything unknown)
+struct OpcodeTable {
+    int8_t op[256];
+};
+
+static constexpr OpcodeTable makeOpcodeTable() {
+    OpcodeTable table = {};
+    for (int c = 0; c < 256; ++c) {
+        table.op[c] = -1;
+    }
+    table.op['F'] = TurtleProgram::Forward;
+    table.op['G'] = TurtleProgram::Forward;
+    table.op['f'] = TurtleProgram::Move;
+    table.op['+'] = TurtleProgram::TurnLeft;
+    table.op['-'] = TurtleProgram::TurnRight;
+    table.op['&'] = TurtleProgram::PitchDown;
+    table.op['^'] = TurtleProgram::PitchUp;
+    table.op['\\'] = TurtleProgram::RollLeft;
+    table.op['/'] = TurtleProgram::RollRight;
+    table.op['|'] = TurtleProgram::TurnAround;
+    table.op['['] = TurtleProgram::Push;
+    table.op[']'] = TurtleProgram::Pop;
+    table.op['L'] = TurtleProgram::Leaf;
+    table.op['!'] = TurtleProgram::Thinner;
+    table.op['\''] = TurtleProgram::Thicker;
+    return table;
+}
+
+static constexpr OpcodeTable kOpcodes = makeOpcodeTable();
+
+static int opcodeOf(char symbol) {
+    return kOpcodes.op[static_cast<unsigned char>(symbol)];
+}
+
+// Length of the run of symbols with opcode `op` starting at text[i].
+// Brackets stay single so each push has one pop to jump to.
+static size_t runLength(const char* text, size_t i, size_t count, int op) {
+    size_t run = 1;
+    if (op != TurtleProgram::Push && op != TurtleProgram::Pop) {
+        while (i + run < count && opcodeOf(text[i + run]) == op) ++run;
+    }
+    return run;
+}
+
+void TurtleProgram::clear() {
+    ops.clear();
+    args.clear();
+    symbols.clear();
+    segments = 0;
+    leaves = 0;
+    depth = 0;
+    balanced = true;
+}
+
+bool TurtleProgram::compile(const char* text, size_t count) {
+    clear();
+    if (count >= UINT32_MAX) return false;
+    
+    std::vector<uint32_t> open;
+    for (size_t i = 0; i < count;) {
+        int op = opcodeOf(text[i]);
+        size_t run = runLength(text, i, count, op);
+        if (op < 0) {
+            i += run;
+            continue;
+        }
+        
+        uint32_t arg = static_cast<uint32_t>(run);
+        if (op == Push) {
+            arg = UINT32_MAX;
+            open.push_back(static_cast<uint32_t>(ops.size()));
+            depth = std::max(depth, open.size());
+        } else if (op == Pop) {
+            if (open.empty()) {
+                balanced = false;
+            } else {
+                args[open.back()] = static_cast<uint32_t>(ops.size());
+                open.pop_back();
+            }
+        } else if (op == Forward) {
+            segments += run;
+        } else if (op == Leaf) {
+            leaves += run;
+        }
+        
+        ops.push_back(static_cast<uint8_t>(op));
+        args.push_back(arg);
+        symbols.push_back(static_cast<uint32_t>(i));
+        i += run;
+    }
+    if (!open.empty()) balanced = false;
+    return true;
+}
+
+void Turtle::runTrig(uint32_t count, float& c, float& s) const {
+    // A run of turns about one axis is a single rotation by the summed angle
+    if (count == 1) {
+        c = angleCos_;
+        s = angleSin_;
+        return;
+    }
+    float rad = glm::radians(angle_) * static_cast<float>(count);
+    c = std::cos(rad);
+    s = std::sin(rad);
+}
+
+void Turtle::execute(const TurtleProgram& program, size_t begin, size_t end) {
+    if (mode3D_) {
+        if (tropismEnabled_) executeAs<true, true>(program, begin, end);
+        else executeAs<true, false>(program, begin, end);
+    } else {
+        if (tropismEnabled_) executeAs<false, true>(program, begin, end);
+        else executeAs<false, false>(program, begin, end);
+    }
+}
+
+template <bool Mode3D, bool Tropism>
+void Turtle::executeAs(const TurtleProgram& program, size_t begin, size_t end) {
+    const uint8_t* ops = program.ops.data();
+    const uint32_t* args = program.args.data();
+    const uint32_t* symbols = program.symbols.data();
+    for (size_t i = begin; i < end; ++i) {
+        symbolIndex_ = symbols[i];
+        runCommand<Mode3D, Tropism>(ops[i], args[i]);
+    }
+}
+
+template <bool Mode3D, bool Tropism>
+void Turtle::runCommand(int op, uint32_t count) {
+    float c, s;
+    switch (op) {
+        case TurtleProgram::Forward:
+            moveForwardRun<Mode3D, Tropism>(count);
+            break;
+        case TurtleProgram::Move:
+            // A straight move's bounds are those of its end points
+            state_.position += state_.direction * (stepLength_ * static_cast<float>(count));
+            updateBounds(state_.position);
+            break;
+        case TurtleProgram::TurnLeft:   runTrig(count, c, s); turnBy<Mode3D>(c, s); break;
+        case TurtleProgram::TurnRight:  runTrig(count, c, s); turnBy<Mode3D>(c, -s); break;
+        case TurtleProgram::PitchDown:  runTrig(count, c, s); pitchBy<Mode3D>(c, -s); break;
+        case TurtleProgram::PitchUp:    runTrig(count, c, s); pitchBy<Mode3D>(c, s); break;
+        case TurtleProgram::RollLeft:   runTrig(count, c, s); rollBy<Mode3D>(c, s); break;
+        case TurtleProgram::RollRight:  runTrig(count, c, s); rollBy<Mode3D>(c, -s); break;
+        case TurtleProgram::TurnAround:
+            if (count & 1) turnAround<Mode3D>();
+            break;
+        case TurtleProgram::Push:
+            pushState();
+            break;
+        case TurtleProgram::Pop:
+            popState();
+            break;
+        case TurtleProgram::Leaf:
+            for (uint32_t k = 0; k < count; ++k) {
+                drawLeaf();
+                ++symbolIndex_;
+            }
+            symbolIndex_ -= count;
+            break;
+        case TurtleProgram::Thinner:
+            scaleWidth(count == 1 ? widthScale_ : std::pow(widthScale_, static_cast<float>(count)));
+            break;
+        case TurtleProgram::Thicker:
+            scaleWidth(count == 1 ? 1.0f / widthScale_ : std::pow(widthScale_, -static_cast<float>(count)));
+            break;
+    }
+}
+
+void Turtle::interpretParallel(const TurtleProgram& program) {
+    size_t n = program.size();
+    int threads = resolveThreadCount(threadCount_);
+    size_t grain = std::max(kParallelMinBranch, n / (static_cast<size_t>(threads) * 16));
+    
+    // Round 0 walks the trunk from the current state (the skeleton pass);
+    // every branch it skipped is a task of the next round, and so on
+    std::vector<InterpretTask> tasks(1);
+    tasks[0].begin = 0;
+    tasks[0].end = n;
+    tasks[0].start = state_;
+    for (size_t roundBegin = 0; roundBegin < tasks.size();) {
+        size_t roundEnd = tasks.size();
+        parallelFor(roundEnd - roundBegin, threadCount_, [&](size_t t) {
+            interpretTask(tasks[roundBegin + t], program, grain);
+        });
+        for (size_t t = roundBegin; t < roundEnd; ++t) {
+            for (size_t r = 0; r < tasks[t].runs.size(); ++r) {
+                if (tasks[t].runs[r].child < 0) continue;
+                InterpretTask child;
+                child.begin = tasks[t].runs[r].childBegin;
+                child.end = tasks[t].runs[r].childEnd;
+                child.start = tasks[t].runs[r].childStart;
+                tasks[t].runs[r].child = static_cast<long>(tasks.size());
+                tasks.push_back(std::move(child));
+            }
+        }
+        roundBegin = roundEnd;
+    }
+    
+    // String order: each run, then the branch task that follows it
+    struct Placement {
+        const InterpretTask* task;
+        const InterpretRun* run;
+        size_t segmentOffset;
+        size_t leafOffset;
+    };
+    std::vector<Placement> order;
+    size_t segmentCount = 0, leafCount = 0;
+    std::vector<std::pair<size_t, size_t>> pending(1, std::make_pair(size_t(0), size_t(0)));  // (task, next run)
+    while (!pending.empty()) {
+        size_t t = pending.back().first;
+        size_t r = pending.back().second;
+        const InterpretTask& task = tasks[t];
+        if (r == task.runs.size()) {
+            pending.pop_back();
+            continue;
+        }
+        ++pending.back().second;
+        
+        const InterpretRun& run = task.runs[r];
+        order.push_back({&task, &run, segmentCount, leafCount});
+        segmentCount += run.segmentEnd - run.segmentBegin;
+        leafCount += run.leafEnd - run.leafBegin;
+        if (run.lowestY < lowestY_) {
+            lowestY_ = run.lowestY;
+            lowestPoint_ = run.lowestPoint;
+        }
+        if (run.child >= 0) {
+            pending.push_back(std::make_pair(static_cast<size_t>(run.child), size_t(0)));
+        }
+    }
+    
+    for (const auto& task : tasks) {
+        minBounds_ = glm::min(minBounds_, task.minBounds);
+        maxBounds_ = glm::max(maxBounds_, task.maxBounds);
+    }
+    
+    segments_.resize(segmentCount);
+    leaves_.resize(leafCount);
+    parallelFor(order.size(), threadCount_, [&](size_t i) {
+        const Placement& place = order[i];
+        const SegmentBuffer& segments = place.task->segments;
+        const LeafBuffer& leaves = place.task->leaves;
+        const InterpretRun& run = *place.run;
+        std::copy(segments.positions.begin() + 2 * run.segmentBegin, segments.positions.begin() + 2 * run.segmentEnd,
+                  segments_.positions.begin() + 2 * place.segmentOffset);
+        std::copy(segments.radii.begin() + run.segmentBegin, segments.radii.begin() + run.segmentEnd,
+                  segments_.radii.begin() + place.segmentOffset);
+        std::copy(segments.colors.begin() + run.segmentBegin, segments.colors.begin() + run.segmentEnd,
+                  segments_.colors.begin() + place.segmentOffset);
+        std::copy(segments.symbols.begin() + run.segmentBegin, segments.symbols.begin() + run.segmentEnd,
+                  segments_.symbols.begin() + place.segmentOffset);
+        std::copy(leaves.positions.begin() + run.leafBegin, leaves.positions.begin() + run.leafEnd,
+                  leaves_.positions.begin() + place.leafOffset);
+        std::copy(leaves.normals.begin() + run.leafBegin, leaves.normals.begin() + run.leafEnd,
+                  leaves_.normals.begin() + place.leafOffset);
+        std::copy(leaves.sizes.begin() + run.leafBegin, leaves.sizes.begin() + run.leafEnd,
+                  leaves_.sizes.begin() + place.leafOffset);
+        std::copy(leaves.colors.begin() + run.leafBegin, leaves.colors.begin() + run.leafEnd,
+                  leaves_.colors.begin() + place.leafOffset);
+        std::copy(leaves.symbols.begin() + run.leafBegin, leaves.symbols.begin() + run.leafEnd,
+                  leaves_.symbols.begin() + place.leafOffset);
+    });
+    
+    state_ = tasks[0].finish;
+}
+
+void Turtle::interpretTask(InterpretTask& task, const TurtleProgram& program, size_t grain) const {
+    Turtle worker;
+    copyParameters(worker);
+    worker.state_ = task.start;
+    worker.minBounds_ = glm::vec3(FLT_MAX);
+    worker.maxBounds_ = glm::vec3(-FLT_MAX);
+    
+    const uint8_t* ops = program.ops.data();
+    const uint32_t* match = program.args.data();
+    size_t runStart = task.begin;
+    auto closeRun = [&](size_t end, long child) {
+        InterpretRun run;
+        run.segmentBegin = task.runs.empty() ? 0 : task.runs.back().segmentEnd;
+        run.leafBegin = task.runs.empty() ? 0 : task.runs.back().leafEnd;
+        worker.lowestY_ = FLT_MAX;
+        worker.execute(program, runStart, end);
+        run.segmentEnd = worker.segments_.size();
+        run.leafEnd = worker.leaves_.size();
+        run.lowestY = worker.lowestY_;
+        run.lowestPoint = worker.lowestPoint_;
+        run.childBegin = end + 1;
+        run.childEnd = child < 0 ? end : match[end];
+        run.childStart = worker.state_;   // Pushing copies the state as is
+        run.child = child;
+        task.runs.push_back(run);
+    };
+    
+    // Branches too small to split can't contain big ones, so every big
+    // branch found here sits at the task's top level
+    for (size_t i = task.begin; i < task.end; ++i) {
+        if (ops[i] != TurtleProgram::Push || match[i] - i < grain) continue;
+        closeRun(i, 0);
+        i = match[i];   // The state after ']' equals the state before '['
+        runStart = i + 1;
+    }
+    closeRun(task.end, -1);
+    
+    task.finish = worker.state_;
+    task.minBounds = worker.minBounds_;
+    task.maxBounds = worker.maxBounds_;
+    std::swap(task.segments, worker.segments_);
+    std::swap(task.leaves, worker.leaves_);
+}
+
+void Turtle::copyParameters(Turtle& other) const {
+    other.angle_ = angle_;
+    other.stepLength_ = stepLength_;
+    other.stepWidth_ = stepWidth_;
+    other.lengthScale_ = lengthScale_;
+    other.widthScale_ = widthScale_;
+    other.tropism_ = tropism_;
+    other.mode3D_ = mode3D_;
+    other.mergeStraightRuns_ = mergeStraightRuns_;
+    other.angleCos_ = angleCos_;
+    other.angleSin_ = angleSin_;
+    other.tropismCos_ = tropismCos_;
+    other.tropismSin_ = tropismSin_;
+    other.tropismBend_ = tropismBend_;
+    other.tropismEnabled_ = tropismEnabled_;
+}
+
+void Turtle::interpret(LSystem& lsystem, int iterations) {
     reset();
+    program_.clear();
     
-    for (char symbol : lsystemString) {
+    // The string never exists here, so size from the closed-form prediction
+    GenerationStats stats = lsystem.predict(iterations);
+    reserve(static_cast<size_t>(std::min(stats.segments, 1e9)),
+            static_cast<size_t>(std::min(stats.leaves, 1e9)),
+            static_cast<size_t>(stats.bracketDepth));
+    lsystem.derive(iterations, *this);
+    flush();
+}
+
+void Turtle::interpret(const ModuleString& modules) {
+    reset();
+    program_.clear();
+    reserveFor(modules.symbols.data(), modules.symbols.size());
+    
+    for (size_t i = 0; i < modules.size(); ++i) {
+        char symbol = modules.symbols[i];
+        symbolIndex_ = i;
+        if (modules.paramCount(i) == 0) {
+            consume(&symbol, 1);
+            continue;
+        }
+        
+        float value = modules.paramsOf(i)[0];
+        flush();
         switch (symbol) {
-            case 'F':  // Move forward and draw
-            case 'G':  // Move forward and draw (alternative)
-                moveForward();
+            case 'F':
+            case 'G':
+                moveForward(value * stepLength_);
                 break;
-            case 'f':  // Move forward without drawing
-                state_.position += state_.direction * stepLength_;
+            case 'f':
+                state_.position += state_.direction * value * stepLength_;
                 updateBounds(state_.position);
                 break;
-            case '+':  // Turn left
-                turnLeft();
-                break;
-            case '-':  // Turn right
-                turnRight();
-                break;
-            case '&':  // Pitch down
-                pitchDown();
-                break;
-            case '^':  // Pitch up
-                pitchUp();
-                break;
-            case '\\': // Roll left
-                rollLeft();
-                break;
-            case '/':  // Roll right
-                rollRight();
-                break;
-            case '|':  // Turn around
-                turnAround();
-                break;
-            case '[':  // Push state
-                pushState();
-                break;
-            case ']':  // Pop state
-                popState();
-                break;
-            case 'L':  // Draw leaf
-                drawLeaf();
-                break;
-            case '!':  // Decrease width
-                scaleWidth(widthScale_);
-                break;
-            case '\'': // Increase width
-                scaleWidth(1.0f / widthScale_);
-                break;
-            case 'A':  // Apex (just a symbol, no action)
-            case 'X':  // Variable (no action)
-            case 'Y':  // Variable (no action)
-                break;
+            case '+':  turn(value); break;
+            case '-':  turn(-value); break;
+            case '&':  pitch(-value); break;
+            case '^':  pitch(value); break;
+            case '\\': roll(value); break;
+            case '/':  roll(-value); break;
+            case '!':  state_.width = value; break;
             default:
-                // Ignore unknown symbols
+                // Parameters of other modules don't affect the turtle
+                consume(&symbol, 1);
                 break;
         }
     }
+    flush();
 }
 
-void Turtle::moveForward() {
-    glm::vec3 startPos = state_.position;
-    
-    // Apply tropism (gravitational bending)
-    if (glm::length(tropism_) > 0.0001f) {
-        applyTropism();
-    }
-    
-    // Move forward
-    state_.position += state_.direction * state_.length * stepLength_;
-    updateBounds(state_.position);
-    
+void Turtle::consume(const char* symbols, size_t count) {
     if (mode3D_) {
-        // Create cylinder
-        Cylinder cyl;
-        cyl.start = startPos;
-        cyl.end = state_.position;
-        cyl.radius = state_.width * stepWidth_;
-        cyl.color = glm::vec3(0.4f, 0.3f, 0.2f); // Brown for stems
-        cylinders_.push_back(cyl);
+        if (tropismEnabled_) consumeAs<true, true>(symbols, count);
+        else consumeAs<true, false>(symbols, count);
     } else {
-        // Create line segment
-        LineSegment line;
-        line.start = startPos;
-        line.end = state_.position;
-        line.color = state_.color;
-        line.width = state_.width * stepWidth_;
-        lines_.push_back(line);
+        if (tropismEnabled_) consumeAs<false, true>(symbols, count);
+        else consumeAs<false, false>(symbols, count);
     }
 }
 
-void Turtle::turnLeft() {
+void Turtle::flush() {
     if (mode3D_) {
-        glm::mat3 rot = getRotationMatrix(state_.up, angle_);
-        state_.direction = rot * state_.direction;
-        state_.left = rot * state_.left;
+        if (tropismEnabled_) flushAs<true, true>();
+        else flushAs<true, false>();
     } else {
-        float rad = glm::radians(angle_);
-        float x = state_.direction.x * cos(rad) - state_.direction.y * sin(rad);
-        float y = state_.direction.x * sin(rad) + state_.direction.y * cos(rad);
-        state_.direction = glm::vec3(x, y, 0.0f);
+        if (tropismEnabled_) flushAs<false, true>();
+        else flushAs<false, false>();
+    }
+}
+
+template <bool Mode3D, bool Tropism>
+void Turtle::consumeAs(const char* symbols, size_t count) {
+    // Same runs as a compiled program of the whole string, however it is
+    // split across calls, so both walks draw the same plant
+    for (size_t i = 0; i < count;) {
+        int op = opcodeOf(symbols[i]);
+        size_t run = runLength(symbols, i, count, op);
+        bool extends = runCount_ > 0 && op == runOp_ && op != TurtleProgram::Push && op != TurtleProgram::Pop &&
+                       runCount_ <= UINT32_MAX - run;
+        if (extends) {
+            runCount_ += static_cast<uint32_t>(run);
+        } else {
+            flushAs<Mode3D, Tropism>();
+            if (op >= 0) {
+                runOp_ = op;
+                runCount_ = static_cast<uint32_t>(run);
+                runSymbol_ = symbolIndex_;
+            }
+        }
+        symbolIndex_ += run;
+        i += run;
+    }
+}
+
+template <bool Mode3D, bool Tropism>
+void Turtle::flushAs() {
+    if (runCount_ == 0) return;
+    size_t next = symbolIndex_;
+    symbolIndex_ = runSymbol_;
+    runCommand<Mode3D, Tropism>(runOp_, runCount_);
+    symbolIndex_ = next;
+    runCount_ = 0;
+}
+
+double Turtle::projectedGeometryBytes(const GenerationStats& stats) const {
+    return stats.segments * SegmentBuffer::kBytesPerSegment + stats.leaves * LeafBuffer::kBytesPerLeaf;
+}
+
+// True if every '[' in `text` is closed within it and no ']' underflows
+static bool isBracketBalanced(const std::string& text) {
+    int depth = 0;
+    for (char symbol : text) {
+        if (symbol == '[') ++depth;
+        else if (symbol == ']' && --depth < 0) return false;
+    }
+    return depth == 0;
+}
+
+bool Turtle::interpretInstanced(const LSystem& lsystem, int iterations, InstancedPlant& plant) {
+    reset();
+    plant.clear();
+    
+    // Tropism bends toward a world direction, and the 2D turns are planar,
+    // so neither commutes with rigid transforms of a subtree
+    if (!mode3D_ || glm::length(tropism_) > 0.0001f || !lsystem.isDeterministic()) {
+        return false;
+    }
+    if (!isBracketBalanced(lsystem.getAxiom())) {
+        return false;
+    }
+    for (int c = 0; c < 256; ++c) {
+        const std::string* successor = lsystem.getSuccessor(static_cast<char>(c));
+        if (successor && !isBracketBalanced(*successor)) {
+            return false;
+        }
+    }
+    
+    iterations = std::max(iterations, 0);
+    std::vector<int32_t> memo(256 * (iterations + 1), -1);
+    plant.root_ = buildPrototype(lsystem, 0, lsystem.getAxiom(), iterations, iterations, plant, memo);
+    plant.fitRootBounds();
+    
+    minBounds_ = plant.getMinBounds();
+    maxBounds_ = plant.getMaxBounds();
+    lowestPoint_ = plant.getRootPosition();
+    return true;
+}
+
+uint32_t Turtle::buildPrototype(const LSystem& lsystem, char symbol, const std::string& body,
+                                int childDepth, int iterations, InstancedPlant& plant,
+                                std::vector<int32_t>& memo) const {
+    // A fresh turtle with our parameters walks the body in the default frame
+    Turtle local;
+    local.angle_ = angle_;
+    local.stepLength_ = stepLength_;
+    local.stepWidth_ = stepWidth_;
+    local.lengthScale_ = lengthScale_;
+    local.widthScale_ = widthScale_;
+    local.tropism_ = glm::vec3(0.0f);
+    local.mode3D_ = true;
+    local.reset();
+    
+    std::vector<InstanceRef> children;
+    
+    for (char t : body) {
+        const std::string* successor = lsystem.getSuccessor(t);
+        if (!successor || childDepth < 1) {
+            // Final generation or a symbol without a rule: a plain command
+            local.consume(&t, 1);
+            continue;
+        }
+        local.flush();
+        
+        // Expand t for childDepth generations once, then reuse it
+        int32_t& slot = memo[static_cast<unsigned char>(t) * (iterations + 1) + childDepth];
+        if (slot < 0) {
+            slot = static_cast<int32_t>(buildPrototype(lsystem, t, *successor, childDepth - 1,
+                                                       iterations, plant, memo));
+        }
+        
+        InstanceRef ref;
+        ref.prototype = static_cast<uint32_t>(slot);
+        ref.transform = stateTransform(local.state_);
+        children.push_back(ref);
+        local.state_ = applyEndState(local.state_, plant.prototypes_[slot].end);
+    }
+    
+    local.flush();
+    Prototype prototype;
+    prototype.symbol = symbol;
+    prototype.depth = symbol ? childDepth + 1 : childDepth;
+    prototype.end = local.state_;
+    std::swap(prototype.cylinders, local.segments_);
+    std::swap(prototype.leaves, local.leaves_);
+    prototype.minBounds = local.minBounds_;
+    prototype.maxBounds = local.maxBounds_;
+    prototype.totalCylinders = prototype.cylinders.size();
+    prototype.totalLeaves = prototype.leaves.size();
+    
+    for (const auto& ref : children) {
+        const Prototype& child = plant.prototypes_[ref.prototype];
+        prototype.totalCylinders += child.totalCylinders;
+        prototype.totalLeaves += child.totalLeaves;
+        
+        // Grow the bounds by the child's transformed box corners
+        for (int corner = 0; corner < 8; ++corner) {
+            glm::vec3 p((corner & 1) ? child.maxBounds.x : child.minBounds.x,
+                        (corner & 2) ? child.maxBounds.y : child.minBounds.y,
+                        (corner & 4) ? child.maxBounds.z : child.minBounds.z);
+            p = ref.transform.origin + ref.transform.frame * p;
+            prototype.minBounds = glm::min(prototype.minBounds, p);
+            prototype.maxBounds = glm::max(prototype.maxBounds, p);
+        }
     }
+    prototype.children.swap(children);
+    
+    // Children are always stored before their parents
+    plant.prototypes_.push_back(std::move(prototype));
+    return static_cast<uint32_t>(plant.prototypes_.size() - 1);
+}
+
+InstanceTransform Turtle::stateTransform(const TurtleState& state) {
+    static const TurtleState start;
+    InstanceTransform transform;
+    transform.origin = state.position;
+    transform.frame = glm::mat3(state.left, state.direction, state.up) * (state.length / start.length);
+    transform.widthScale = state.width / start.width;
+    return transform;
 }
 
-void Turtle::turnRight() {
+TurtleState Turtle::applyEndState(const TurtleState& state, const TurtleState& end) {
+    static const TurtleState start;
+    glm::mat3 rotation(state.left, state.direction, state.up);
+    
+    TurtleState result = state;
+    result.position = state.position + rotation * (end.position * (state.length / start.length));
+    result.direction = rotation * end.direction;
+    result.left = rotation * end.left;
+    result.up = rotation * end.up;
+    result.length = state.length * end.length / start.length;
+    result.width = state.width * end.width / start.width;
+    return result;
+}
+
+void Turtle::moveForward(float distance) {
     if (mode3D_) {
-        glm::mat3 rot = getRotationMatrix(state_.up, -angle_);
-        state_.direction = rot * state_.direction;
-        state_.left = rot * state_.left;
+        if (tropismEnabled_) moveForward<true, true>(distance);
+        else moveForward<true, false>(distance);
     } else {
-        float rad = glm::radians(-angle_);
-        float x = state_.direction.x * cos(rad) - state_.direction.y * sin(rad);
-        float y = state_.direction.x * sin(rad) + state_.direction.y * cos(rad);
-        state_.direction = glm::vec3(x, y, 0.0f);
+        if (tropismEnabled_) moveForward<false, true>(distance);
+        else moveForward<false, false>(distance);
+    }
+}
+
+template <bool Mode3D, bool Tropism>
+void Turtle::moveForward(float distance) {
+    glm::vec3 startPos = state_.position;
+    
+    // Apply tropism (gravitational bending)
+    if (Tropism) {
+        applyTropism<Mode3D>();
+    }
+    
+    // Move forward
+    state_.position += state_.direction * distance;
+    updateBounds(state_.position);
+    
+    // Cylinder in 3D, line segment in 2D
+    segments_.push(startPos, state_.position, state_.width * stepWidth_,
+                   Mode3D ? kStemColor : kLineColor, static_cast<uint32_t>(symbolIndex_));
+}
+
+// v rotated about the unit vector `axis` (Rodrigues)
+static glm::vec3 rotateAbout(const glm::vec3& v, const glm::vec3& axis, float c, float s) {
+    return c * v + s * glm::cross(axis, v) + (1.0f - c) * glm::dot(axis, v) * axis;
+}
+
+template <bool Mode3D, bool Tropism>
+void Turtle::moveForwardRun(size_t count) {
+    float distance = state_.length * stepLength_;
+    float radius = state_.width * stepWidth_;
+    const glm::vec3& color = Mode3D ? kStemColor : kLineColor;
+    uint32_t symbol = static_cast<uint32_t>(symbolIndex_);
+    glm::vec3 start = state_.position;
+    glm::vec3 h = state_.direction;
+    
+    glm::vec3 torque = Tropism ? glm::cross(h, tropism_) : glm::vec3(0.0f);
+    float torqueLength = Tropism ? glm::length(torque) : 0.0f;
+    if (torqueLength <= 0.0001f) {
+        // No bend: every step is along the heading
+        if (mergeStraightRuns_) {
+            state_.position = start + h * (distance * static_cast<float>(count));
+            segments_.push(start, state_.position, radius, color, symbol);
+        } else {
+            for (size_t k = 0; k < count; ++k) {
+                segments_.push(start + h * (distance * static_cast<float>(k)),
+                               start + h * (distance * static_cast<float>(k + 1)),
+                               radius, color, symbol + static_cast<uint32_t>(k));
+            }
+            state_.position = start + h * (distance * static_cast<float>(count));
+        }
+        updateBounds(state_.position);   // Collinear points lie within the end points' bounds
+        return;
+    }
+    
+    // Each bend turns the heading toward the tropism about the same axis,
+    // so step k heads along h rotated by k + 1 bends. That holds until the
+    // heading would swing past the tropism; steps from there on oscillate
+    // around it and go one at a time.
+    float toTropism = std::atan2(torqueLength, glm::dot(h, tropism_));
+    size_t bent = std::min(count, static_cast<size_t>(toTropism / tropismBend_));
+    if (bent > 0) {
+        // Bending renormalizes the heading, which 2D turns don't keep unit
+        h = glm::normalize(h);
+        glm::vec3 axis = torque / torqueLength;
+        glm::vec3 side = glm::cross(axis, h);   // h turned a quarter toward the tropism
+        float c = 1.0f, s = 0.0f;
+        glm::vec3 position = start;
+        for (size_t k = 0; k < bent; ++k) {
+            float next = c * tropismCos_ - s * tropismSin_;
+            s = s * tropismCos_ + c * tropismSin_;
+            c = next;
+            glm::vec3 end = position + (c * h + s * side) * distance;
+            segments_.push(position, end, radius, color, symbol + static_cast<uint32_t>(k));
+            updateBounds(end);
+            position = end;
+        }
+        
+        state_.position = position;
+        state_.direction = glm::normalize(c * h + s * side);
+        if (Mode3D) {
+            state_.left = rotateAbout(state_.left, axis, c, s);
+            state_.up = rotateAbout(state_.up, axis, c, s);
+            countRotation();
+        }
     }
+    
+    for (size_t k = bent; k < count; ++k) {
+        symbolIndex_ = symbol + k;
+        moveForward<Mode3D, Tropism>(distance);
+    }
+    symbolIndex_ = symbol;
+}
+
+void Turtle::turn(float angleDeg) {
+    float rad = glm::radians(angleDeg);
+    if (mode3D_) turnBy<true>(std::cos(rad), std::sin(rad));
+    else turnBy<false>(std::cos(rad), std::sin(rad));
+}
+
+void Turtle::pitch(float angleDeg) {
+    float rad = glm::radians(angleDeg);
+    if (mode3D_) pitchBy<true>(std::cos(rad), std::sin(rad));
+    else pitchBy<false>(std::cos(rad), std::sin(rad));
 }
 
-void Turtle::pitchDown() {
-    glm::mat3 rot = getRotationMatrix(state_.left, -angle_);
-    state_.direction = rot * state_.direction;
-    state_.up = rot * state_.up;
+void Turtle::roll(float angleDeg) {
+    float rad = glm::radians(angleDeg);
+    if (mode3D_) rollBy<true>(std::cos(rad), std::sin(rad));
+    else rollBy<false>(std::cos(rad), std::sin(rad));
 }
 
-void Turtle::pitchUp() {
-    glm::mat3 rot = getRotationMatrix(state_.left, angle_);
-    state_.direction = rot * state_.direction;
-    state_.up = rot * state_.up;
+// In 3D the frame is right-handed and orthonormal with left = direction x up,
+// so each elementary rotation only mixes the two vectors orthogonal to its
+// axis. 2D turns rotate the direction alone within the drawing plane, which
+// leaves the frame skewed; pitch and roll there take the general path.
+template <bool Mode3D>
+void Turtle::turnBy(float c, float s) {
+    glm::vec3 h = state_.direction;
+    if (Mode3D) {
+        // About up
+        state_.direction = c * h - s * state_.left;
+        state_.left = c * state_.left + s * h;
+        countRotation();
+    } else {
+        // In the drawing plane, about +z
+        state_.direction = glm::vec3(c * h.x - s * h.y, s * h.x + c * h.y, 0.0f);
+    }
 }
 
-void Turtle::rollLeft() {
-    glm::mat3 rot = getRotationMatrix(state_.direction, angle_);
-    state_.left = rot * state_.left;
-    state_.up = rot * state_.up;
+template <bool Mode3D>
+void Turtle::pitchBy(float c, float s) {
+    // About left
+    glm::vec3 h = state_.direction;
+    if (Mode3D) {
+        state_.direction = c * h + s * state_.up;
+        state_.up = c * state_.up - s * h;
+        countRotation();
+    } else {
+        glm::vec3 axis = glm::normalize(state_.left);
+        state_.direction = rotateAbout(h, axis, c, s);
+        state_.up = rotateAbout(state_.up, axis, c, s);
+    }
 }
 
-void Turtle::rollRight() {
-    glm::mat3 rot = getRotationMatrix(state_.direction, -angle_);
-    state_.left = rot * state_.left;
-    state_.up = rot * state_.up;
+template <bool Mode3D>
+void Turtle::rollBy(float c, float s) {
+    // About direction
+    glm::vec3 l = state_.left;
+    if (Mode3D) {
+        state_.left = c * l - s * state_.up;
+        state_.up = c * state_.up + s * l;
+        countRotation();
+    } else {
+        glm::vec3 axis = glm::normalize(state_.direction);
+        state_.left = rotateAbout(l, axis, c, s);
+        state_.up = rotateAbout(state_.up, axis, c, s);
+    }
 }
 
+template <bool Mode3D>
 void Turtle::turnAround() {
-    if (mode3D_) {
-        glm::mat3 rot = getRotationMatrix(state_.up, 180.0f);
-        state_.direction = rot * state_.direction;
-        state_.left = rot * state_.left;
+    if (Mode3D) {
+        turnBy<true>(-1.0f, 0.0f);
     } else {
         state_.direction = -state_.direction;
     }
 }
 
 void Turtle::pushState() {
-    stateStack_.push(state_);
+    // Only grows if the reserved depth was too small
+    if (stackDepth_ == stateStack_.size()) {
+        stateStack_.push_back(state_);
+    } else {
+        stateStack_[stackDepth_] = state_;
+    }
+    ++stackDepth_;
 }
 
 void Turtle::popState() {
-    if (!stateStack_.empty()) {
-        state_ = stateStack_.top();
-        stateStack_.pop();
+    if (stackDepth_ > 0) {
+        state_ = stateStack_[--stackDepth_];
     }
 }
 
 void Turtle::drawLeaf() {
-    Leaf leaf;
-    leaf.position = state_.position;
-    leaf.normal = state_.direction;
-    leaf.size = state_.width * stepWidth_ * 2.0f;
-    leaf.color = glm::vec3(0.2f, 0.8f, 0.3f); // Green
-    leaves_.push_back(leaf);
+    leaves_.push(state_.position, state_.direction, state_.width * stepWidth_ * 2.0f, kLeafColor,
+                 static_cast<uint32_t>(symbolIndex_));
 }
 
 void Turtle::scaleLength(float factor) {
@@ -216,43 +924,36 @@ void Turtle::updateBounds(const glm::vec3& point) {
     }
 }
 
+template <bool Mode3D>
 void Turtle::applyTropism() {
-    // Bend the direction vector slightly toward tropism vector
-    glm::vec3 t = tropism_;
-    glm::vec3 h = state_.direction;
+    // Bend toward the tropism vector; in 3D the whole frame follows so it
+    // stays orthonormal
+    glm::vec3 torque = glm::cross(state_.direction, tropism_);
+    float torqueLength = glm::length(torque);
     
-    // Calculate torque vector
-    glm::vec3 torque = glm::cross(h, t);
-    
-    if (glm::length(torque) > 0.0001f) {
-        float alpha = 0.3f; // Tropism strength
-        glm::vec3 axis = glm::normalize(torque);
-        float angle = alpha * glm::length(t);
-        
-        glm::mat3 rot = getRotationMatrix(axis, glm::degrees(angle));
-        state_.direction = glm::normalize(rot * state_.direction);
+    if (torqueLength > 0.0001f) {
+        glm::vec3 axis = torque / torqueLength;
+        state_.direction = glm::normalize(rotateAbout(state_.direction, axis, tropismCos_, tropismSin_));
+        if (Mode3D) {
+            state_.left = rotateAbout(state_.left, axis, tropismCos_, tropismSin_);
+            state_.up = rotateAbout(state_.up, axis, tropismCos_, tropismSin_);
+            countRotation();
+        }
     }
 }
 
-glm::mat3 Turtle::getRotationMatrix(const glm::vec3& axis, float angleDeg) {
-    float rad = glm::radians(angleDeg);
-    glm::vec3 ax = glm::normalize(axis);
-    float c = cos(rad);
-    float s = sin(rad);
-    float t = 1.0f - c;
-    
-    glm::mat3 rot;
-    rot[0][0] = t * ax.x * ax.x + c;
-    rot[0][1] = t * ax.x * ax.y + s * ax.z;
-    rot[0][2] = t * ax.x * ax.z - s * ax.y;
-    
-    rot[1][0] = t * ax.x * ax.y - s * ax.z;
-    rot[1][1] = t * ax.y * ax.y + c;
-    rot[1][2] = t * ax.y * ax.z + s * ax.x;
-    
-    rot[2][0] = t * ax.x * ax.z + s * ax.y;
-    rot[2][1] = t * ax.y * ax.z - s * ax.x;
-    rot[2][2] = t * ax.z * ax.z + c;
-    
-    return rot;
+void Turtle::countRotation() {
+    // The count travels with the state through push/pop, so the frame is
+    // re-orthonormalized at the same points however the string is walked
+    if (++state_.rotations % kOrthonormalizePeriod == 0) {
+        orthonormalize();
+    }
+}
+
+void Turtle::orthonormalize() {
+    glm::vec3 h = glm::normalize(state_.direction);
+    glm::vec3 l = glm::normalize(state_.left - glm::dot(state_.left, h) * h);
+    state_.direction = h;
+    state_.left = l;
+    state_.up = glm::cross(l, h);
 }